@@ -51,6 +51,8 @@ def trustflow_dependencies():
 
     _com_github_yaml_cpp()
 
+    _com_github_facebook_zstd()
+
 def _local_openssl_openssl():
     maybe(
         native.new_local_repository,
@@ -220,3 +222,16 @@ def _com_github_yaml_cpp():
             "https://github.com/jbeder/yaml-cpp/archive/refs/tags/yaml-cpp-0.7.0.tar.gz",
         ],
     )
+
+def _com_github_facebook_zstd():
+    maybe(
+        http_archive,
+        name = "com_github_facebook_zstd",
+        sha256 = "9c4396cc829cfae319a6e2615202e82aad41372073482fce286fac78646d3ee4",
+        strip_prefix = "zstd-1.5.5",
+        build_file = "@trustflow//bazel:zstd.BUILD",
+        type = "tar.gz",
+        urls = [
+            "https://github.com/facebook/zstd/releases/download/v1.5.5/zstd-1.5.5.tar.gz",
+        ],
+    )
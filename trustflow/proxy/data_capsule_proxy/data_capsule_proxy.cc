@@ -16,11 +16,13 @@
 
 #include <filesystem>
 
+#include "cppcodec/base32_rfc4648_unpadded.hpp"
 #include "cppcodec/base64_rfc4648.hpp"
 #include "src/butil/logging.h"
 #include "src/google/protobuf/util/json_util.h"
 #include "yacl/base/exception.h"
 #include "yacl/crypto/hash/hash_utils.h"
+#include "yacl/crypto/hmac/hmac_sha256.h"
 #include "yacl/crypto/rand/rand.h"
 
 #include "trustflow/proxy/data_capsule_proxy/capsule_manager_client.h"
@@ -40,6 +42,7 @@ namespace capsule_manager = ::secretflowapis::v2::sdc::capsule_manager;
 constexpr char kTempDir[] = "/tmp";
 constexpr char kResponseContentType[] = "application/json";
 constexpr int kKeyBytes = 16;
+constexpr char kCheckpointNameDomain[] = "trustflow checkpoint name\n";
 
 std::filesystem::path GenTempDir(const std::string& path) {
   const auto path_hash = yacl::crypto::Sha256(path);
@@ -47,6 +50,29 @@ std::filesystem::path GenTempDir(const std::string& path) {
          cppcodec::base64_rfc4648::encode(path_hash);
 }
 
+// Crypto options of a job from source to dest with data_key, checkpointed
+// under checkpoint_dir if set. The checkpoint is named after all three, so
+// that a job of another source does not resume it, and a retry with a
+// rotated or corrected data key starts a journal of its own rather than
+// fail on the one of the old key.
+utils::FileCryptoOptions JobCryptoOptions(utils::FileCryptoOptions options,
+                                          const std::string& checkpoint_dir,
+                                          const std::string& source,
+                                          const std::string& dest,
+                                          yacl::ByteContainerView data_key) {
+  if (!checkpoint_dir.empty()) {
+    const auto job_hash =
+        yacl::crypto::HmacSha256(data_key)
+            .Update(kCheckpointNameDomain + source + '\n' + dest)
+            .CumulativeMac();
+    options.checkpoint_path =
+        (std::filesystem::path(checkpoint_dir) /
+         (cppcodec::base32_rfc4648_unpadded::encode(job_hash) + ".ckpt"))
+            .string();
+  }
+  return options;
+}
+
 capsule_manager::ResourceRequest GenResourceRequest(
     const secretflowapis::v2::sdc::data_capsule_proxy::CmResourceConfig&
         cm_resource_config,
@@ -108,20 +134,37 @@ void DataCapsuleProxyImpl::GetInputData(
 
     if (request->has_s3_config()) {
       std::filesystem::path download_temp_path = GenTempDir(dest_path);
-      std::filesystem::remove_all(download_temp_path);
-
       const auto& s3_config = request->s3_config();
-      DownloadFromOss(s3_config.endpoint(), s3_config.bucket(),
-                      s3_config.path(), download_temp_path,
-                      s3_config.access_key_id(), s3_config.access_key_secret(),
-                      s3_config.sts_token());
+      const auto crypto_options = JobCryptoOptions(
+          crypto_options_, checkpoint_dir_,
+          s3_config.endpoint() + '/' + s3_config.bucket() + '/' +
+              s3_config.path(),
+          dest_path, data_key);
+
+      // the checkpoint is created once the download is complete, so with a
+      // checkpoint left by a restart the downloaded files are kept
+      if (!crypto_options.checkpoint_path.empty() &&
+          std::filesystem::exists(crypto_options.checkpoint_path) &&
+          std::filesystem::exists(download_temp_path)) {
+        SPDLOG_INFO("Resuming decryption to {} from checkpoint {}", dest_path,
+                    crypto_options.checkpoint_path);
+      } else {
+        std::filesystem::remove_all(download_temp_path);
+        DownloadFromOss(s3_config.endpoint(), s3_config.bucket(),
+                        s3_config.path(), download_temp_path,
+                        s3_config.access_key_id(),
+                        s3_config.access_key_secret(), s3_config.sts_token());
+      }
 
       trustflow::proxy::utils::DecryptToDir(download_temp_path, dest_path,
-                                            data_key);
+                                            data_key, crypto_options);
       std::filesystem::remove_all(download_temp_path);
     } else if (request->has_local_fs_config()) {
-      trustflow::proxy::utils::DecryptToDir(request->local_fs_config().path(),
-                                            dest_path, data_key);
+      const std::string& src_path = request->local_fs_config().path();
+      trustflow::proxy::utils::DecryptToDir(
+          src_path, dest_path, data_key,
+          JobCryptoOptions(crypto_options_, checkpoint_dir_, src_path,
+                           dest_path, data_key));
     } else {
       YACL_THROW("Source config not found");
     }
@@ -150,8 +193,12 @@ void DataCapsuleProxyImpl::PutResultData(
 
     const std::string& src_path = request->source_config().path();
     std::vector<uint8_t> data_key;
+    // a retry gets another generated key and can't resume, so its jobs are
+    // not checkpointed
+    std::string checkpoint_dir = checkpoint_dir_;
     if (request->data_key_b64().empty()) {
       data_key = yacl::crypto::RandBytes(kKeyBytes);
+      checkpoint_dir.clear();
     } else {
       data_key = cppcodec::base64_rfc4648::decode(request->data_key_b64());
     }
@@ -160,15 +207,21 @@ void DataCapsuleProxyImpl::PutResultData(
       const auto& s3_config = request->s3_config();
       const std::filesystem::path enc_temp_path = GenTempDir(src_path);
 
-      trustflow::proxy::utils::EncryptToDir(src_path, enc_temp_path, data_key);
+      trustflow::proxy::utils::EncryptToDir(
+          src_path, enc_temp_path, data_key,
+          JobCryptoOptions(crypto_options_, checkpoint_dir, src_path,
+                           enc_temp_path, data_key));
       UploadToOss(s3_config.endpoint(), s3_config.bucket(), enc_temp_path,
                   s3_config.path(), s3_config.access_key_id(),
                   s3_config.access_key_secret(), s3_config.sts_token());
 
       std::filesystem::remove_all(enc_temp_path);
     } else if (request->has_local_fs_config()) {
+      const std::string& dest_path = request->local_fs_config().path();
       trustflow::proxy::utils::EncryptToDir(
-          src_path, request->local_fs_config().path(), data_key);
+          src_path, dest_path, data_key,
+          JobCryptoOptions(crypto_options_, checkpoint_dir, src_path,
+                           dest_path, data_key));
     } else {
       YACL_THROW("Dest config not found");
     }
@@ -16,6 +16,8 @@
 
 #include "brpc/server.h"
 
+#include "trustflow/proxy/utils/crypto_util.h"
+
 #include "secretflowapis/v2/sdc/data_capsule_proxy/data_capsule_proxy.pb.h"
 
 namespace trustflow {
@@ -28,11 +30,15 @@ class DataCapsuleProxyImpl
   explicit DataCapsuleProxyImpl(const std::string& cm_endpoint,
                                 const std::string& plat,
                                 const std::string& cert,
-                                const std::string& private_key)
+                                const std::string& private_key,
+                                const utils::FileCryptoOptions& crypto_options,
+                                const std::string& checkpoint_dir = "")
       : cm_endpoint_(cm_endpoint),
         plat_(plat),
         cert_(cert),
-        private_key_(private_key) {}
+        private_key_(private_key),
+        crypto_options_(crypto_options),
+        checkpoint_dir_(checkpoint_dir) {}
   void GetInputData(
       ::google::protobuf::RpcController* cntl_base,
       const ::secretflowapis::v2::sdc::data_capsule_proxy::GetInputDataRequest*
@@ -58,6 +64,10 @@ class DataCapsuleProxyImpl
   const std::string cert_;
   // pkcs8 private key in PEM format
   const std::string private_key_;
+  // Options of decrypting input data and encrypting result data
+  const utils::FileCryptoOptions crypto_options_;
+  // Directory of the checkpoints of the crypto jobs, empty disables them
+  const std::string checkpoint_dir_;
 };
 }  // namespace data_capsule_proxy
 }  // namespace proxy
@@ -31,6 +31,44 @@ DEFINE_string(cert_path, "app.crt", "App certificate path");
 DEFINE_string(private_key_path, "app.key", "App private key path");
 DEFINE_string(cm_endpoint, "127.0.0.1:8888", "CapsuleManager endpoint");
 DEFINE_string(cm_init_config, "", "Init tls asset to get from CapsuleManager");
+DEFINE_uint32(enc_block_bytes, 0,
+              "Encrypted data block length of result data, 0 means choosing "
+              "it from the file length");
+DEFINE_bool(enc_use_mmap, false,
+            "Whether encrypting and decrypting data through memory mappings");
+DEFINE_uint32(enc_max_parallel_files, 0,
+              "Files of a directory encrypted or decrypted at a time, 0 "
+              "means the number of cores");
+DEFINE_bool(enc_use_io_uring, false,
+            "Whether encrypting and decrypting data with io_uring file I/O");
+DEFINE_bool(enc_counter_iv, false,
+            "Whether deriving data block IVs from a random per file prefix "
+            "and the block index instead of drawing each one from the DRBG");
+DEFINE_bool(enc_integrity_index, false,
+            "Whether writing a Merkle integrity index over the data blocks "
+            "of result data");
+DEFINE_bool(enc_require_integrity_index, false,
+            "Whether rejecting input data files without an integrity index");
+DEFINE_string(enc_compression, "none",
+              "Codec compressing the data blocks of result data before "
+              "encryption, none or zstd");
+DEFINE_uint32(enc_format_version, 1,
+              "Encrypted file format version of result data, 2 packs the "
+              "data block headers and appends a block index");
+DEFINE_bool(enc_wrap_key, false,
+            "Whether encrypting each result file with a random file key "
+            "wrapped by the data key, which is rotated by rewrapping it");
+DEFINE_bool(enc_derive_key, false,
+            "Whether encrypting each result file with a key derived from the "
+            "data key and a random per file salt");
+DEFINE_string(enc_cipher_suite, "auto",
+              "AEAD of the data blocks of result data, aes-gcm, "
+              "chacha20-poly1305, sm4-gcm or auto, which picks aes-gcm on "
+              "CPUs with AES instructions and chacha20-poly1305 elsewhere");
+DEFINE_string(enc_checkpoint_dir, "",
+              "Directory of the progress checkpoints of input decryption and "
+              "result encryption, which resume after a restart, empty "
+              "disables them");
 
 // log config
 DEFINE_string(log_path, "data_capsule_proxy.log", "App log path");
@@ -109,9 +147,28 @@ int main(int argc, char* argv[]) {
 
     brpc::Server server;
 
+    trustflow::proxy::utils::FileCryptoOptions crypto_options;
+    crypto_options.block_bytes = FLAGS_enc_block_bytes;
+    crypto_options.use_mmap = FLAGS_enc_use_mmap;
+    crypto_options.max_parallel_files = FLAGS_enc_max_parallel_files;
+    crypto_options.use_io_uring = FLAGS_enc_use_io_uring;
+    crypto_options.integrity_index = FLAGS_enc_integrity_index;
+    crypto_options.require_integrity_index = FLAGS_enc_require_integrity_index;
+    crypto_options.compression =
+        trustflow::proxy::utils::CompressionFromName(FLAGS_enc_compression);
+    crypto_options.format_version = FLAGS_enc_format_version;
+    crypto_options.wrap_key = FLAGS_enc_wrap_key;
+    crypto_options.derive_key = FLAGS_enc_derive_key;
+    crypto_options.cipher_suite =
+        trustflow::proxy::utils::CipherSuiteFromName(FLAGS_enc_cipher_suite);
+    crypto_options.iv_mode = FLAGS_enc_counter_iv
+                                 ? trustflow::proxy::utils::IvMode::kCounter
+                                 : trustflow::proxy::utils::IvMode::kRandom;
+
     trustflow::proxy::data_capsule_proxy::DataCapsuleProxyImpl
         data_capsule_proxy_impl(FLAGS_cm_endpoint, FLAGS_plat, cert,
-                                private_key);
+                                private_key, crypto_options,
+                                FLAGS_enc_checkpoint_dir);
 
     if (server.AddService(&data_capsule_proxy_impl,
                           brpc::SERVER_DOESNT_OWN_SERVICE) != 0) {
@@ -0,0 +1,256 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trustflow/proxy/utils/checkpoint.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <system_error>
+#include <vector>
+
+#include "openssl/crypto.h"
+#include "spdlog/spdlog.h"
+#include "yacl/base/exception.h"
+#include "yacl/crypto/hmac/hmac_sha256.h"
+#include "yacl/crypto/rand/rand.h"
+
+#include "trustflow/proxy/utils/data_block_cipher.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+namespace {
+
+// Journal:
+//  Magic: 8 bytes
+//  Salt: 16 bytes, random per journal
+//  Job tag: 32 bytes, HMAC of the job id
+// followed by records of
+//  Payload length: 4 bytes
+//  Payload: source size, source mtime, blocks and destination length of
+//  8 bytes each, then the file name
+//  Record tag: the first 16 bytes of the HMAC of the payload
+// The HMACs are HMAC-SHA256 under a key derived by HKDF-SHA256 from the
+// data key and the salt, with a leading domain byte, so neither the job
+// tag nor the records can be made or checked without the data key.
+constexpr char kMagic[] = "TFCKPT02";
+constexpr size_t kMagicBytes = sizeof(kMagic) - 1;
+constexpr size_t kSaltBytes = 16;
+constexpr size_t kJobTagBytes = 32;
+constexpr size_t kJournalHeaderBytes = kMagicBytes + kSaltBytes + kJobTagBytes;
+constexpr size_t kPayloadLenBytes = sizeof(uint32_t);
+constexpr size_t kPayloadFixedBytes = 4 * sizeof(uint64_t);
+constexpr size_t kRecordTagBytes = 16;
+// HKDF info of the MAC key
+constexpr char kMacKeyInfo[] = "trustflow checkpoint mac key";
+constexpr size_t kMacKeyBytes = 32;
+constexpr uint8_t kJobTagDomain = 0;
+constexpr uint8_t kRecordTagDomain = 1;
+
+template <typename T>
+void AppendInt(std::vector<uint8_t>* buf, T value) {
+  const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+  buf->insert(buf->end(), bytes, bytes + sizeof(value));
+}
+
+template <typename T>
+T ReadInt(const uint8_t* ptr) {
+  T value;
+  std::memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+std::vector<uint8_t> Tag(yacl::ByteContainerView mac_key, uint8_t domain,
+                         yacl::ByteContainerView data) {
+  return yacl::crypto::HmacSha256(mac_key)
+      .Update(yacl::ByteContainerView(&domain, 1))
+      .Update(data)
+      .CumulativeMac();
+}
+
+std::vector<uint8_t> EncodeRecord(yacl::ByteContainerView mac_key,
+                                  const std::string& name,
+                                  const FileStamp& src, uint64_t blocks,
+                                  uint64_t dest_len) {
+  std::vector<uint8_t> payload;
+  AppendInt(&payload, src.size);
+  AppendInt(&payload, src.mtime_ns);
+  AppendInt(&payload, blocks);
+  AppendInt(&payload, dest_len);
+  payload.insert(payload.end(), name.begin(), name.end());
+
+  std::vector<uint8_t> record;
+  AppendInt(&record, static_cast<uint32_t>(payload.size()));
+  record.insert(record.end(), payload.begin(), payload.end());
+  const auto tag = Tag(mac_key, kRecordTagDomain, payload);
+  record.insert(record.end(), tag.begin(), tag.begin() + kRecordTagBytes);
+  return record;
+}
+
+}  // namespace
+
+FileStamp FileStamp::Of(const std::string& path) {
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0) {
+    YACL_THROW_IO_ERROR("Failed to stat {}: {}", path,
+                        std::system_category().message(errno));
+  }
+  FileStamp stamp;
+  stamp.size = st.st_size;
+  stamp.mtime_ns =
+      static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  return stamp;
+}
+
+Checkpoint::Checkpoint(const std::string& path, const std::string& job_id,
+                       yacl::ByteContainerView data_key)
+    : path_(path) {
+  Load(job_id, data_key);
+}
+
+void Checkpoint::Load(const std::string& job_id,
+                      yacl::ByteContainerView data_key) {
+  std::string journal;
+  if (std::filesystem::exists(path_)) {
+    journal = ReadFile(path_);
+  }
+  const auto* ptr = reinterpret_cast<const uint8_t*>(journal.data());
+  std::vector<uint8_t> salt;
+  if (journal.empty()) {
+    salt = yacl::crypto::RandBytes(kSaltBytes);
+  } else {
+    // never overwrite the journal of another job, which may still resume
+    YACL_ENFORCE(journal.size() >= kJournalHeaderBytes &&
+                     journal.compare(0, kMagicBytes, kMagic) == 0,
+                 "{} is not a checkpoint journal, remove it to start over",
+                 path_);
+    salt.assign(ptr + kMagicBytes, ptr + kMagicBytes + kSaltBytes);
+  }
+  mac_key_ = HkdfSha256(data_key, salt, kMacKeyInfo, kMacKeyBytes);
+  const auto job_tag = Tag(mac_key_, kJobTagDomain, job_id);
+
+  if (!journal.empty()) {
+    YACL_ENFORCE(CRYPTO_memcmp(job_tag.data(),
+                               ptr + kMagicBytes + kSaltBytes,
+                               kJobTagBytes) == 0,
+                 "Checkpoint {} belongs to another job or data key, remove "
+                 "it to start over",
+                 path_);
+    size_t offset = kJournalHeaderBytes;
+    while (journal.size() - offset >= kPayloadLenBytes) {
+      const auto payload_len = ReadInt<uint32_t>(ptr + offset);
+      if (payload_len < kPayloadFixedBytes ||
+          journal.size() - offset - kPayloadLenBytes <
+              payload_len + kRecordTagBytes) {
+        break;
+      }
+      yacl::ByteContainerView payload(ptr + offset + kPayloadLenBytes,
+                                      payload_len);
+      const auto tag = Tag(mac_key_, kRecordTagDomain, payload);
+      if (CRYPTO_memcmp(tag.data(), payload.data() + payload_len,
+                        kRecordTagBytes) != 0) {
+        break;
+      }
+      Entry entry;
+      entry.src.size = ReadInt<uint64_t>(payload.data());
+      entry.src.mtime_ns = ReadInt<int64_t>(payload.data() + 8);
+      entry.blocks = ReadInt<uint64_t>(payload.data() + 16);
+      entry.dest_len = ReadInt<uint64_t>(payload.data() + 24);
+      entries_[std::string(payload.begin() + kPayloadFixedBytes,
+                           payload.end())] = entry;
+      offset += kPayloadLenBytes + payload_len + kRecordTagBytes;
+    }
+    SPDLOG_INFO("Loaded {} file records from checkpoint {}", entries_.size(),
+                path_);
+  }
+
+  // compact into a new journal, which replaces the old one atomically
+  std::vector<uint8_t> compacted(kMagic, kMagic + kMagicBytes);
+  compacted.insert(compacted.end(), salt.begin(), salt.end());
+  compacted.insert(compacted.end(), job_tag.begin(), job_tag.end());
+  for (const auto& [name, entry] : entries_) {
+    auto record = EncodeRecord(mac_key_, name, entry.src, entry.blocks,
+                               entry.dest_len);
+    compacted.insert(compacted.end(), record.begin(), record.end());
+  }
+  const auto parent = std::filesystem::path(path_).parent_path();
+  if (!parent.empty()) {
+    std::filesystem::create_directories(parent);
+  }
+  const std::string tmp_path = path_ + ".tmp";
+  {
+    PosixFile tmp(tmp_path, O_WRONLY | O_CREAT | O_TRUNC);
+    tmp.WriteAt(0, compacted);
+    tmp.Sync();
+    tmp.Close();
+  }
+  if (std::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+    YACL_THROW_IO_ERROR("Failed to rename {} to {}: {}", tmp_path, path_,
+                        std::system_category().message(errno));
+  }
+  journal_ = std::make_unique<PosixFile>(path_, O_WRONLY);
+  journal_len_ = compacted.size();
+}
+
+uint64_t Checkpoint::DoneBlocks(const std::string& name, const FileStamp& src,
+                                const std::string& dest_path) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(name);
+  if (it == entries_.end() || !(it->second.src == src)) {
+    return 0;
+  }
+  std::error_code ec;
+  const uint64_t dest_len = std::filesystem::file_size(dest_path, ec);
+  if (ec) {
+    return 0;
+  }
+  const auto& entry = it->second;
+  if (entry.blocks == kFileDone ? dest_len != entry.dest_len
+                                : dest_len < entry.dest_len) {
+    return 0;
+  }
+  return entry.blocks;
+}
+
+void Checkpoint::Record(const std::string& name, const FileStamp& src,
+                        uint64_t blocks, uint64_t dest_len) {
+  const auto record = EncodeRecord(mac_key_, name, src, blocks, dest_len);
+  std::lock_guard<std::mutex> lock(mutex_);
+  YACL_ENFORCE(journal_ != nullptr, "Checkpoint {} is removed", path_);
+  journal_->WriteAt(journal_len_, record);
+  journal_->Sync();
+  journal_len_ += record.size();
+  entries_[name] = Entry{src, blocks, dest_len};
+}
+
+void Checkpoint::Remove() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (journal_ != nullptr) {
+    journal_->Close();
+    journal_.reset();
+  }
+  std::filesystem::remove(path_);
+  entries_.clear();
+}
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
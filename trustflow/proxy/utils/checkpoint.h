@@ -0,0 +1,101 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "yacl/base/byte_container_view.h"
+
+#include "trustflow/proxy/utils/io_util.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+// Size and modification time of a source file, progress recorded for a
+// file only applies while its stamp is unchanged
+struct FileStamp {
+  uint64_t size = 0;
+  int64_t mtime_ns = 0;
+
+  static FileStamp Of(const std::string& path);
+
+  bool operator==(const FileStamp& other) const {
+    return size == other.size && mtime_ns == other.mtime_ns;
+  }
+};
+
+// Append only journal of the progress of an encryption or decryption job,
+// which lets a rerun after a crash skip the finished files and resume the
+// others after their last durable data block.
+// Each record is appended with a single write and synced, a torn record at
+// the end of the journal is ignored when loading. Thread safe.
+class Checkpoint {
+ public:
+  // Number of blocks of a finished file
+  static constexpr uint64_t kFileDone = std::numeric_limits<uint64_t>::max();
+
+  // Open or create the journal at path, compacted to the latest record of
+  // each file
+  // Throw if the journal was written for another job_id or data_key, rather
+  // than discard the progress of that job. Records are authenticated with a
+  // key derived from data_key, the ones that fail are dropped.
+  Checkpoint(const std::string& path, const std::string& job_id,
+             yacl::ByteContainerView data_key);
+
+  Checkpoint(const Checkpoint&) = delete;
+  Checkpoint& operator=(const Checkpoint&) = delete;
+
+  // Number of leading data blocks of file name that are durable in
+  // dest_path, kFileDone if the file is finished
+  // Return 0 if nothing is recorded, the source stamp differs from src or
+  // dest_path is shorter than recorded.
+  uint64_t DoneBlocks(const std::string& name, const FileStamp& src,
+                      const std::string& dest_path) const;
+
+  // Record that the first blocks data blocks of file name are durable in
+  // its destination, which is dest_len bytes long by now
+  void Record(const std::string& name, const FileStamp& src, uint64_t blocks,
+              uint64_t dest_len);
+
+  // Delete the journal once the job is done
+  void Remove();
+
+ private:
+  struct Entry {
+    FileStamp src;
+    uint64_t blocks = 0;
+    uint64_t dest_len = 0;
+  };
+
+  void Load(const std::string& job_id, yacl::ByteContainerView data_key);
+
+  std::string path_;
+  std::vector<uint8_t> mac_key_;
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::unique_ptr<PosixFile> journal_;
+  uint64_t journal_len_ = 0;
+};
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
@@ -0,0 +1,151 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trustflow/proxy/utils/checkpoint.h"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "trustflow/proxy/utils/io_util.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+namespace {
+
+constexpr char kJobId[] = "encrypt\n/src\n/dest";
+
+class CheckpointTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    dir_ = std::filesystem::path(::testing::TempDir()) / "checkpoint_test" /
+           ::testing::UnitTest::GetInstance()->current_test_info()->name();
+    std::filesystem::remove_all(dir_);
+    std::filesystem::create_directories(dir_);
+    journal_path_ = dir_ / "job.ckpt";
+    src_path_ = dir_ / "src";
+    dest_path_ = dir_ / "dest";
+    WriteFile(src_path_, std::string(1000, 's'));
+    WriteFile(dest_path_, std::string(500, 'd'));
+  }
+
+  void TearDown() override { std::filesystem::remove_all(dir_); }
+
+  std::filesystem::path dir_;
+  std::string journal_path_;
+  std::string src_path_;
+  std::string dest_path_;
+  const std::vector<uint8_t> data_key_ = std::vector<uint8_t>(16, 0x11);
+};
+
+TEST_F(CheckpointTest, RecordsSurviveReload) {
+  const auto src = FileStamp::Of(src_path_);
+  {
+    Checkpoint checkpoint(journal_path_, kJobId, data_key_);
+    EXPECT_EQ(checkpoint.DoneBlocks("a", src, dest_path_), 0u);
+    checkpoint.Record("a", src, 2, 300);
+    checkpoint.Record("a", src, 3, 400);
+    checkpoint.Record("b", src, Checkpoint::kFileDone, 500);
+  }
+  Checkpoint checkpoint(journal_path_, kJobId, data_key_);
+  EXPECT_EQ(checkpoint.DoneBlocks("a", src, dest_path_), 3u);
+  EXPECT_EQ(checkpoint.DoneBlocks("b", src, dest_path_),
+            Checkpoint::kFileDone);
+  EXPECT_EQ(checkpoint.DoneBlocks("c", src, dest_path_), 0u);
+
+  checkpoint.Remove();
+  EXPECT_FALSE(std::filesystem::exists(journal_path_));
+}
+
+TEST_F(CheckpointTest, ChangedSourceOrDestinationIsRedone) {
+  const auto src = FileStamp::Of(src_path_);
+  Checkpoint checkpoint(journal_path_, kJobId, data_key_);
+  checkpoint.Record("a", src, 3, 400);
+  checkpoint.Record("b", src, Checkpoint::kFileDone, 500);
+
+  FileStamp changed = src;
+  ++changed.size;
+  EXPECT_EQ(checkpoint.DoneBlocks("a", changed, dest_path_), 0u);
+  changed = src;
+  ++changed.mtime_ns;
+  EXPECT_EQ(checkpoint.DoneBlocks("b", changed, dest_path_), 0u);
+
+  // a partial file may have grown since, a finished one must be unchanged
+  WriteFile(dest_path_, std::string(600, 'd'));
+  EXPECT_EQ(checkpoint.DoneBlocks("a", src, dest_path_), 3u);
+  EXPECT_EQ(checkpoint.DoneBlocks("b", src, dest_path_), 0u);
+  WriteFile(dest_path_, std::string(399, 'd'));
+  EXPECT_EQ(checkpoint.DoneBlocks("a", src, dest_path_), 0u);
+  std::filesystem::remove(dest_path_);
+  EXPECT_EQ(checkpoint.DoneBlocks("a", src, dest_path_), 0u);
+}
+
+TEST_F(CheckpointTest, DropsRecordWithBadTag) {
+  const auto src = FileStamp::Of(src_path_);
+  {
+    Checkpoint checkpoint(journal_path_, kJobId, data_key_);
+    checkpoint.Record("a", src, 3, 400);
+    checkpoint.Record("b", src, 2, 300);
+  }
+  std::string journal = ReadFile(journal_path_);
+  journal.back() ^= 1;
+  WriteFile(journal_path_, journal);
+
+  Checkpoint checkpoint(journal_path_, kJobId, data_key_);
+  EXPECT_EQ(checkpoint.DoneBlocks("a", src, dest_path_), 3u);
+  EXPECT_EQ(checkpoint.DoneBlocks("b", src, dest_path_), 0u);
+}
+
+TEST_F(CheckpointTest, DropsTornRecord) {
+  const auto src = FileStamp::Of(src_path_);
+  {
+    Checkpoint checkpoint(journal_path_, kJobId, data_key_);
+    checkpoint.Record("a", src, 3, 400);
+    checkpoint.Record("b", src, 2, 300);
+  }
+  const std::string journal = ReadFile(journal_path_);
+  WriteFile(journal_path_, journal.substr(0, journal.size() - 5));
+
+  Checkpoint checkpoint(journal_path_, kJobId, data_key_);
+  EXPECT_EQ(checkpoint.DoneBlocks("a", src, dest_path_), 3u);
+  EXPECT_EQ(checkpoint.DoneBlocks("b", src, dest_path_), 0u);
+}
+
+TEST_F(CheckpointTest, RejectsAnotherJobOrKey) {
+  const auto src = FileStamp::Of(src_path_);
+  {
+    Checkpoint checkpoint(journal_path_, kJobId, data_key_);
+    checkpoint.Record("a", src, 3, 400);
+  }
+  const std::string journal = ReadFile(journal_path_);
+  EXPECT_ANY_THROW(
+      Checkpoint(journal_path_, "encrypt\n/src\n/other", data_key_));
+  EXPECT_ANY_THROW(
+      Checkpoint(journal_path_, kJobId, std::vector<uint8_t>(16, 0x22)));
+  // the journal is kept for its own job
+  EXPECT_EQ(ReadFile(journal_path_), journal);
+
+  WriteFile(journal_path_, "not a journal");
+  EXPECT_ANY_THROW(Checkpoint(journal_path_, kJobId, data_key_));
+}
+
+}  // namespace
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
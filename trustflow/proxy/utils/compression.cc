@@ -0,0 +1,91 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trustflow/proxy/utils/compression.h"
+
+#include <cstring>
+
+#include "yacl/base/exception.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+Compression CompressionFromName(const std::string& name) {
+  if (name.empty() || name == "none") {
+    return Compression::kNone;
+  }
+  if (name == "zstd") {
+    return Compression::kZstd;
+  }
+  YACL_THROW("Unsupported compression {}", name);
+}
+
+BlockCompressor::BlockCompressor(Compression compression)
+    : compression_(compression), ctx_(ZSTD_createCCtx(), ZSTD_freeCCtx) {
+  YACL_ENFORCE(compression_ == Compression::kZstd,
+               "Unsupported compression {}", static_cast<int>(compression_));
+  YACL_ENFORCE(ctx_ != nullptr, "ZSTD_createCCtx failed");
+}
+
+yacl::ByteContainerView BlockCompressor::Compress(
+    yacl::ByteContainerView raw_data) {
+  buf_.resize(kBlockCodecBytes + ZSTD_compressBound(raw_data.size()));
+  buf_[0] = static_cast<uint8_t>(compression_);
+  const size_t len =
+      ZSTD_compressCCtx(ctx_.get(), buf_.data() + kBlockCodecBytes,
+                        buf_.size() - kBlockCodecBytes, raw_data.data(),
+                        raw_data.size(), ZSTD_CLEVEL_DEFAULT);
+  YACL_ENFORCE(!ZSTD_isError(len), "Compression failed: {}",
+               ZSTD_getErrorName(len));
+  if (kBlockCodecBytes + len >= raw_data.size()) {
+    return {};
+  }
+  return yacl::ByteContainerView(buf_.data(), kBlockCodecBytes + len);
+}
+
+BlockDecompressor::BlockDecompressor()
+    : ctx_(ZSTD_createDCtx(), ZSTD_freeDCtx) {
+  YACL_ENFORCE(ctx_ != nullptr, "ZSTD_createDCtx failed");
+}
+
+absl::Span<uint8_t> BlockDecompressor::Buffer(size_t len) {
+  buf_.resize(len);
+  return absl::MakeSpan(buf_);
+}
+
+void BlockDecompressor::Decompress(yacl::ByteContainerView plaintext,
+                                   absl::Span<uint8_t> raw_data) {
+  YACL_ENFORCE_GE(plaintext.size(), kBlockCodecBytes,
+                  "Data block format is not correct");
+  const auto codec = static_cast<Compression>(plaintext[0]);
+  const auto data = plaintext.subspan(kBlockCodecBytes);
+  if (codec == Compression::kNone) {
+    YACL_ENFORCE_EQ(data.size(), raw_data.size(), "Raw data size mismatch");
+    std::memcpy(raw_data.data(), data.data(), data.size());
+    return;
+  }
+  YACL_ENFORCE(codec == Compression::kZstd, "Unsupported compression {}",
+               static_cast<int>(codec));
+  const size_t len = ZSTD_decompressDCtx(ctx_.get(), raw_data.data(),
+                                         raw_data.size(), data.data(),
+                                         data.size());
+  YACL_ENFORCE(!ZSTD_isError(len), "Decompression failed: {}",
+               ZSTD_getErrorName(len));
+  YACL_ENFORCE_EQ(len, raw_data.size(), "Raw data size mismatch");
+}
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
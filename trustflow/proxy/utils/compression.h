@@ -0,0 +1,87 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/types/span.h"
+#include "yacl/base/byte_container_view.h"
+#include "zstd.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+// Codec of the raw data of data blocks, which is compressed before
+// encryption
+enum class Compression : uint8_t {
+  kNone = 0,
+  kZstd = 1,
+};
+
+// The plaintext of each data block of a compressed file starts with the
+// codec of the block, kNone if the raw data is stored as is because it
+// doesn't compress
+constexpr size_t kBlockCodecBytes = sizeof(Compression);
+
+// Parse "none" or "zstd"
+Compression CompressionFromName(const std::string& name);
+
+// Compresses the raw data of data blocks
+// Not thread safe, every thread should own its compressor.
+class BlockCompressor {
+ public:
+  explicit BlockCompressor(Compression compression);
+
+  // Compress raw_data into the block plaintext of the codec byte and the
+  // compressed data, which is valid until the next call
+  // Return an empty view if that is not shorter than raw_data.
+  yacl::ByteContainerView Compress(yacl::ByteContainerView raw_data);
+
+ private:
+  using UniqueCCtx = std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)>;
+
+  Compression compression_;
+  UniqueCCtx ctx_;
+  std::vector<uint8_t> buf_;
+};
+
+// Decompresses the plaintext of data blocks
+// Not thread safe, every thread should own its decompressor.
+class BlockDecompressor {
+ public:
+  BlockDecompressor();
+
+  // Buffer of len bytes for a block plaintext, valid until the next call
+  absl::Span<uint8_t> Buffer(size_t len);
+
+  // Decode plaintext, the codec byte and the data of a block, into
+  // raw_data, whose size is the raw data length of the block
+  void Decompress(yacl::ByteContainerView plaintext,
+                  absl::Span<uint8_t> raw_data);
+
+ private:
+  using UniqueDCtx = std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)>;
+
+  UniqueDCtx ctx_;
+  std::vector<uint8_t> buf_;
+};
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
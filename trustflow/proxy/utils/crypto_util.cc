@@ -14,14 +14,39 @@
 
 #include "trustflow/proxy/utils/crypto_util.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <filesystem>
+#include <functional>
 #include <future>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <system_error>
+#include <thread>
+#include <utility>
 
 #include "absl/strings/ascii.h"
 #include "cppcodec/base32_rfc4648_unpadded.hpp"
 #include "openssl/pem.h"
 #include "yacl/crypto/key_utils.h"
-#include "yacl/io/stream/file_io.h"
+
+#include "trustflow/proxy/utils/checkpoint.h"
+#include "trustflow/proxy/utils/compression.h"
+#include "trustflow/proxy/utils/data_block_cipher.h"
+#include "trustflow/proxy/utils/integrity_index.h"
+#include "trustflow/proxy/utils/io_backend.h"
+#include "trustflow/proxy/utils/io_util.h"
+#include "trustflow/proxy/utils/worker_pool.h"
 
 namespace trustflow {
 namespace proxy {
@@ -29,133 +54,888 @@ namespace utils {
 
 namespace {
 
-// Header:
-//  Version: 4 bytes
-//  Schema: 4 bytes
-//  Packet count: 8 bytes
-//  Block length: 4 bytes
-constexpr uint32_t kVersion = 1;
-constexpr uint32_t kSchema = 1;
-constexpr size_t kVersionBytes = sizeof(kVersion);
-constexpr size_t kSchemaBytes = sizeof(kSchema);
-
 constexpr uint32_t kBlockBytes = 0x2000;
-constexpr size_t kPacketCntBytes = sizeof(uint64_t);
-constexpr size_t kBlockLenBytes = sizeof(kBlockBytes);
-
-// Reserve 32 bytes for IV and MAC, the actual used bytes should be inferred
-// from IV length and MAC length fields.
-// Data block:
-//  IV length: 1 byte
-//  MAC length: 1 byte
-//  IV: 32 bytes
-//  MAC: 32 bytes
-
-// define next two const in crypto_util.h
-//  constexpr uint8_t kIvBytes = 12;
-//  constexpr uint8_t kMacBytes = 16;
-constexpr uint8_t kIvFieldBytes = 32;
-constexpr uint8_t kMacFieldBytes = 32;
-constexpr uint8_t kAes128KeyLen = 16;
-constexpr uint8_t kAes256KeyLen = 32;
-constexpr size_t kIvLenBytes = sizeof(kIvBytes);
-constexpr size_t kMacLenBytes = sizeof(kMacBytes);
+constexpr uint32_t kMaxBlockBytes = 0x4000000;
+// AutoBlockBytes tiers, see crypto_util_benchmark for the measurements
+constexpr uint64_t kSmallFileBytes = 0x1000000;
+constexpr uint32_t kLargeFileBlockBytes = 0x10000;
+
+// Data bytes handed between the encryption pipeline stages or claimed by a
+// decryption worker at a time, and batches in flight per encryption worker.
+// The pipeline memory is bounded by
+// num_threads * kBatchesPerWorker * kBatchBytes.
+constexpr size_t kBatchBytes = 0x80000;
+constexpr size_t kBatchesPerWorker = 2;
 
 constexpr size_t kBufSize = 4096;
 
 constexpr char kEncSuffix[] = ".enc";
 
-// Step 1: parse data block header
-// Step 2: decrypt data and return
-std::vector<uint8_t> DecryptDataBlock(yacl::ByteContainerView data_block,
-                                      yacl::ByteContainerView data_key) {
-  YACL_ENFORCE_GE(data_block.size(), kIvLenBytes,
-                  "Data block format is not correct");
-  // parse iv length
-  uint64_t offset = 0;
-  uint64_t iv_len =
-      Bytes2Int<uint64_t>(data_block.subspan(offset, kIvLenBytes));
-  offset += kIvLenBytes;
-
-  // get iv
-  YACL_ENFORCE_GE(data_block.size(), offset + kIvFieldBytes,
-                  "Data block format is not correct");
-  yacl::ByteContainerView iv = data_block.subspan(offset, iv_len);
-  offset += kIvFieldBytes;
-
-  // parse mac length
-  YACL_ENFORCE_GE(data_block.size(), offset + kMacLenBytes,
-                  "Data block format is not correct");
-  uint64_t mac_len =
-      Bytes2Int<uint64_t>(data_block.subspan(offset, kMacLenBytes));
-  offset += kMacLenBytes;
-
-  // get mac
-  YACL_ENFORCE_GE(data_block.size(), offset + kMacFieldBytes,
-                  "Data block format is not correct");
-  yacl::ByteContainerView mac = data_block.subspan(offset, mac_len);
-  offset += kMacFieldBytes;
-
-  // get data
-  yacl::ByteContainerView encrypted_data = data_block.subspan(offset);
-
-  // decrypt data
-  std::vector<uint8_t> raw_data(encrypted_data.size());
-
-  if (data_key.size() == kAes128KeyLen) {
-    yacl::crypto::Aes128GcmCrypto(data_key, iv)
-        .Decrypt(encrypted_data, "", mac, absl::Span<uint8_t>(raw_data));
-  } else if (data_key.size() == kAes256KeyLen) {
-    yacl::crypto::Aes256GcmCrypto(data_key, iv)
-        .Decrypt(encrypted_data, "", mac, absl::Span<uint8_t>(raw_data));
-  } else {
-    YACL_THROW("data_key size error got {}", data_key.size());
+// Number of data blocks in a batch of about kBatchBytes
+size_t BlocksPerBatch(uint32_t block_len) {
+  return std::max<size_t>(1, kBatchBytes / block_len);
+}
+
+size_t NumThreads(const FileCryptoOptions& options) {
+  if (options.num_threads != 0) {
+    return options.num_threads;
   }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
 
-  return raw_data;
+size_t MaxParallelFiles(const FileCryptoOptions& options) {
+  if (options.max_parallel_files != 0) {
+    return options.max_parallel_files;
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
 }
 
-void EncryptDataBlock(yacl::io::FileInputStream& in,
-                      yacl::io::FileOutputStream& out, uint32_t block_len,
-                      yacl::ByteContainerView data_key) {
-  // get iv mac data
-  std::vector<uint8_t> raw_data(block_len);
-  in.Read(&raw_data[0], raw_data.size());
-
-  auto iv = yacl::crypto::RandBytes(kIvBytes, true);
-  std::vector<uint8_t> mac(kMacBytes);
-  std::vector<uint8_t> encrypted_data(block_len);
-
-  if (data_key.size() == kAes128KeyLen) {
-    yacl::crypto::Aes128GcmCrypto(data_key, iv)
-        .Encrypt(raw_data, "", absl::Span<uint8_t>(encrypted_data),
-                 absl::Span<uint8_t>(mac));
-  } else if (data_key.size() == kAes256KeyLen) {
-    yacl::crypto::Aes256GcmCrypto(data_key, iv)
-        .Encrypt(raw_data, "", absl::Span<uint8_t>(encrypted_data),
-                 absl::Span<uint8_t>(mac));
+// FIFO queue connecting the pipeline stages, Pop returns std::nullopt once
+// the queue is closed and drained
+template <typename T>
+class BlockingQueue {
+ public:
+  void Push(T item) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(std::move(item));
+    }
+    cv_.notify_one();
+  }
+
+  std::optional<T> Pop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return closed_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return std::nullopt;
+    }
+    T item = std::move(queue_.front());
+    queue_.pop_front();
+    return item;
+  }
+
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    cv_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<T> queue_;
+  bool closed_ = false;
+};
+
+// Consecutive data blocks travelling through the encryption pipeline, the
+// raw data is read into the encrypted data part of each block and encrypted
+// in place, so a batch is written with a single write
+// Compressed blocks vary in length, each one has a slot with room for the
+// codec byte in front of its raw data and the batch is written with a
+// vectored write of the blocks.
+struct EncryptBatch {
+  explicit EncryptBatch(const EncFileLayout& layout)
+      : version(layout.version),
+        header_bytes(layout.BlockHeaderBytes()),
+        raw_data_offset(header_bytes +
+                        (layout.compression != Compression::kNone
+                             ? kBlockCodecBytes
+                             : 0)),
+        slot_len(raw_data_offset + layout.block_len - header_bytes) {
+    const size_t block_data_len = layout.block_len - header_bytes;
+    blocks.Resize(BlocksPerBatch(block_data_len) * slot_len);
+    iov.reserve(BlocksPerBatch(block_data_len));
+  }
+
+  const uint32_t version;
+  const size_t header_bytes;
+  const size_t raw_data_offset;
+  const size_t slot_len;
+  AlignedBuffer blocks;
+  size_t blocks_len = 0;
+  size_t raw_len = 0;
+  // index of the first data block in the file
+  uint64_t first_block = 0;
+  // raw data parts to read, the data blocks to write once encrypted
+  std::vector<iovec> iov;
+};
+
+// Read up to one batch of raw data at offset, at most remain_len bytes
+// Return the raw data bytes read
+uint64_t ReadBatch(IoBackend& io, const PosixFile& in, uint64_t offset,
+                   uint64_t remain_len, uint32_t block_data_len,
+                   EncryptBatch* batch) {
+  const uint64_t raw_len = std::min<uint64_t>(
+      remain_len, BlocksPerBatch(block_data_len) * block_data_len);
+  batch->iov.clear();
+  batch->blocks_len = 0;
+  batch->first_block = offset / block_data_len;
+  batch->raw_len = raw_len;
+  for (uint64_t done = 0; done < raw_len; done += block_data_len) {
+    size_t len = std::min<uint64_t>(block_data_len, raw_len - done);
+    uint8_t* slot = batch->blocks.data() +
+                    done / block_data_len * batch->slot_len;
+    batch->iov.push_back({slot + batch->raw_data_offset, len});
+  }
+  io.ReadVAt(in, offset, absl::MakeSpan(batch->iov));
+  return raw_len;
+}
+
+// Encrypt the raw data read into batch, compressing it first with a
+// compressor
+void EncryptBatchBlocks(EncryptBatch* batch, DataBlockCipher& cipher,
+                        BlockCompressor* compressor,
+                        const BlockIvSource& iv_source) {
+  const size_t block_data_len = batch->slot_len - batch->raw_data_offset;
+  uint64_t index = batch->first_block;
+  batch->iov.clear();
+  batch->blocks_len = 0;
+  for (size_t done = 0; done < batch->raw_len; done += block_data_len) {
+    const size_t len = std::min(block_data_len, batch->raw_len - done);
+    uint8_t* slot =
+        batch->blocks.data() + done / block_data_len * batch->slot_len;
+    yacl::ByteContainerView plaintext(slot + batch->raw_data_offset, len);
+    if (compressor != nullptr) {
+      plaintext = compressor->Compress(plaintext);
+      if (plaintext.empty()) {
+        // store the raw data as is behind its codec byte
+        slot[batch->header_bytes] = static_cast<uint8_t>(Compression::kNone);
+        plaintext = yacl::ByteContainerView(slot + batch->header_bytes,
+                                            kBlockCodecBytes + len);
+      }
+    }
+    auto data_block =
+        absl::MakeSpan(slot, batch->header_bytes + plaintext.size());
+    EncryptDataBlock(batch->version, plaintext, data_block, cipher, iv_source,
+                     index++);
+    batch->iov.push_back({data_block.data(), data_block.size()});
+    batch->blocks_len += data_block.size();
+  }
+}
+
+// Write the encrypted batch at out_offset of out, appending the bounds of
+// its data blocks to block_offsets if they vary in length
+void WriteBatch(IoBackend& io, const PosixFile& out, uint64_t out_offset,
+                EncryptBatch* batch, std::vector<uint64_t>* block_offsets) {
+  if (batch->raw_data_offset == batch->header_bytes) {
+    io.WriteAt(out, out_offset,
+               yacl::ByteContainerView(batch->blocks.data(),
+                                       batch->blocks_len));
+    return;
+  }
+  for (const auto& entry : batch->iov) {
+    block_offsets->push_back(block_offsets->back() + entry.iov_len);
+  }
+  io.WriteVAt(out, out_offset, absl::MakeSpan(batch->iov));
+}
+
+// Encrypt the raw data of in to the data blocks of out in layout
+// The calling thread reads batches of raw data, num_workers threads encrypt
+// them and a writer thread writes the data blocks in reading order.
+// The bounds of compressed data blocks are set in layout once written.
+void EncryptBlocks(IoBackend& io, const PosixFile& in, const PosixFile& out,
+                   EncFileLayout* layout, yacl::ByteContainerView data_key,
+                   const BlockIvSource& iv_source, size_t num_workers) {
+  const uint64_t file_len = layout->raw_len;
+  const uint32_t block_data_len =
+      layout->block_len - layout->BlockHeaderBytes();
+  const Compression compression = layout->compression;
+  uint64_t out_offset = layout->data_offset;
+  std::vector<uint64_t> block_offsets;
+  if (compression != Compression::kNone) {
+    block_offsets.reserve(layout->packet_cnt + 1);
+    block_offsets.push_back(out_offset);
+  }
+  auto make_compressor = [&] {
+    return compression != Compression::kNone
+               ? std::make_unique<BlockCompressor>(compression)
+               : nullptr;
+  };
+
+  if (num_workers <= 1) {
+    EncryptBatch batch(*layout);
+    DataBlockCipher cipher(data_key, layout->cipher_suite);
+    auto compressor = make_compressor();
+    uint64_t offset = 0;
+    while (offset < file_len) {
+      offset += ReadBatch(io, in, offset, file_len - offset, block_data_len,
+                          &batch);
+      EncryptBatchBlocks(&batch, cipher, compressor.get(), iv_source);
+      WriteBatch(io, out, out_offset, &batch, &block_offsets);
+      out_offset += batch.blocks_len;
+    }
+    layout->block_offsets = std::move(block_offsets);
+    return;
+  }
+
+  std::vector<std::unique_ptr<EncryptBatch>> batches;
+  BlockingQueue<EncryptBatch*> free_queue;
+  BlockingQueue<std::pair<EncryptBatch*, std::promise<void>>> work_queue;
+  BlockingQueue<std::pair<EncryptBatch*, std::future<void>>> write_queue;
+  for (size_t i = 0; i < num_workers * kBatchesPerWorker; ++i) {
+    batches.emplace_back(std::make_unique<EncryptBatch>(*layout));
+    free_queue.Push(batches.back().get());
+  }
+
+  std::vector<DataBlockCipher> ciphers;
+  std::vector<std::unique_ptr<BlockCompressor>> compressors;
+  for (size_t i = 0; i < num_workers; ++i) {
+    ciphers.emplace_back(data_key, layout->cipher_suite);
+    compressors.push_back(make_compressor());
+  }
+
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < num_workers; ++i) {
+    workers.emplace_back([&, &cipher = ciphers[i],
+                          compressor = compressors[i].get()] {
+      while (auto work = work_queue.Pop()) {
+        try {
+          EncryptBatchBlocks(work->first, cipher, compressor, iv_source);
+          work->second.set_value();
+        } catch (...) {
+          work->second.set_exception(std::current_exception());
+        }
+      }
+    });
+  }
+
+  // batches are written in the order they were queued, waiting for each one
+  // to be encrypted, and then recycled to the reader
+  std::exception_ptr write_error;
+  std::thread writer([&] {
+    while (auto item = write_queue.Pop()) {
+      try {
+        item->second.get();
+        WriteBatch(io, out, out_offset, item->first, &block_offsets);
+        out_offset += item->first->blocks_len;
+        free_queue.Push(item->first);
+      } catch (...) {
+        write_error = std::current_exception();
+        free_queue.Close();
+        break;
+      }
+    }
+  });
+
+  std::exception_ptr read_error;
+  try {
+    uint64_t offset = 0;
+    while (offset < file_len) {
+      auto batch = free_queue.Pop();
+      if (!batch) {
+        break;
+      }
+      offset += ReadBatch(io, in, offset, file_len - offset, block_data_len,
+                          *batch);
+
+      std::promise<void> encrypted;
+      write_queue.Push({*batch, encrypted.get_future()});
+      work_queue.Push({*batch, std::move(encrypted)});
+    }
+  } catch (...) {
+    read_error = std::current_exception();
+  }
+  work_queue.Close();
+  write_queue.Close();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  writer.join();
+
+  if (read_error) {
+    std::rethrow_exception(read_error);
+  }
+  if (write_error) {
+    std::rethrow_exception(write_error);
+  }
+  layout->block_offsets = std::move(block_offsets);
+}
+
+// Decompressor of a worker for the data blocks of layout, nullptr if they
+// are not compressed
+std::unique_ptr<BlockDecompressor> MakeDecompressor(
+    const EncFileLayout& layout) {
+  return layout.compression != Compression::kNone
+             ? std::make_unique<BlockDecompressor>()
+             : nullptr;
+}
+
+// Decrypt data blocks [begin, end) of in to their raw data offsets in out
+// with one read into the scratch buffer, decrypting in place and one
+// vectored write of the decrypted parts
+// Compressed blocks are decompressed into the buffer of decompressor, which
+// is written at once. Blocks are checked against index if the file has one.
+void DecryptBlockRange(IoBackend& io, const PosixFile& in,
+                       const PosixFile& out,
+                       const EncFileLayout& layout, uint64_t begin,
+                       uint64_t end, DataBlockCipher& cipher,
+                       BlockDecompressor* decompressor,
+                       const IntegrityIndex* index, AlignedBuffer* blocks,
+                       std::vector<iovec>* iov) {
+  const uint64_t begin_offset = layout.BlockOffset(begin);
+  blocks->Resize(layout.BlockOffset(end) - begin_offset);
+  io.ReadAt(in, begin_offset,
+            absl::MakeSpan(blocks->data(), blocks->size()));
+
+  absl::Span<uint8_t> raw_range;
+  if (decompressor != nullptr) {
+    raw_range = decompressor->Buffer(layout.RawOffset(end) -
+                                     layout.RawOffset(begin));
+  }
+  iov->clear();
+  for (uint64_t i = begin; i < end; ++i) {
+    auto data_block = absl::MakeSpan(
+        blocks->data() + layout.BlockOffset(i) - begin_offset,
+        layout.BlockOffset(i + 1) - layout.BlockOffset(i));
+    auto plaintext = data_block.subspan(layout.BlockHeaderBytes());
+    DecryptDataBlock(layout.version, data_block, cipher, plaintext);
+    if (index != nullptr) {
+      index->CheckBlock(i, BlockTag(layout.version, data_block));
+    }
+    if (decompressor != nullptr) {
+      decompressor->Decompress(
+          plaintext,
+          raw_range.subspan(layout.RawOffset(i) - layout.RawOffset(begin),
+                            layout.RawOffset(i + 1) - layout.RawOffset(i)));
+    } else {
+      iov->push_back({plaintext.data(), plaintext.size()});
+    }
+  }
+  if (decompressor != nullptr) {
+    iov->push_back({raw_range.data(), raw_range.size()});
+  }
+  io.WriteVAt(out, layout.RawOffset(begin), absl::MakeSpan(*iov));
+}
+
+// Durable progress of one file of a checkpointed job. Range workers report
+// the data blocks they have written, and the blocks written without gaps
+// from the start are recorded to the checkpoint after syncing the
+// destination, at most once per interval.
+class FileProgress {
+ public:
+  FileProgress(Checkpoint* checkpoint, std::string name, const FileStamp& src,
+               std::string dest_path, uint64_t first_block,
+               std::chrono::milliseconds interval)
+      : checkpoint_(checkpoint),
+        name_(std::move(name)),
+        src_(src),
+        dest_path_(std::move(dest_path)),
+        interval_(interval),
+        first_block_(first_block),
+        written_(first_block),
+        recorded_(first_block),
+        last_record_(std::chrono::steady_clock::now()) {}
+
+  // First data block to write, the blocks before are durable in the
+  // destination, Checkpoint::kFileDone if the file is finished
+  uint64_t first_block() const { return first_block_; }
+
+  // Write the file from its first data block again
+  void Restart() { first_block_ = written_ = recorded_ = 0; }
+
+  // Data blocks [begin, end) are written
+  void Done(uint64_t begin, uint64_t end) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.emplace(begin, end);
+    for (auto it = pending_.find(written_); it != pending_.end();
+         it = pending_.find(written_)) {
+      written_ = it->second;
+      pending_.erase(it);
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (written_ > recorded_ && now - last_record_ >= interval_) {
+      Record(written_);
+      recorded_ = written_;
+      last_record_ = now;
+    }
+  }
+
+  // All data blocks are written
+  void Finish() { Record(Checkpoint::kFileDone); }
+
+ private:
+  void Record(uint64_t blocks) {
+    PosixFile dest(dest_path_, O_RDONLY);
+    dest.Sync();
+    checkpoint_->Record(name_, src_, blocks, dest.GetLength());
+  }
+
+  Checkpoint* checkpoint_;
+  const std::string name_;
+  const FileStamp src_;
+  const std::string dest_path_;
+  const std::chrono::milliseconds interval_;
+  uint64_t first_block_;
+
+  std::mutex mutex_;
+  // written ranges after a gap, by first block
+  std::map<uint64_t, uint64_t> pending_;
+  uint64_t written_;
+  uint64_t recorded_;
+  std::chrono::steady_clock::time_point last_record_;
+};
+
+// Call a worker made by make_worker() on each range of up to
+// blocks_per_range blocks of [0, block_cnt), num_workers threads repeatedly
+// claim the next range until all blocks are done or any worker throws.
+// Each thread makes its own worker, so workers may keep scratch buffers.
+// Called from a task of pool, the helpers are pool tasks instead of
+// threads, which idle workers steal.
+// With progress, the ranges start at its first block and are reported to it
+// once written.
+template <typename MakeWorker>
+void ParallelForBlockRanges(uint64_t block_cnt, uint64_t blocks_per_range,
+                            size_t num_workers, const MakeWorker& make_worker,
+                            WorkerPool* pool, FileProgress* progress) {
+  const uint64_t first_block =
+      progress != nullptr ? progress->first_block() : 0;
+  YACL_ENFORCE_LE(first_block, block_cnt, "Resumed after the last block");
+  if (pool != nullptr && pool->InWorker()) {
+    num_workers = pool->num_threads();
+  }
+  num_workers = std::min<uint64_t>(
+      num_workers,
+      (block_cnt - first_block + blocks_per_range - 1) / blocks_per_range);
+  std::atomic<uint64_t> next_block{first_block};
+  std::atomic<bool> failed{false};
+  std::mutex error_mutex;
+  std::exception_ptr error;
+
+  auto work = [&] {
+    try {
+      auto worker = make_worker();
+      while (!failed) {
+        uint64_t begin = next_block.fetch_add(blocks_per_range);
+        if (begin >= block_cnt) {
+          break;
+        }
+        const uint64_t end = std::min(begin + blocks_per_range, block_cnt);
+        worker(begin, end);
+        if (progress != nullptr) {
+          progress->Done(begin, end);
+        }
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+      failed = true;
+    }
+  };
+
+  if (pool != nullptr && pool->InWorker()) {
+    // helpers only run work() if they start before the calling task is
+    // done with the ranges, so the calling task never waits for queued
+    // helpers, late ones return at once
+    struct Helpers {
+      std::mutex mutex;
+      std::condition_variable cv;
+      bool closed = false;
+      size_t running = 0;
+    };
+    auto helpers = std::make_shared<Helpers>();
+    for (size_t i = 1; i < num_workers; ++i) {
+      pool->Submit([helpers, &work] {
+        {
+          std::lock_guard<std::mutex> lock(helpers->mutex);
+          if (helpers->closed) {
+            return;
+          }
+          ++helpers->running;
+        }
+        work();
+        std::lock_guard<std::mutex> lock(helpers->mutex);
+        --helpers->running;
+        helpers->cv.notify_all();
+      });
+    }
+    work();
+    std::unique_lock<std::mutex> lock(helpers->mutex);
+    helpers->closed = true;
+    helpers->cv.wait(lock, [&] { return helpers->running == 0; });
   } else {
-    YACL_THROW("data_key size error got {}", data_key.size());
+    // the calling thread is one of the workers
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < num_workers; ++i) {
+      workers.emplace_back(work);
+    }
+    work();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+// Decrypt all data blocks of in to out with positional reads and writes
+void DecryptBlocks(IoBackend& io, const PosixFile& in, const PosixFile& out,
+                   const EncFileLayout& layout,
+                   yacl::ByteContainerView data_key,
+                   const IntegrityIndex* index, size_t num_workers,
+                   WorkerPool* pool, FileProgress* progress) {
+  ParallelForBlockRanges(
+      layout.packet_cnt, BlocksPerBatch(layout.block_len), num_workers,
+      [&] {
+        return [&, cipher = DataBlockCipher(data_key, layout.cipher_suite),
+                decompressor = MakeDecompressor(layout),
+                blocks = AlignedBuffer(),
+                iov = std::vector<iovec>()](uint64_t begin,
+                                            uint64_t end) mutable {
+          DecryptBlockRange(io, in, out, layout, begin, end, cipher,
+                            decompressor.get(), index, &blocks, &iov);
+        };
+      },
+      pool, progress);
+}
+
+// Check the tags of data blocks [begin, end) of in, and the blocks against
+// index if the file has one, decrypting in the scratch buffer
+// Return the blocks that fail the checks.
+std::vector<uint64_t> VerifyBlockRange(IoBackend& io, const PosixFile& in,
+                                       const EncFileLayout& layout,
+                                       uint64_t begin, uint64_t end,
+                                       DataBlockCipher& cipher,
+                                       const IntegrityIndex* index,
+                                       AlignedBuffer* blocks) {
+  const uint64_t begin_offset = layout.BlockOffset(begin);
+  blocks->Resize(layout.BlockOffset(end) - begin_offset);
+  io.ReadAt(in, begin_offset,
+            absl::MakeSpan(blocks->data(), blocks->size()));
+
+  std::vector<uint64_t> bad_blocks;
+  for (uint64_t i = begin; i < end; ++i) {
+    auto data_block = absl::MakeSpan(
+        blocks->data() + layout.BlockOffset(i) - begin_offset,
+        layout.BlockOffset(i + 1) - layout.BlockOffset(i));
+    try {
+      DecryptDataBlock(layout.version, data_block, cipher,
+                       data_block.subspan(layout.BlockHeaderBytes()));
+      if (index != nullptr) {
+        index->CheckBlock(i, BlockTag(layout.version, data_block));
+      }
+    } catch (const yacl::Exception& e) {
+      SPDLOG_WARN("Data block {} of {} is bad: {}", i, in.path(), e.what());
+      bad_blocks.push_back(i);
+    }
+  }
+  return bad_blocks;
+}
+
+// Encrypt the raw data of data blocks [begin, end) of in into out with one
+// vectored read into the encrypted data parts of the scratch buffer,
+// encrypting in place and one write
+void EncryptBlockRange(IoBackend& io, const PosixFile& in,
+                       const PosixFile& out, const EncFileLayout& layout,
+                       uint64_t begin, uint64_t end, DataBlockCipher& cipher,
+                       const BlockIvSource& iv_source, AlignedBuffer* blocks,
+                       std::vector<iovec>* iov) {
+  const uint64_t begin_offset = layout.BlockOffset(begin);
+  blocks->Resize(layout.BlockOffset(end) - begin_offset);
+  auto data_block = [&](uint64_t i) {
+    return absl::MakeSpan(blocks->data() + layout.BlockOffset(i) - begin_offset,
+                          layout.BlockOffset(i + 1) - layout.BlockOffset(i));
+  };
+
+  iov->clear();
+  for (uint64_t i = begin; i < end; ++i) {
+    auto raw_data = data_block(i).subspan(layout.BlockHeaderBytes());
+    iov->push_back({raw_data.data(), raw_data.size()});
+  }
+  io.ReadVAt(in, layout.RawOffset(begin), absl::MakeSpan(*iov));
+
+  for (uint64_t i = begin; i < end; ++i) {
+    EncryptDataBlock(layout.version,
+                     data_block(i).subspan(layout.BlockHeaderBytes()),
+                     data_block(i), cipher, iv_source, i);
+  }
+  io.WriteAt(out, begin_offset,
+             yacl::ByteContainerView(blocks->data(), blocks->size()));
+}
+
+// Encrypt all raw data of in into the data blocks of out with positional
+// reads and writes of block ranges, unlike EncryptBlocks any worker can
+// take any range, which lets idle pool workers help with large files
+void EncryptBlockRanges(IoBackend& io, const PosixFile& in,
+                        const PosixFile& out, const EncFileLayout& layout,
+                        yacl::ByteContainerView data_key,
+                        const BlockIvSource& iv_source, size_t num_workers,
+                        WorkerPool* pool, FileProgress* progress) {
+  ParallelForBlockRanges(
+      layout.packet_cnt, BlocksPerBatch(layout.block_len), num_workers,
+      [&] {
+        return [&, cipher = DataBlockCipher(data_key, layout.cipher_suite),
+                blocks = AlignedBuffer(),
+                iov = std::vector<iovec>()](uint64_t begin,
+                                            uint64_t end) mutable {
+          EncryptBlockRange(io, in, out, layout, begin, end, cipher,
+                            iv_source, &blocks, &iov);
+        };
+      },
+      pool, progress);
+}
+
+// Decrypt all data blocks from the mapped encrypted file into the mapped
+// raw data file. Each block is decrypted into a scratch buffer and only
+// copied to the mapping once its tag and index leaf are checked, so a
+// tampered block never leaves plaintext in the output.
+void DecryptMappedBlocks(const uint8_t* in, uint8_t* out,
+                         const EncFileLayout& layout,
+                         yacl::ByteContainerView data_key,
+                         const IntegrityIndex* index, size_t num_workers,
+                         WorkerPool* pool, FileProgress* progress) {
+  ParallelForBlockRanges(
+      layout.packet_cnt, BlocksPerBatch(layout.block_len), num_workers,
+      [&] {
+        return [&, cipher = DataBlockCipher(data_key, layout.cipher_suite),
+                decompressor = MakeDecompressor(layout),
+                raw = AlignedBuffer()](uint64_t begin, uint64_t end) mutable {
+          for (uint64_t i = begin; i < end; ++i) {
+            uint64_t block_offset = layout.BlockOffset(i);
+            uint64_t raw_offset = layout.RawOffset(i);
+            yacl::ByteContainerView data_block(
+                in + block_offset, layout.BlockOffset(i + 1) - block_offset);
+            raw.Resize(layout.RawOffset(i + 1) - raw_offset);
+            auto raw_data = absl::MakeSpan(raw.data(), raw.size());
+            if (decompressor != nullptr) {
+              DecryptDataBlock(layout.version, data_block, cipher,
+                               *decompressor, raw_data);
+            } else {
+              DecryptDataBlock(layout.version, data_block, cipher, raw_data);
+            }
+            if (index != nullptr) {
+              index->CheckBlock(i, BlockTag(layout.version, data_block));
+            }
+            std::memcpy(out + raw_offset, raw.data(), raw.size());
+          }
+        };
+      },
+      pool, progress);
+}
+
+// Encrypt all raw data from the mapped raw data file straight into the data
+// blocks of the mapped encrypted file
+void EncryptMappedBlocks(const uint8_t* in, uint8_t* out,
+                         const EncFileLayout& layout,
+                         yacl::ByteContainerView data_key,
+                         const BlockIvSource& iv_source, size_t num_workers,
+                         WorkerPool* pool, FileProgress* progress) {
+  ParallelForBlockRanges(
+      layout.packet_cnt, BlocksPerBatch(layout.block_len), num_workers,
+      [&] {
+        return [&, cipher = DataBlockCipher(data_key, layout.cipher_suite)](
+                   uint64_t begin, uint64_t end) mutable {
+          for (uint64_t i = begin; i < end; ++i) {
+            uint64_t block_offset = layout.BlockOffset(i);
+            uint64_t raw_offset = layout.RawOffset(i);
+            EncryptDataBlock(
+                layout.version,
+                yacl::ByteContainerView(in + raw_offset,
+                                        layout.RawOffset(i + 1) - raw_offset),
+                absl::MakeSpan(out + block_offset,
+                               layout.BlockOffset(i + 1) - block_offset),
+                cipher, iv_source, i);
+          }
+        };
+      },
+      pool, progress);
+}
+
+// Cipher suite of the data blocks written with option suite
+CipherSuite ResolveCipherSuite(CipherSuite suite) {
+  return suite == CipherSuite::kAuto ? FasterCipherSuite() : suite;
+}
+
+// Write the extension area of out, whose header and data blocks are written
+// already, with the entries of the file key, the compression and the
+// integrity index
+void WriteExtensionArea(const PosixFile& out, const EncFileLayout& layout,
+                        yacl::ByteContainerView data_key,
+                        bool integrity_index) {
+  std::vector<uint8_t> area(kExtLenBytes);
+  const auto ext_len =
+      static_cast<uint32_t>(layout.data_offset - kHeaderBytes - kExtLenBytes);
+  std::memcpy(area.data(), &ext_len, kExtLenBytes);
+  // first, see kKeyEntryOffset
+  AppendKeyExtension(layout, &area);
+  AppendCipherSuiteExtension(layout, &area);
+  if (layout.compression != Compression::kNone) {
+    AppendCompressionExtensions(layout, &area);
+  }
+  if (integrity_index) {
+    AppendIntegrityIndex(out, layout, data_key, &area);
+  }
+  YACL_ENFORCE_EQ(kHeaderBytes + area.size(), layout.data_offset,
+                  "Extension area length mismatch");
+  out.WriteAt(kHeaderBytes, area);
+}
+
+// Header of layout, followed for files with a file key or another cipher
+// suite than AES-GCM by the extension length, the key entry and the cipher
+// suite entry, which are written ahead of the data blocks so that kept data
+// blocks can be decrypted after a restart
+std::vector<uint8_t> EncodeFilePrefix(const EncFileLayout& layout) {
+  auto prefix = EncodeHeader(layout.packet_cnt, layout.block_len,
+                             layout.schema, layout.version);
+  if (KeyExtensionBytes(layout) + CipherSuiteExtensionBytes(layout) != 0) {
+    const auto ext_len = static_cast<uint32_t>(layout.data_offset -
+                                               kHeaderBytes - kExtLenBytes);
+    prefix.resize(kHeaderBytes + kExtLenBytes);
+    std::memcpy(prefix.data() + kHeaderBytes, &ext_len, kExtLenBytes);
+    AppendKeyExtension(layout, &prefix);
+    AppendCipherSuiteExtension(layout, &prefix);
+  }
+  return prefix;
+}
+
+// Value of the key entry of type and len bytes of the file at path
+std::vector<uint8_t> ReadKeyEntry(const std::string& path, uint16_t type,
+                                  uint32_t len) {
+  PosixFile file(path, O_RDONLY);
+  std::vector<uint8_t> entry(kExtEntryHeaderBytes + len);
+  file.ReadAt(kKeyEntryOffset - kExtEntryHeaderBytes, absl::MakeSpan(entry));
+  const auto view = yacl::ByteContainerView(entry);
+  YACL_ENFORCE(
+      Bytes2Int<uint16_t>(view.subspan(0, kExtTypeBytes)) == type &&
+          Bytes2Int<uint32_t>(view.subspan(kExtTypeBytes,
+                                           kExtValueLenBytes)) == len,
+      "{} has no key entry of type {}", path, type);
+  return std::vector<uint8_t>(entry.begin() + kExtEntryHeaderBytes,
+                              entry.end());
+}
+
+// Draw a random file key wrapped by data_key, if wrap, or a random salt
+// to derive one from data_key into layout, and return the file key
+// With kept data blocks of progress, the file key they are encrypted with
+// is taken from the prefix of dest_path instead, or progress restarts if
+// that fails.
+std::vector<uint8_t> NewFileKey(const std::string& dest_path,
+                                yacl::ByteContainerView data_key, bool wrap,
+                                FileProgress* progress,
+                                EncFileLayout* layout) {
+  if (progress != nullptr && progress->first_block() > 0) {
+    try {
+      if (wrap) {
+        auto wrapped_key = ReadKeyEntry(dest_path, kExtWrappedKey,
+                                        WrappedKeyBytes(data_key.size()));
+        auto file_key = UnwrapFileKey(data_key, wrapped_key);
+        layout->wrapped_key = std::move(wrapped_key);
+        return file_key;
+      }
+      layout->key_salt = ReadKeyEntry(dest_path, kExtKeySalt, kKeySaltBytes);
+      return DeriveFileKey(data_key, layout->key_salt);
+    } catch (const yacl::Exception& e) {
+      SPDLOG_WARN("No file key in {}, encrypting it from the start: {}",
+                  dest_path, e.what());
+      progress->Restart();
+    }
   }
+  if (wrap) {
+    auto file_key = yacl::crypto::RandBytes(data_key.size());
+    layout->wrapped_key = WrapFileKey(data_key, file_key);
+    return file_key;
+  }
+  layout->key_salt = yacl::crypto::RandBytes(kKeySaltBytes);
+  return DeriveFileKey(data_key, layout->key_salt);
+}
+
+// Rewrap the file key of the encrypted file at path from old_key to
+// new_key, which only reads and writes the start of the file
+void RewrapFileKey(const std::string& path, yacl::ByteContainerView old_key,
+                   yacl::ByteContainerView new_key) {
+  YACL_ENFORCE_EQ(new_key.size(), old_key.size(),
+                  "New data key length should be the old one");
+  PosixFile file(path, O_RDWR);
+  YACL_ENFORCE_GE(file.GetLength(), kKeyEntryOffset,
+                  "{} is too short for an encrypted file", path);
+  std::vector<uint8_t> prefix(kKeyEntryOffset);
+  file.ReadAt(0, absl::MakeSpan(prefix));
+  const auto view = yacl::ByteContainerView(prefix);
+  const auto entry = view.subspan(kHeaderBytes + kExtLenBytes);
+  YACL_ENFORCE(
+      Bytes2Int<uint32_t>(view.subspan(kVersionBytes, kSchemaBytes)) ==
+              kSchemaExtended &&
+          Bytes2Int<uint16_t>(entry.subspan(0, kExtTypeBytes)) ==
+              kExtWrappedKey &&
+          Bytes2Int<uint32_t>(entry.subspan(kExtTypeBytes)) ==
+              WrappedKeyBytes(old_key.size()),
+      "{} has no file key of the data key length, use ReencryptToDir", path);
 
-  // write iv
-  out.Write(&kIvBytes, kIvLenBytes);
-  out.Write(iv.data(), iv.size());
-  // padding iv
-  std::vector<uint8_t> iv_padding(kIvFieldBytes - iv.size());
-  out.Write(&iv_padding[0], iv_padding.size());
-  // write mac
-  out.Write(&kMacBytes, kMacLenBytes);
-  out.Write(mac.data(), mac.size());
-  // padding mac
-  std::vector<uint8_t> mac_padding(kMacFieldBytes - mac.size());
-  out.Write(&mac_padding[0], mac_padding.size());
-  // write encrypted data
-  out.Write(encrypted_data.data(), encrypted_data.size());
+  std::vector<uint8_t> wrapped_key(WrappedKeyBytes(old_key.size()));
+  file.ReadAt(kKeyEntryOffset, absl::MakeSpan(wrapped_key));
+  std::vector<uint8_t> file_key;
+  try {
+    file_key = UnwrapFileKey(old_key, wrapped_key);
+  } catch (const yacl::Exception&) {
+    // a rerun of an interrupted rotation finds files rewrapped already
+    UnwrapFileKey(new_key, wrapped_key);
+    SPDLOG_INFO("File key of {} is wrapped by the new key already", path);
+    return;
+  }
+  file.WriteAt(kKeyEntryOffset, WrapFileKey(new_key, file_key));
+  file.Close();
+}
+
+// Write what follows the data blocks of out once they are written, the
+// index of a version 2 file and the extension area
+void FinishEncryptedFile(const PosixFile& out, const EncFileLayout& layout,
+                         yacl::ByteContainerView data_key,
+                         bool integrity_index) {
+  if (layout.version == kVersion2) {
+    out.WriteAt(layout.BlockOffset(layout.packet_cnt),
+                EncodeBlockIndex(layout));
+  }
+  if (layout.schema == kSchemaExtended) {
+    WriteExtensionArea(out, layout, data_key, integrity_index);
+  }
+}
+
+// Encrypt src_path to dest_path through shared mappings of both files
+// Return false without encrypting if the disk space of dest_path can not be
+// reserved, as a write fault on a mapping that outgrows the disk kills the
+// process.
+bool EncryptMappedFile(const std::string& src_path,
+                       const std::string& dest_path,
+                       yacl::ByteContainerView header,
+                       const EncFileLayout& layout,
+                       yacl::ByteContainerView data_key,
+                       const BlockIvSource& iv_source, bool integrity_index,
+                       size_t num_workers, WorkerPool* pool,
+                       FileProgress* progress) {
+  PosixFile in(src_path, O_RDONLY);
+  // a resumed file keeps its written data blocks
+  const bool resumed = progress != nullptr && progress->first_block() > 0;
+  PosixFile out(dest_path, O_RDWR | O_CREAT | (resumed ? 0 : O_TRUNC));
+  const uint64_t enc_len = layout.BlockOffset(layout.packet_cnt);
+  if (!out.Allocate(enc_len)) {
+    return false;
+  }
+  {
+    MappedFile in_map(in, layout.RawOffset(layout.packet_cnt), false);
+    MappedFile out_map(out, enc_len, true);
+    std::copy(header.begin(), header.end(), out_map.data());
+    EncryptMappedBlocks(in_map.data(), out_map.data(), layout, data_key,
+                        iv_source, num_workers, pool, progress);
+  }
+  FinishEncryptedFile(out, layout, data_key, integrity_index);
+  out.Close();
+  in.Close();
+  return true;
 }
 
 }  // namespace
 
+uint32_t AutoBlockBytes(uint64_t file_len) {
+  if (file_len < kSmallFileBytes) {
+    return kBlockBytes;
+  }
+  return kLargeFileBlockBytes;
+}
+
 using UniqueBio = std::unique_ptr<BIO, decltype(&BIO_free)>;
 using UniqueX509 = std::unique_ptr<X509, decltype(&X509_free)>;
 using UniqueEVP = std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>;
@@ -190,135 +970,546 @@ std::string GeneratePartyId(const std::string& pem_cert) {
       yacl::crypto::Sha256(public_key_der));
 }
 
+namespace {
+
+// Checkpoint of a job as configured by options, nullptr if checkpoints are
+// disabled. A checkpoint only resumes the same operation between the same
+// paths with the same data key, and throws for any other job.
+std::unique_ptr<Checkpoint> OpenCheckpoint(const FileCryptoOptions& options,
+                                           const std::string& operation,
+                                           const std::string& src_path,
+                                           const std::string& dest_path,
+                                           yacl::ByteContainerView data_key) {
+  if (options.checkpoint_path.empty()) {
+    return nullptr;
+  }
+  const std::string job_id =
+      operation + '\n' + std::filesystem::absolute(src_path).string() + '\n' +
+      std::filesystem::absolute(dest_path).string();
+  return std::make_unique<Checkpoint>(options.checkpoint_path, job_id,
+                                      data_key);
+}
+
+// Progress of file name of a checkpointed job, from src_path to dest_path,
+// nullptr without checkpoint
+std::shared_ptr<FileProgress> ResumeFile(Checkpoint* checkpoint,
+                                         const std::string& name,
+                                         const std::string& src_path,
+                                         const std::string& dest_path,
+                                         const FileCryptoOptions& options) {
+  if (checkpoint == nullptr) {
+    return nullptr;
+  }
+  const auto src = FileStamp::Of(src_path);
+  const uint64_t first_block = checkpoint->DoneBlocks(name, src, dest_path);
+  if (first_block == Checkpoint::kFileDone) {
+    SPDLOG_INFO("Skipping {}, done before the restart", src_path);
+  } else if (first_block > 0) {
+    SPDLOG_INFO("Resuming {} from data block {}", src_path, first_block);
+  }
+  return std::make_shared<FileProgress>(
+      checkpoint, name, src, dest_path, first_block,
+      std::chrono::milliseconds(options.checkpoint_interval_ms));
+}
+
+bool IsFileDone(const std::shared_ptr<FileProgress>& progress) {
+  return progress != nullptr &&
+         progress->first_block() == Checkpoint::kFileDone;
+}
+
 // Decrypt a file from src_path to dest_path
 // Step 1: parse file header from src_path
-// Step 2: read data block from src_path
-// Step 3: decrypt data block
-// Step 4: write data block to src_path
-void DecryptFile(const std::string& src_path, const std::string& dest_path,
-                 yacl::ByteContainerView data_key) {
+// Step 2: preallocate dest_path to the raw data length
+// Step 3: read, decrypt and write ranges of data blocks in parallel through
+// io, on worker threads or, as a task of pool, on pool workers
+// With progress, the data blocks before its first block are kept.
+void DecryptFileWithIo(const std::string& src_path,
+                       const std::string& dest_path,
+                       yacl::ByteContainerView data_key,
+                       const FileCryptoOptions& options, IoBackend& io,
+                       WorkerPool* pool, FileProgress* progress) {
   SPDLOG_INFO("Decrypting {} to {}", src_path, dest_path);
   YACL_ENFORCE_NE(src_path, dest_path, "Inplace decryption is not allowed");
 
-  yacl::io::FileInputStream in(src_path);
-  yacl::io::FileOutputStream out(dest_path);
-
-  // parse file header
-  auto file_len = in.GetLength();
-  auto header_len =
-      kVersionBytes + kSchemaBytes + kPacketCntBytes + kBlockLenBytes;
-  YACL_ENFORCE_GT(file_len, header_len,
-                  "File length {} is less than required header length {}",
-                  file_len, header_len);
-  // skip version and schema
-  in.Seekg(kVersionBytes + kSchemaBytes);
-
-  // read packet count
-  std::vector<uint8_t> buf(kPacketCntBytes);
-  in.Read(&buf[0], buf.size());
-  uint64_t packet_cnt = Bytes2Int<uint64_t>(buf);
-  YACL_ENFORCE_GE(packet_cnt, 1u, "Packet cnt is less than 1");
-
-  // read block len
-  buf.resize(kBlockLenBytes);
-  in.Read(&buf[0], buf.size());
-  uint32_t block_len = Bytes2Int<uint32_t>(buf);
-
-  // avoid mul overflow
-  YACL_ENFORCE(block_len != 0, "block len should not be 0");
-  YACL_ENFORCE_EQ((packet_cnt - 1) * block_len / block_len, (packet_cnt - 1),
-                  "uint64 overflow in DecryptFile");
-  YACL_ENFORCE_EQ(packet_cnt * block_len / block_len, packet_cnt,
-                  "uint64 overflow in DecryptFile");
-
-  // check length
-  YACL_ENFORCE_GE(file_len - header_len, (packet_cnt - 1) * block_len,
-                  "N - 1 Data block len is more than required file length");
-  YACL_ENFORCE_GE(block_len * packet_cnt, file_len - header_len,
-                  "N Data block len is less than required file length");
-
-  // read 1 ~ (n - 1) data block
-  buf.resize(block_len);
-  for (uint64_t i = 0; i < packet_cnt - 1; ++i) {
-    in.Read(&buf[0], buf.size());
-    auto decrypted_data = DecryptDataBlock(buf, data_key);
-    out.Write(decrypted_data.data(), decrypted_data.size());
-  }
-
-  // read last data block
-  buf.resize(file_len - header_len - (packet_cnt - 1) * block_len);
-  in.Read(&buf[0], buf.size());
-  auto decrypted_data = DecryptDataBlock(buf, data_key);
-  out.Write(decrypted_data.data(), decrypted_data.size());
+  PosixFile in(src_path, O_RDONLY);
+  const auto layout = ReadFileLayout(in);
+  const auto file_key = FileKey(layout, data_key);
+  // every block is decrypted, so the whole index is checked up front
+  auto index = IntegrityIndex::Open(in, layout, file_key,
+                                    options.require_integrity_index);
+  if (index != nullptr) {
+    index->LoadLeaves();
+  }
+
+  const uint64_t raw_len = layout.RawOffset(layout.packet_cnt);
+  const bool resumed = progress != nullptr && progress->first_block() > 0;
+  PosixFile out(dest_path, (options.use_mmap ? O_RDWR : O_WRONLY) | O_CREAT |
+                               (resumed ? 0 : O_TRUNC));
+  try {
+    // only map the output when its disk space is reserved, see
+    // EncryptMappedFile
+    if (out.Allocate(raw_len) && options.use_mmap && raw_len > 0) {
+      MappedFile in_map(in, layout.BlockOffset(layout.packet_cnt), false);
+      MappedFile out_map(out, raw_len, true);
+      DecryptMappedBlocks(in_map.data(), out_map.data(), layout, file_key,
+                          index.get(), NumThreads(options), pool, progress);
+    } else {
+      DecryptBlocks(io, in, out, layout, file_key, index.get(),
+                    NumThreads(options), pool, progress);
+    }
+  } catch (...) {
+    // leave no partly decrypted output behind, a checkpointed job restarts
+    // the file as its output is gone
+    std::error_code ec;
+    std::filesystem::remove(dest_path, ec);
+    throw;
+  }
 
   // close file
   out.Close();
   in.Close();
+  if (progress != nullptr) {
+    progress->Finish();
+  }
 
   SPDLOG_INFO("Decrypt {} to {} success", src_path, dest_path);
 }
 
-void DecryptToDir(const std::string& src_path, const std::string& dest_path,
-                  yacl::ByteContainerView data_key) {
+// Decrypt data blocks [begin, end) of in with old_cipher and encrypt them
+// again with new_cipher in place, with one read and one write at the same
+// offset of out
+void ReencryptBlockRange(IoBackend& io, const PosixFile& in,
+                         const PosixFile& out, const EncFileLayout& layout,
+                         uint64_t begin, uint64_t end,
+                         DataBlockCipher& old_cipher,
+                         DataBlockCipher& new_cipher,
+                         const BlockIvSource& iv_source,
+                         const IntegrityIndex* index, AlignedBuffer* blocks) {
+  const uint64_t begin_offset = layout.BlockOffset(begin);
+  blocks->Resize(layout.BlockOffset(end) - begin_offset);
+  io.ReadAt(in, begin_offset,
+            absl::MakeSpan(blocks->data(), blocks->size()));
+  for (uint64_t i = begin; i < end; ++i) {
+    auto data_block = absl::MakeSpan(
+        blocks->data() + layout.BlockOffset(i) - begin_offset,
+        layout.BlockOffset(i + 1) - layout.BlockOffset(i));
+    auto plaintext = data_block.subspan(layout.BlockHeaderBytes());
+    DecryptDataBlock(layout.version, data_block, old_cipher, plaintext);
+    if (index != nullptr) {
+      index->CheckBlock(i, BlockTag(layout.version, data_block));
+    }
+    EncryptDataBlock(layout.version, plaintext, data_block, new_cipher,
+                     iv_source, i);
+  }
+  io.WriteAt(out, begin_offset,
+             yacl::ByteContainerView(blocks->data(), blocks->size()));
+}
+
+// Reencrypt a file from src_path under old_key to dest_path under new_key
+// The data blocks keep their plaintext, compressed or not, and thus their
+// length, so dest_path gets the layout of src_path and the raw data never
+// leaves memory. Ranges of data blocks are reencrypted in parallel, on
+// worker threads or, as a task of pool, on pool workers. The extension area
+// and the index of a version 2 file are written once the data blocks are,
+// with the integrity index over the new tags.
+// With progress, the data blocks before its first block are kept.
+void ReencryptFileWithIo(const std::string& src_path,
+                         const std::string& dest_path,
+                         yacl::ByteContainerView old_key,
+                         yacl::ByteContainerView new_key,
+                         const FileCryptoOptions& options, IoBackend& io,
+                         WorkerPool* pool, FileProgress* progress) {
+  SPDLOG_INFO("Reencrypting {} to {}", src_path, dest_path);
+  YACL_ENFORCE_NE(src_path, dest_path, "Inplace reencryption is not allowed");
+
+  PosixFile in(src_path, O_RDONLY);
+  auto layout = ReadFileLayout(in);
+  YACL_ENFORCE(options.iv_mode != IvMode::kCounter ||
+                   layout.packet_cnt <= kMaxCounterIvBlocks,
+               "{} data blocks exceed the counter IV space",
+               layout.packet_cnt);
+  const auto old_file_key = FileKey(layout, old_key);
+  auto index = IntegrityIndex::Open(in, layout, old_file_key,
+                                    options.require_integrity_index);
+  if (index != nullptr) {
+    index->LoadLeaves();
+  }
+  // a file with a file key gets a new one, as the old one is known to
+  // holders of the old data key
+  std::vector<uint8_t> new_file_key(new_key.begin(), new_key.end());
+  if (KeyExtensionBytes(layout) != 0) {
+    const bool wrap = !layout.wrapped_key.empty();
+    // the key entry keeps its length
+    YACL_ENFORCE(!wrap || new_key.size() == old_key.size(),
+                 "New data key length should be the old one");
+    layout.wrapped_key.clear();
+    layout.key_salt.clear();
+    new_file_key = NewFileKey(dest_path, new_key, wrap, progress, &layout);
+  }
+
+  const bool resumed = progress != nullptr && progress->first_block() > 0;
+  PosixFile out(dest_path, O_RDWR | O_CREAT | (resumed ? 0 : O_TRUNC));
+  out.WriteAt(0, EncodeFilePrefix(layout));
+
+  const BlockIvSource iv_source(options.iv_mode);
+  ParallelForBlockRanges(
+      layout.packet_cnt, BlocksPerBatch(layout.block_len),
+      NumThreads(options),
+      [&] {
+        return [&,
+                old_cipher = DataBlockCipher(old_file_key, layout.cipher_suite),
+                new_cipher = DataBlockCipher(new_file_key, layout.cipher_suite),
+                blocks = AlignedBuffer()](uint64_t begin,
+                                          uint64_t end) mutable {
+          ReencryptBlockRange(io, in, out, layout, begin, end, old_cipher,
+                              new_cipher, iv_source, index.get(), &blocks);
+        };
+      },
+      pool, progress);
+  FinishEncryptedFile(out, layout, new_file_key, index != nullptr);
+
+  out.Close();
+  in.Close();
+  if (progress != nullptr) {
+    progress->Finish();
+  }
+  SPDLOG_INFO("Reencrypt {} to {} success", src_path, dest_path);
+}
+
+// Submits the file tasks of a directory walk to pool largest first.
+// Sorting the whole tree would hold every path in memory before the first
+// task starts, so tasks are sorted within windows of kWindowFiles files.
+class LargestFirstSubmitter {
+ public:
+  static constexpr size_t kWindowFiles = 1024;
+
+  explicit LargestFirstSubmitter(WorkerPool* pool) : pool_(pool) {}
+
+  // Return false once pool has rejected a task, i.e. a task has failed
+  bool Add(uint64_t bytes, std::function<void()> task) {
+    window_.emplace_back(bytes, std::move(task));
+    return window_.size() < kWindowFiles || Flush();
+  }
+
+  bool Flush() {
+    std::stable_sort(
+        window_.begin(), window_.end(),
+        [](const auto& a, const auto& b) { return a.first > b.first; });
+    bool submitted = true;
+    for (auto& [bytes, task] : window_) {
+      if (!pool_->Submit(std::move(task))) {
+        submitted = false;
+        break;
+      }
+    }
+    window_.clear();
+    return submitted;
+  }
+
+ private:
+  WorkerPool* pool_;
+  std::vector<std::pair<uint64_t, std::function<void()>>> window_;
+};
+
+// Source files a directory job transforms and how their destinations are
+// named, the other files are copied as they are
+enum class JobFiles {
+  // every file, to its name with .enc appended
+  kAllAddingEncSuffix,
+  // .enc files, to their name without .enc
+  kEncDroppingSuffix,
+  // .enc files, to the same name
+  kEnc,
+};
+
+// Transforms the file at src_path to dest_path through io. As a task of
+// pool the data blocks of large files are shared with its idle workers,
+// pool is nullptr for a single file. progress is nullptr without
+// checkpoint.
+using FileTask = std::function<void(
+    const std::string& src_path, const std::string& dest_path, IoBackend& io,
+    WorkerPool* pool, FileProgress* progress)>;
+
+void CopyPlainFile(const std::string& src_path, const std::string& dest_path,
+                   FileProgress* progress) {
+  SPDLOG_INFO("Copying {} without .enc to {}", src_path, dest_path);
+  std::filesystem::copy(src_path, dest_path,
+                        std::filesystem::copy_options::overwrite_existing);
+  if (progress != nullptr) {
+    progress->Finish();
+  }
+  SPDLOG_INFO("Copy {} to {} success", src_path, dest_path);
+}
+
+// Run task on src_path, a single file or every regular file under the
+// directory, with the destinations at the same relative paths under
+// dest_path
+// Directories are walked into a pool of options.max_parallel_files
+// workers, largest files first, sharing one IoBackend so that io_uring
+// batches I/O across the files. With options.checkpoint_path the job of
+// operation is checkpointed under job_key, files done before a restart are
+// skipped and the checkpoint is removed once all files are done.
+void RunFileJob(const std::string& operation, const std::string& src_path,
+                const std::string& dest_path, yacl::ByteContainerView job_key,
+                const FileCryptoOptions& options, JobFiles files,
+                const FileTask& task) {
   YACL_ENFORCE(std::filesystem::exists(src_path), "src_path {} not exists",
                src_path);
+  const bool single_file = std::filesystem::is_regular_file(src_path);
+  if (!single_file && !std::filesystem::is_directory(src_path)) {
+    YACL_THROW("src_path {} is not a file or directory", src_path);
+  }
 
-  std::filesystem::path dest_object_path;
-  if (std::filesystem::is_regular_file(src_path)) {
-    dest_object_path = std::filesystem::path(dest_path) /
-                       std::filesystem::path(src_path).filename();
+  auto checkpoint =
+      OpenCheckpoint(options, operation, src_path, dest_path, job_key);
+  auto io = CreateIoBackend(options.use_io_uring);
+  // closure of the file at src_object_path, named name in the job, nullptr
+  // if it is done already
+  auto file_closure = [&](const std::filesystem::path& src_object_path,
+                          const std::filesystem::path& name,
+                          WorkerPool* pool) -> std::function<void()> {
+    const bool encrypted = src_object_path.extension() == kEncSuffix;
+    const bool copy = files != JobFiles::kAllAddingEncSuffix && !encrypted;
+    auto dest_object_path = std::filesystem::path(dest_path) / name;
+    if (files == JobFiles::kAllAddingEncSuffix) {
+      dest_object_path.concat(kEncSuffix);
+    } else if (files == JobFiles::kEncDroppingSuffix && encrypted) {
+      dest_object_path.replace_extension("");
+    }
     if (!std::filesystem::exists(dest_object_path.parent_path())) {
       std::filesystem::create_directories(dest_object_path.parent_path());
     }
-    if (std::filesystem::path(src_path).extension() == kEncSuffix) {
-      dest_object_path.replace_extension("");
-      SPDLOG_INFO("Decrypting {} to {}", src_path, dest_object_path.string());
-      DecryptFile(src_path, dest_object_path, data_key);
-      SPDLOG_INFO("Decrypt {} to {} success", src_path,
-                  dest_object_path.string());
-    } else {
-      SPDLOG_INFO("Coping {} without .enc to {}", src_path,
-                  dest_object_path.string());
-      std::filesystem::copy(src_path, dest_object_path,
-                            std::filesystem::copy_options::overwrite_existing);
-      SPDLOG_INFO("Copy {} to {} success", src_path, dest_object_path.string());
-    }
-  } else if (std::filesystem::is_directory(src_path)) {
-    std::vector<std::future<void>> futures;
+    auto progress = ResumeFile(checkpoint.get(), name, src_object_path,
+                               dest_object_path, options);
+    if (IsFileDone(progress)) {
+      return nullptr;
+    }
+    if (copy) {
+      return [src_object_path, dest_object_path, progress] {
+        CopyPlainFile(src_object_path, dest_object_path, progress.get());
+      };
+    }
+    return [&task, &io, src_object_path, dest_object_path, pool, progress] {
+      task(src_object_path, dest_object_path, *io, pool, progress.get());
+    };
+  };
+
+  if (single_file) {
+    if (auto closure = file_closure(
+            src_path, std::filesystem::path(src_path).filename(), nullptr)) {
+      closure();
+    }
+  } else {
+    // the directory walk blocks while the pool is full, workers left idle
+    // by small files help with the block ranges of large ones
+    WorkerPool pool(MaxParallelFiles(options), MaxParallelFiles(options));
+    LargestFirstSubmitter submitter(&pool);
+    bool submitted = true;
     for (const auto& src_item :
          std::filesystem::recursive_directory_iterator(src_path)) {
-      if (std::filesystem::is_regular_file(src_item.path())) {
-        std::filesystem::path relative_path =
-            std::filesystem::relative(src_item.path(), src_path);
-
-        dest_object_path = std::filesystem::path(dest_path / relative_path);
-        if (!std::filesystem::exists(dest_object_path.parent_path())) {
-          std::filesystem::create_directories(dest_object_path.parent_path());
-        }
-        if (src_item.path().extension() == kEncSuffix) {
-          dest_object_path.replace_extension("");
-
-          futures.emplace_back(std::async(std::launch::async, DecryptFile,
-                                          src_item.path().string(),
-                                          dest_object_path, data_key));
-        } else {
-          // copy files without .enc (not need to decrypt)
-          SPDLOG_INFO("Coping {} without .enc to {}", src_item.path().string(),
-                      dest_object_path.string());
-          std::filesystem::copy(
-              src_item.path().string(), dest_object_path,
-              std::filesystem::copy_options::overwrite_existing);
-          SPDLOG_INFO("Copy {} to {} success", src_item.path().string(),
-                      dest_object_path.string());
-        }
+      if (!std::filesystem::is_regular_file(src_item.path())) {
+        continue;
+      }
+      auto closure = file_closure(
+          src_item.path(),
+          std::filesystem::relative(src_item.path(), src_path), &pool);
+      if (closure == nullptr) {
+        continue;
+      }
+      // stop walking after a failure, Wait reports it
+      submitted = submitter.Add(src_item.file_size(), std::move(closure));
+      if (!submitted) {
+        break;
       }
     }
-    for (auto& future : futures) {
-      future.get();
+    if (submitted) {
+      submitter.Flush();
+    }
+    pool.Wait();
+  }
+  if (checkpoint != nullptr) {
+    checkpoint->Remove();
+  }
+}
+
+}  // namespace
+
+void DecryptFile(const std::string& src_path, const std::string& dest_path,
+                 yacl::ByteContainerView data_key,
+                 const FileCryptoOptions& options) {
+  auto io = CreateIoBackend(options.use_io_uring);
+  DecryptFileWithIo(src_path, dest_path, data_key, options, *io, nullptr,
+                    nullptr);
+}
+
+std::vector<uint8_t> DecryptRange(const std::string& src_path,
+                                  uint64_t offset, uint64_t length,
+                                  yacl::ByteContainerView data_key,
+                                  const FileCryptoOptions& options) {
+  PosixFile in(src_path, O_RDONLY);
+  const auto layout = ReadFileLayout(in);
+  const uint64_t raw_len = layout.RawOffset(layout.packet_cnt);
+  if (offset >= raw_len || length == 0) {
+    return {};
+  }
+  const uint64_t end_offset = offset + std::min(length, raw_len - offset);
+  const auto file_key = FileKey(layout, data_key);
+  auto index = IntegrityIndex::Open(in, layout, file_key,
+                                    options.require_integrity_index);
+
+  const uint64_t begin = layout.BlockOf(offset);
+  const uint64_t end = layout.BlockOf(end_offset - 1) + 1;
+  const uint64_t begin_offset = layout.BlockOffset(begin);
+  std::vector<uint8_t> blocks(layout.BlockOffset(end) - begin_offset);
+  in.ReadAt(begin_offset, absl::MakeSpan(blocks));
+
+  DataBlockCipher cipher(file_key, layout.cipher_suite);
+  auto decompressor = MakeDecompressor(layout);
+  std::vector<uint8_t> raw_block;
+  std::vector<uint8_t> raw_data(end_offset - offset);
+  for (uint64_t i = begin; i < end; ++i) {
+    auto data_block =
+        absl::MakeSpan(blocks.data() + layout.BlockOffset(i) - begin_offset,
+                       layout.BlockOffset(i + 1) - layout.BlockOffset(i));
+    const uint64_t raw_offset = layout.RawOffset(i);
+    absl::Span<uint8_t> block_raw_data;
+    if (decompressor != nullptr) {
+      raw_block.resize(layout.RawOffset(i + 1) - raw_offset);
+      block_raw_data = absl::MakeSpan(raw_block);
+      DecryptDataBlock(layout.version, data_block, cipher, *decompressor,
+                       block_raw_data);
+    } else {
+      block_raw_data = data_block.subspan(layout.BlockHeaderBytes());
+      DecryptDataBlock(layout.version, data_block, cipher, block_raw_data);
+    }
+    if (index != nullptr) {
+      index->CheckBlock(i, BlockTag(layout.version, data_block));
+    }
+
+    const uint64_t lo = std::max(offset, raw_offset);
+    const uint64_t hi = std::min(end_offset, layout.RawOffset(i + 1));
+    std::memcpy(raw_data.data() + lo - offset,
+                block_raw_data.data() + lo - raw_offset, hi - lo);
+  }
+  // the index reads its nodes from in
+  in.Close();
+  return raw_data;
+}
+
+VerifyResult VerifyFile(const std::string& src_path,
+                        yacl::ByteContainerView data_key,
+                        const FileCryptoOptions& options) {
+  const auto start = std::chrono::steady_clock::now();
+  auto io = CreateIoBackend(options.use_io_uring);
+  PosixFile in(src_path, O_RDONLY);
+  const auto layout = ReadFileLayout(in);
+  const auto file_key = FileKey(layout, data_key);
+  auto index = IntegrityIndex::Open(in, layout, file_key,
+                                    options.require_integrity_index);
+  if (index != nullptr) {
+    index->LoadLeaves();
+  }
+
+  VerifyResult result;
+  std::mutex mutex;
+  ParallelForBlockRanges(
+      layout.packet_cnt, BlocksPerBatch(layout.block_len),
+      NumThreads(options),
+      [&] {
+        return [&, cipher = DataBlockCipher(file_key, layout.cipher_suite),
+                blocks = AlignedBuffer()](uint64_t begin,
+                                          uint64_t end) mutable {
+          auto bad_blocks = VerifyBlockRange(*io, in, layout, begin, end,
+                                             cipher, index.get(), &blocks);
+          if (!bad_blocks.empty()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            result.bad_blocks.insert(result.bad_blocks.end(),
+                                     bad_blocks.begin(), bad_blocks.end());
+          }
+        };
+      },
+      nullptr, nullptr);
+  in.Close();
+
+  std::sort(result.bad_blocks.begin(), result.bad_blocks.end());
+  result.blocks = layout.packet_cnt;
+  result.bytes = layout.BlockOffset(layout.packet_cnt);
+  result.seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  return result;
+}
+
+void DecryptToDir(const std::string& src_path, const std::string& dest_path,
+                  yacl::ByteContainerView data_key,
+                  const FileCryptoOptions& options) {
+  RunFileJob("decrypt", src_path, dest_path, data_key, options,
+             JobFiles::kEncDroppingSuffix,
+             [&](const std::string& src_object_path,
+                 const std::string& dest_object_path, IoBackend& io,
+                 WorkerPool* pool, FileProgress* progress) {
+               DecryptFileWithIo(src_object_path, dest_object_path, data_key,
+                                 options, io, pool, progress);
+             });
+}
+
+void ReencryptToDir(const std::string& src_path, const std::string& dest_path,
+                    yacl::ByteContainerView old_key,
+                    yacl::ByteContainerView new_key,
+                    const FileCryptoOptions& options) {
+  // a checkpoint only resumes a rotation between the same two keys
+  std::vector<uint8_t> job_key(old_key.begin(), old_key.end());
+  job_key.insert(job_key.end(), new_key.begin(), new_key.end());
+  RunFileJob("reencrypt", src_path, dest_path, job_key, options,
+             JobFiles::kEnc,
+             [&](const std::string& src_object_path,
+                 const std::string& dest_object_path, IoBackend& io,
+                 WorkerPool* pool, FileProgress* progress) {
+               ReencryptFileWithIo(src_object_path, dest_object_path, old_key,
+                                   new_key, options, io, pool, progress);
+             });
+}
+
+void RewrapFileKeys(const std::string& path, yacl::ByteContainerView old_key,
+                    yacl::ByteContainerView new_key,
+                    const FileCryptoOptions& options) {
+  YACL_ENFORCE(std::filesystem::exists(path), "path {} not exists", path);
+  if (std::filesystem::is_regular_file(path)) {
+    RewrapFileKey(path, old_key, new_key);
+  } else if (std::filesystem::is_directory(path)) {
+    // each file costs a small read and write, so the files in flight
+    // hide the latency of remote storage
+    WorkerPool pool(MaxParallelFiles(options), MaxParallelFiles(options));
+    for (const auto& item :
+         std::filesystem::recursive_directory_iterator(path)) {
+      if (!std::filesystem::is_regular_file(item.path()) ||
+          item.path().extension() != kEncSuffix) {
+        continue;
+      }
+      if (!pool.Submit([&, file_path = item.path()] {
+            RewrapFileKey(file_path, old_key, new_key);
+          })) {
+        break;
+      }
     }
+    pool.Wait();
   } else {
-    YACL_THROW("src_path {} is not a file or directory", src_path);
+    YACL_THROW("path {} is not a file or directory", path);
+  }
+  SPDLOG_INFO("Rewrap file keys of {} success", path);
+}
+
+namespace {
+
+// Whether the file at path starts with header
+bool HasHeader(const std::string& path, yacl::ByteContainerView header) {
+  PosixFile file(path, O_RDONLY);
+  if (file.GetLength() < header.size()) {
+    return false;
   }
+  std::vector<uint8_t> buf(header.size());
+  file.ReadAt(0, absl::MakeSpan(buf));
+  return std::equal(buf.begin(), buf.end(), header.begin());
 }
 
 // Encrypt a file from src_path to dest_path
@@ -326,80 +1517,438 @@ void DecryptToDir(const std::string& src_path, const std::string& dest_path,
 // Step 2: encrypt raw data
 // Step 3: write header to dest_path file
 // Step 4: write data block to dest_path file
-void EncryptFile(const std::string& src_path, const std::string& dest_path,
-                 yacl::ByteContainerView data_key) {
+// As a task of pool or with progress, the data blocks are encrypted in
+// block ranges, on pool workers for the former. With progress, the data
+// blocks before its first block are kept.
+void EncryptFileWithIo(const std::string& src_path,
+                       const std::string& dest_path,
+                       yacl::ByteContainerView data_key,
+                       const FileCryptoOptions& options, IoBackend& io,
+                       WorkerPool* pool, FileProgress* progress) {
   SPDLOG_INFO("Encrypting {} to {}", src_path, dest_path);
   YACL_ENFORCE_NE(src_path, dest_path, "Inplace encryption is not allowed");
 
   // read raw data
-  yacl::io::FileInputStream in(src_path);
-  auto file_len = in.GetLength();
-  uint32_t block_header_len =
-      kIvLenBytes + kIvFieldBytes + kMacLenBytes + kMacFieldBytes;
-  uint32_t block_data_len = kBlockBytes - block_header_len;
+  uint64_t file_len = std::filesystem::file_size(src_path);
+  const uint32_t block_bytes =
+      options.block_bytes != 0 ? options.block_bytes : AutoBlockBytes(file_len);
+  YACL_ENFORCE(options.format_version == kVersion ||
+                   options.format_version == kVersion2,
+               "Unsupported format version {}", options.format_version);
+  YACL_ENFORCE(!(options.wrap_key && options.derive_key),
+               "wrap_key and derive_key are exclusive");
+  const size_t header_bytes = BlockHeaderBytes(options.format_version);
+  YACL_ENFORCE(block_bytes > header_bytes && block_bytes <= kMaxBlockBytes,
+               "block bytes {} should be in ({}, {}]", block_bytes,
+               header_bytes, kMaxBlockBytes);
+  uint32_t block_data_len = block_bytes - header_bytes;
   uint64_t packet_cnt =
       file_len / block_data_len + (file_len % block_data_len != 0);
   YACL_ENFORCE_GE(packet_cnt, 1u, "Pack cnt less than 1");
+  YACL_ENFORCE(options.iv_mode != IvMode::kCounter ||
+                   packet_cnt <= kMaxCounterIvBlocks,
+               "{} data blocks exceed the counter IV space, use larger blocks",
+               packet_cnt);
+  const BlockIvSource iv_source(options.iv_mode);
+  EncFileLayout layout;
+  layout.version = options.format_version;
+  layout.packet_cnt = packet_cnt;
+  layout.block_len = block_bytes;
+  layout.last_block_len =
+      header_bytes + file_len - (packet_cnt - 1) * block_data_len;
+  layout.raw_len = file_len;
+  layout.compression = options.compression;
+  const bool compressed = layout.compression != Compression::kNone;
+  // the extension area is written once the data blocks are, but for the
+  // wrapped key
+  uint64_t ext_bytes = 0;
+  std::vector<uint8_t> file_key(data_key.begin(), data_key.end());
+  if (options.wrap_key || options.derive_key) {
+    file_key = NewFileKey(dest_path, data_key, options.wrap_key, progress,
+                          &layout);
+    ext_bytes += KeyExtensionBytes(layout);
+  }
+  layout.cipher_suite = ResolveCipherSuite(options.cipher_suite);
+  ext_bytes += CipherSuiteExtensionBytes(layout);
+  if (compressed) {
+    ext_bytes += CompressionExtensionBytes(layout.version, packet_cnt);
+  }
+  if (options.integrity_index) {
+    ext_bytes += IntegrityExtensionBytes(packet_cnt);
+  }
+  if (ext_bytes != 0) {
+    layout.schema = kSchemaExtended;
+    layout.data_offset = kHeaderBytes + kExtLenBytes + ext_bytes;
+  }
+  const auto header = EncodeFilePrefix(layout);
+
+  // the kept data blocks must have the layout of this run, and compressed
+  // ones can't be kept as their bounds are only written at the end
+  if (progress != nullptr && progress->first_block() > 0 &&
+      (compressed || !HasHeader(dest_path, header))) {
+    SPDLOG_WARN("{} has another block layout, encrypting it from the start",
+                dest_path);
+    progress->Restart();
+  }
+  const bool resumed = progress != nullptr && progress->first_block() > 0;
+
+  // compressed data blocks are only placed once written
+  if (options.use_mmap && !compressed) {
+    if (EncryptMappedFile(src_path, dest_path, header, layout, file_key,
+                          iv_source, options.integrity_index,
+                          NumThreads(options), pool, progress)) {
+      if (progress != nullptr) {
+        progress->Finish();
+      }
+      SPDLOG_INFO("Encrypt {} to {} success", src_path, dest_path);
+      return;
+    }
+  }
 
   // write file header
-  yacl::io::FileOutputStream out(dest_path);
-  out.Write(reinterpret_cast<const char*>(&kVersion), kVersionBytes);
-  out.Write(reinterpret_cast<const char*>(&kSchema), kSchemaBytes);
-  out.Write(reinterpret_cast<const char*>(&packet_cnt), kPacketCntBytes);
-  out.Write(reinterpret_cast<const char*>(&kBlockBytes), kBlockLenBytes);
+  PosixFile in(src_path, O_RDONLY);
+  PosixFile out(dest_path, O_RDWR | O_CREAT | (resumed ? 0 : O_TRUNC));
+  out.WriteAt(0, header);
 
-  // block from 1 to pack_cnt - 1
-  for (uint64_t i = 0; i < packet_cnt - 1; ++i) {
-    EncryptDataBlock(in, out, block_data_len, data_key);
+  // write data blocks, the last one holds the remaining raw data
+  if (!compressed && (pool != nullptr || progress != nullptr)) {
+    EncryptBlockRanges(io, in, out, layout, file_key, iv_source,
+                       NumThreads(options), pool, progress);
+  } else {
+    // compressed blocks go through the pipeline, which places them in
+    // order, in a pool task on its own thread as the pool runs other files
+    EncryptBlocks(io, in, out, &layout, file_key, iv_source,
+                  pool != nullptr && pool->InWorker() ? 1
+                                                      : NumThreads(options));
   }
-  // the last block
-  EncryptDataBlock(in, out, file_len - (packet_cnt - 1) * block_data_len,
-                   data_key);
+  FinishEncryptedFile(out, layout, file_key, options.integrity_index);
 
   out.Close();
   in.Close();
+  if (progress != nullptr) {
+    progress->Finish();
+  }
   SPDLOG_INFO("Encrypt {} to {} success", src_path, dest_path);
 }
 
-void EncryptToDir(const std::string& src_path, const std::string& dest_path,
-                  yacl::ByteContainerView data_key) {
-  YACL_ENFORCE(std::filesystem::exists(src_path), "src_path {} not exists",
-               src_path);
-  std::filesystem::path dest_object_path;
-
-  if (std::filesystem::is_regular_file(src_path)) {
-    dest_object_path = (std::filesystem::path(dest_path) /
-                        std::filesystem::path(src_path).filename())
-                           .concat(kEncSuffix);
-    if (!std::filesystem::exists(dest_object_path.parent_path())) {
-      std::filesystem::create_directories(dest_object_path.parent_path());
-    }
-    EncryptFile(src_path, dest_object_path, data_key);
-  } else if (std::filesystem::is_directory(src_path)) {
-    std::vector<std::future<void>> futures;
-    for (const auto& src_item :
-         std::filesystem::recursive_directory_iterator(src_path)) {
-      if (std::filesystem::is_regular_file(src_item.path())) {
-        std::filesystem::path relative_path =
-            std::filesystem::relative(src_item.path(), src_path);
-
-        // for files in directory
-        dest_object_path =
-            std::filesystem::path(dest_path / relative_path).concat(kEncSuffix);
-        if (!std::filesystem::exists(dest_object_path.parent_path())) {
-          std::filesystem::create_directories(dest_object_path.parent_path());
-        }
-        futures.emplace_back(std::async(std::launch::async, EncryptFile,
-                                        src_item.path(), dest_object_path,
-                                        data_key));
+// Encrypt the raw data read from src_path up to its end, for pipes and
+// other files without a length
+void EncryptStream(const std::string& src_path, const std::string& dest_path,
+                   yacl::ByteContainerView data_key,
+                   const FileCryptoOptions& options) {
+  SPDLOG_INFO("Encrypting stream {} to {}", src_path, dest_path);
+  PosixFile in(src_path, O_RDONLY);
+  StreamingEncryptor encryptor(dest_path, data_key, options);
+  std::vector<uint8_t> buf(kBatchBytes);
+  while (true) {
+    const ssize_t n = ::read(in.fd(), buf.data(), buf.size());
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
       }
+      YACL_THROW_IO_ERROR("Failed to read {}: {}", src_path,
+                          std::system_category().message(errno));
     }
-    for (auto& future : futures) {
-      future.get();
+    if (n == 0) {
+      break;
     }
+    encryptor.Write(yacl::ByteContainerView(buf.data(), n));
+  }
+  encryptor.Finish();
+  in.Close();
+  SPDLOG_INFO("Encrypt stream {} to {} success", src_path, dest_path);
+}
+
+}  // namespace
+
+void EncryptFile(const std::string& src_path, const std::string& dest_path,
+                 yacl::ByteContainerView data_key,
+                 const FileCryptoOptions& options) {
+  if (!std::filesystem::is_regular_file(src_path)) {
+    EncryptStream(src_path, dest_path, data_key, options);
+    return;
+  }
+  auto io = CreateIoBackend(options.use_io_uring);
+  EncryptFileWithIo(src_path, dest_path, data_key, options, *io, nullptr,
+                    nullptr);
+}
+
+StreamingEncryptor::StreamingEncryptor(const std::string& path, int flags,
+                                       yacl::ByteContainerView data_key,
+                                       IvMode iv_mode)
+    : out_(path, flags),
+      cipher_(data_key),
+      iv_source_(iv_mode),
+      max_blocks_(iv_mode == IvMode::kCounter
+                      ? kMaxCounterIvBlocks
+                      : std::numeric_limits<uint64_t>::max()) {}
+
+StreamingEncryptor::StreamingEncryptor(const std::string& dest_path,
+                                       yacl::ByteContainerView data_key,
+                                       const FileCryptoOptions& options)
+    : StreamingEncryptor(dest_path, O_WRONLY | O_CREAT | O_TRUNC, data_key,
+                         options.iv_mode) {
+  YACL_ENFORCE(options.format_version == kVersion ||
+                   options.format_version == kVersion2,
+               "Unsupported format version {}", options.format_version);
+  YACL_ENFORCE(!options.integrity_index,
+               "Streaming encryption has no integrity index");
+  layout_.version = options.format_version;
+  layout_.block_len =
+      options.block_bytes != 0 ? options.block_bytes : kBlockBytes;
+  const size_t header_bytes = layout_.BlockHeaderBytes();
+  YACL_ENFORCE(layout_.block_len > header_bytes &&
+                   layout_.block_len <= kMaxBlockBytes,
+               "block bytes {} should be in ({}, {}]", layout_.block_len,
+               header_bytes, kMaxBlockBytes);
+  layout_.compression = options.compression;
+  uint64_t ext_bytes = 0;
+  std::vector<uint8_t> file_key(data_key.begin(), data_key.end());
+  if (options.wrap_key || options.derive_key) {
+    YACL_ENFORCE(!(options.wrap_key && options.derive_key),
+                 "wrap_key and derive_key are exclusive");
+    file_key =
+        NewFileKey(dest_path, data_key, options.wrap_key, nullptr, &layout_);
+    ext_bytes += KeyExtensionBytes(layout_);
+  }
+  layout_.cipher_suite = ResolveCipherSuite(options.cipher_suite);
+  ext_bytes += CipherSuiteExtensionBytes(layout_);
+  if (KeyExtensionBytes(layout_) != 0 ||
+      layout_.cipher_suite != CipherSuite::kAesGcm) {
+    cipher_ = DataBlockCipher(file_key, layout_.cipher_suite);
+  }
+  if (layout_.compression != Compression::kNone) {
+    YACL_ENFORCE_EQ(layout_.version, kVersion2,
+                    "Streaming compression needs format version 2");
+    compressor_ = std::make_unique<BlockCompressor>(layout_.compression);
+    ext_bytes += CompressionExtensionBytes(layout_.version, 0);
+    raw_data_offset_ = kBlockCodecBytes;
+  }
+  if (ext_bytes != 0) {
+    layout_.schema = kSchemaExtended;
+    layout_.data_offset = kHeaderBytes + kExtLenBytes + ext_bytes;
+  }
+  if (compressor_ != nullptr) {
+    layout_.block_offsets.push_back(layout_.data_offset);
+  }
+  pending_.resize(raw_data_offset_ + layout_.block_len - header_bytes);
+  blocks_.reserve(kBatchBytes + layout_.block_len + kBlockCodecBytes);
+  out_offset_ = layout_.data_offset;
+  out_.WriteAt(0, EncodeHeader(0, layout_.block_len, layout_.schema,
+                               layout_.version));
+  modified_ = true;
+}
+
+std::unique_ptr<StreamingEncryptor> StreamingEncryptor::Append(
+    const std::string& path, yacl::ByteContainerView data_key) {
+  std::unique_ptr<StreamingEncryptor> encryptor(
+      new StreamingEncryptor(path, O_RDWR, data_key, IvMode::kRandom));
+  encryptor->ReopenLastBlock(data_key);
+  return encryptor;
+}
+
+void StreamingEncryptor::ReopenLastBlock(yacl::ByteContainerView data_key) {
+  layout_ = ReadFileLayout(out_);
+  if (KeyExtensionBytes(layout_) != 0 ||
+      layout_.cipher_suite != CipherSuite::kAesGcm) {
+    cipher_ = DataBlockCipher(FileKey(layout_, data_key),
+                              layout_.cipher_suite);
+  }
+  YACL_ENFORCE(layout_.FindExtension(kExtMerkleRoot) == nullptr,
+               "Can't append to {} with an integrity index", out_.path());
+  YACL_ENFORCE(layout_.compression == Compression::kNone ||
+                   layout_.version == kVersion2,
+               "Can't append to compressed version 1 file {}", out_.path());
+  if (layout_.compression != Compression::kNone) {
+    compressor_ = std::make_unique<BlockCompressor>(layout_.compression);
+    raw_data_offset_ = kBlockCodecBytes;
+  }
+  const size_t header_bytes = layout_.BlockHeaderBytes();
+  pending_.resize(raw_data_offset_ + layout_.block_len - header_bytes);
+  blocks_.reserve(kBatchBytes + layout_.block_len + kBlockCodecBytes);
+
+  const uint64_t last = layout_.packet_cnt - 1;
+  out_offset_ = layout_.BlockOffset(last);
+  std::vector<uint8_t> data_block(layout_.BlockOffset(last + 1) -
+                                  out_offset_);
+  out_.ReadAt(out_offset_, absl::MakeSpan(data_block));
+  pending_len_ = layout_.RawOffset(last + 1) - layout_.RawOffset(last);
+  auto raw_data =
+      absl::MakeSpan(pending_.data() + raw_data_offset_, pending_len_);
+  if (compressor_ != nullptr) {
+    BlockDecompressor decompressor;
+    DecryptDataBlock(layout_.version, data_block, cipher_, decompressor,
+                     raw_data);
   } else {
-    YACL_THROW("src_path {} is not a file or directory", src_path);
+    DecryptDataBlock(layout_.version, data_block, cipher_, raw_data);
+  }
+
+  // the last data block is encrypted again and everything after it is
+  // rewritten
+  layout_.packet_cnt = last;
+  if (!layout_.block_offsets.empty()) {
+    layout_.block_offsets.resize(last + 1);
+  }
+  if (!layout_.raw_offsets.empty()) {
+    layout_.raw_offsets.resize(last + 1);
+  }
+}
+
+StreamingEncryptor::~StreamingEncryptor() {
+  if (modified_ && !finished_) {
+    SPDLOG_WARN("Encrypted stream {} is not finished and can't be read",
+                out_.path());
+  }
+}
+
+void StreamingEncryptor::Write(yacl::ByteContainerView data) {
+  YACL_ENFORCE(!finished_, "Encrypted stream {} is finished", out_.path());
+  const size_t block_data_len = pending_.size() - raw_data_offset_;
+  while (!data.empty()) {
+    // a full data block waits for more data, as it may be the last one
+    if (pending_len_ == block_data_len) {
+      EncryptPending();
+    }
+    const size_t len = std::min(data.size(), block_data_len - pending_len_);
+    std::memcpy(pending_.data() + raw_data_offset_ + pending_len_,
+                data.data(), len);
+    pending_len_ += len;
+    layout_.raw_len += len;
+    data = data.subspan(len);
+  }
+}
+
+void StreamingEncryptor::Finish() {
+  YACL_ENFORCE(!finished_, "Encrypted stream {} is finished", out_.path());
+  // an empty stream still has its one data block
+  EncryptPending();
+  FlushBlocks();
+  // no integrity index, so the file key is not needed
+  FinishEncryptedFile(out_, layout_, {}, false);
+  out_.WriteAt(0, EncodeHeader(layout_.packet_cnt, layout_.block_len,
+                               layout_.schema, layout_.version));
+  // an appended file may end before the old index did
+  out_.Truncate(layout_.version == kVersion2
+                    ? out_offset_ + layout_.packet_cnt * kIndexEntryBytes
+                    : out_offset_);
+  out_.Close();
+  finished_ = true;
+}
+
+void StreamingEncryptor::EncryptPending() {
+  YACL_ENFORCE_LT(layout_.packet_cnt, max_blocks_,
+                  "Data blocks exceed the counter IV space, use larger blocks");
+  yacl::ByteContainerView plaintext(pending_.data() + raw_data_offset_,
+                                    pending_len_);
+  if (compressor_ != nullptr) {
+    plaintext = compressor_->Compress(plaintext);
+    if (plaintext.empty()) {
+      // store the raw data as is behind its codec byte
+      pending_[0] = static_cast<uint8_t>(Compression::kNone);
+      plaintext = yacl::ByteContainerView(pending_.data(),
+                                          kBlockCodecBytes + pending_len_);
+    }
+  }
+  const size_t offset = blocks_.size();
+  const size_t block_len = layout_.BlockHeaderBytes() + plaintext.size();
+  blocks_.resize(offset + block_len);
+  EncryptDataBlock(layout_.version, plaintext,
+                   absl::MakeSpan(blocks_).subspan(offset), cipher_,
+                   iv_source_, layout_.packet_cnt++);
+  if (!layout_.block_offsets.empty()) {
+    layout_.block_offsets.push_back(layout_.block_offsets.back() + block_len);
   }
+  if (!layout_.raw_offsets.empty()) {
+    layout_.raw_offsets.push_back(layout_.raw_offsets.back() + pending_len_);
+  }
+  layout_.last_block_len = block_len;
+  pending_len_ = 0;
+  if (blocks_.size() >= kBatchBytes) {
+    FlushBlocks();
+  }
+}
+
+void StreamingEncryptor::FlushBlocks() {
+  out_.WriteAt(out_offset_, blocks_);
+  modified_ = true;
+  out_offset_ += blocks_.size();
+  blocks_.clear();
+}
+
+void AppendEncryptedFile(const std::string& path,
+                         yacl::ByteContainerView data,
+                         yacl::ByteContainerView data_key) {
+  auto encryptor = StreamingEncryptor::Append(path, data_key);
+  encryptor->Write(data);
+  encryptor->Finish();
+}
+
+void PatchEncryptedFile(const std::string& path, uint64_t offset,
+                        yacl::ByteContainerView data,
+                        yacl::ByteContainerView data_key) {
+  if (data.empty()) {
+    return;
+  }
+  PosixFile file(path, O_RDWR);
+  const auto layout = ReadFileLayout(file);
+  YACL_ENFORCE(layout.compression == Compression::kNone,
+               "Can't patch compressed file {}", path);
+  YACL_ENFORCE(offset <= layout.raw_len &&
+                   data.size() <= layout.raw_len - offset,
+               "Patch of {} bytes at {} is past the {} raw data bytes of {}",
+               data.size(), offset, layout.raw_len, path);
+  const auto file_key = FileKey(layout, data_key);
+  auto index = IntegrityIndex::Open(file, layout, file_key);
+
+  const uint64_t end_offset = offset + data.size();
+  const uint64_t begin = layout.BlockOf(offset);
+  const uint64_t end = layout.BlockOf(end_offset - 1) + 1;
+  const uint64_t begin_offset = layout.BlockOffset(begin);
+  std::vector<uint8_t> blocks(layout.BlockOffset(end) - begin_offset);
+  file.ReadAt(begin_offset, absl::MakeSpan(blocks));
+
+  DataBlockCipher cipher(file_key, layout.cipher_suite);
+  // counter IVs would repeat for the patched blocks
+  const BlockIvSource iv_source(IvMode::kRandom);
+  std::vector<std::vector<uint8_t>> tags;
+  for (uint64_t i = begin; i < end; ++i) {
+    auto data_block =
+        absl::MakeSpan(blocks.data() + layout.BlockOffset(i) - begin_offset,
+                       layout.BlockOffset(i + 1) - layout.BlockOffset(i));
+    auto raw_data = data_block.subspan(layout.BlockHeaderBytes());
+    DecryptDataBlock(layout.version, data_block, cipher, raw_data);
+    if (index != nullptr) {
+      index->CheckBlock(i, BlockTag(layout.version, data_block));
+    }
+
+    const uint64_t raw_offset = layout.RawOffset(i);
+    const uint64_t lo = std::max(offset, raw_offset);
+    const uint64_t hi = std::min(end_offset, layout.RawOffset(i + 1));
+    std::memcpy(raw_data.data() + lo - raw_offset, data.data() + lo - offset,
+                hi - lo);
+    EncryptDataBlock(layout.version, raw_data, data_block, cipher, iv_source,
+                     i);
+    const auto tag = BlockTag(layout.version, data_block);
+    tags.emplace_back(tag.begin(), tag.end());
+  }
+  file.WriteAt(begin_offset, blocks);
+  if (index != nullptr) {
+    UpdateIntegrityIndex(file, layout, file_key, begin, tags);
+  }
+  file.Close();
+}
+
+void EncryptToDir(const std::string& src_path, const std::string& dest_path,
+                  yacl::ByteContainerView data_key,
+                  const FileCryptoOptions& options) {
+  RunFileJob("encrypt", src_path, dest_path, data_key, options,
+             JobFiles::kAllAddingEncSuffix,
+             [&](const std::string& src_object_path,
+                 const std::string& dest_object_path, IoBackend& io,
+                 WorkerPool* pool, FileProgress* progress) {
+               EncryptFileWithIo(src_object_path, dest_object_path, data_key,
+                                 options, io, pool, progress);
+             });
 }
 
 }  // namespace utils
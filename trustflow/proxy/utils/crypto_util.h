@@ -14,6 +14,7 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -31,6 +32,11 @@
 #include "yacl/crypto/rand/rand.h"
 #include "yacl/crypto/sign/rsa_signing.h"
 
+#include "trustflow/proxy/utils/compression.h"
+#include "trustflow/proxy/utils/data_block_cipher.h"
+#include "trustflow/proxy/utils/enc_file_format.h"
+#include "trustflow/proxy/utils/io_util.h"
+
 #include "secretflowapis/v2/sdc/capsule_manager/capsule_manager.pb.h"
 
 namespace trustflow {
@@ -41,39 +47,265 @@ constexpr char kRs256[] = "RS256";
 constexpr char kRsaOaep[] = "RSA-OAEP";
 constexpr char kAes128Gcm[] = "A128GCM";
 
-constexpr uint8_t kIvBytes = 12;
-constexpr uint8_t kMacBytes = 16;
 constexpr uint8_t kContentKeyBytes = 16;
 const std::string kJwsConcatDelimiter = ".";
 
-// Convert byte array to int
-template <typename T>
-T Bytes2Int(yacl::ByteContainerView bytes) {
-  size_t len = bytes.size();
-  YACL_ENFORCE_LE(len, sizeof(T), "Converting bytes to integer overflow");
-  T ret = 0;
-  // Little-endian
-  for (size_t i = 0; i < len; i++) {
-    ret = (ret << 8 | bytes[len - i - 1]);
-  }
-  return ret;
-}
+// Tunables of the file encryption and decryption routines
+struct FileCryptoOptions {
+  // Number of crypto worker threads used for a single file, 0 means
+  // std::thread::hardware_concurrency()
+  size_t num_threads = 0;
+  // Number of worker threads of EncryptToDir and DecryptToDir, which take
+  // files largest first and help each other with the block ranges of large
+  // files, 0 means std::thread::hardware_concurrency()
+  size_t max_parallel_files = 0;
+  // Length of the encrypted data blocks written by encryption, including the
+  // data block header, 0 means picking one from the raw data length with
+  // AutoBlockBytes. Decryption always uses the length in the file header.
+  uint32_t block_bytes = 0;
+  // Encrypt or decrypt between shared mappings of the source and the
+  // preallocated destination file, which saves the intermediate buffers and
+  // copies. Falls back to file reads and writes where the destination space
+  // can not be reserved.
+  bool use_mmap = false;
+  // IV construction of encryption, kCounter saves the DRBG call per block
+  IvMode iv_mode = IvMode::kRandom;
+  // Submit the file reads and writes through io_uring, batched across the
+  // blocks and, for EncryptToDir and DecryptToDir, the files in flight.
+  // Falls back to blocking I/O where io_uring is unavailable.
+  bool use_io_uring = false;
+  // Write an integrity index with encryption, a Merkle tree over the data
+  // block tags whose root is authenticated in the header, which binds the
+  // blocks to their positions and count, see integrity_index.h. Decryption
+  // checks the index of any file that has one.
+  bool integrity_index = false;
+  // Reject files without an integrity index on decryption, verification and
+  // reencryption. Stripping the extension area of a file removes its index
+  // undetected, after which its data blocks could be reordered or dropped,
+  // so readers of files written with an index should require it.
+  bool require_integrity_index = false;
+  // Compress the raw data of each data block before encrypting it, which
+  // shrinks text data several fold. Compressed files are written by the
+  // encryption pipeline, without memory mappings or resuming partly written
+  // files. Decryption decompresses any compressed file.
+  Compression compression = Compression::kNone;
+  // Format version of encrypted files, kVersion2 packs the data block
+  // header into 28 instead of 66 bytes and appends an 8 byte index entry
+  // per data block, see enc_file_format.h. Decryption reads both versions.
+  uint32_t format_version = kVersion;
+  // Encrypt each file with a random file key, stored wrapped by the data key
+  // in the extension area, so that RewrapFileKeys changes the data key of
+  // the file by rewriting a few dozen bytes. Decryption unwraps the file key
+  // of any file that has one.
+  bool wrap_key = false;
+  // Encrypt each file with a key derived by HKDF-SHA256 from the data key
+  // and a random salt stored in the extension area. GCM with random IVs
+  // allows about 2^32 data blocks per key, which then applies per file
+  // rather than to everything under the data key. Excludes wrap_key, whose
+  // random file keys lift the limit too. Decryption derives the file key
+  // of any file that has a salt.
+  bool derive_key = false;
+  // AEAD of the data blocks written by encryption, kAuto picks the faster
+  // suite of the host, see FasterCipherSuite, which is AES-GCM as before on
+  // CPUs with AES instructions and ChaCha20-Poly1305 elsewhere. kSm4Gcm
+  // serves deployments bound to the SM cipher series. Decryption reads the
+  // suite from each file.
+  CipherSuite cipher_suite = CipherSuite::kAuto;
+  // Journal the progress of EncryptToDir and DecryptToDir to this file, so
+  // that rerunning the same job after a crash skips the finished files and
+  // resumes the others after their last durable data block. The file is
+  // removed once the job succeeds, empty disables checkpoints.
+  std::string checkpoint_path;
+  // Minimum time between two checkpoint records of a file in progress, each
+  // record syncs the destination file to disk
+  uint32_t checkpoint_interval_ms = 5000;
+};
+
+// Data block length for a raw data of file_len bytes, files below 16 MiB keep
+// 8 KiB blocks for fine grained random access while larger ones use 64 KiB
+// blocks, which amortize the per block IV, tag and header. Longer blocks
+// measured no faster and only make random access coarser.
+uint32_t AutoBlockBytes(uint64_t file_len);
 
 // Decrypt a ciphertext file at src_path to a plaintext file at dest_path
 // with data_key
+// Data blocks are located from the header, so options.num_threads workers
+// decrypt disjoint block ranges with positional reads and writes into the
+// preallocated dest_path.
 void DecryptFile(const std::string& src_path, const std::string& dest_path,
-                 yacl::ByteContainerView data_key);
-
+                 yacl::ByteContainerView data_key,
+                 const FileCryptoOptions& options = {});
+
+// Decrypt length raw data bytes from offset of the encrypted file at
+// src_path, fewer if the raw data ends before
+// Only the data blocks covering the range are read, with one read, and
+// decrypted, and checked against the integrity index along their paths if
+// the file has one. Only options.require_integrity_index applies.
+std::vector<uint8_t> DecryptRange(const std::string& src_path,
+                                  uint64_t offset, uint64_t length,
+                                  yacl::ByteContainerView data_key,
+                                  const FileCryptoOptions& options = {});
+
+// Result of VerifyFile
+struct VerifyResult {
+  uint64_t blocks = 0;
+  // encrypted bytes checked
+  uint64_t bytes = 0;
+  double seconds = 0;
+  // data blocks that fail their tag or integrity index check, ascending
+  std::vector<uint64_t> bad_blocks;
+};
+
+// Check every data block of the encrypted file at src_path against its tag,
+// and the integrity index if the file has one, without writing raw data
+// anywhere. options.num_threads workers check disjoint block ranges.
+// Bad data blocks are reported rather than thrown, a corrupt header or
+// extension area still throws as the blocks can't be located then.
+VerifyResult VerifyFile(const std::string& src_path,
+                        yacl::ByteContainerView data_key,
+                        const FileCryptoOptions& options = {});
+
+// Decrypt a single file or every .enc file under src_path to dest_path, other
+// files are copied. options.num_threads only applies to the single file case,
+// files of a directory are decrypted by options.max_parallel_files workers.
 void DecryptToDir(const std::string& src_path, const std::string& dest_path,
-                  yacl::ByteContainerView data_key);
+                  yacl::ByteContainerView data_key,
+                  const FileCryptoOptions& options = {});
+
+// Reencrypt a single file or every .enc file under src_path from old_key
+// to new_key into dest_path, other files are copied
+// Each data block is decrypted and encrypted again in memory, so rotating
+// the key costs one read and one write of the encrypted data and no raw
+// data reaches the disk. Files of a directory are reencrypted by
+// options.max_parallel_files workers, which also share the block ranges of
+// large files, options.num_threads applies to the single file case. The
+// encrypted files keep their layout, options only choose the IV mode, and
+// files with a file key get a new one.
+void ReencryptToDir(const std::string& src_path, const std::string& dest_path,
+                    yacl::ByteContainerView old_key,
+                    yacl::ByteContainerView new_key,
+                    const FileCryptoOptions& options = {});
+
+// Rewrap the file key of the encrypted file at path, or of every .enc file
+// under path, from old_key to new_key in place, see
+// FileCryptoOptions::wrap_key
+// Only the start of each file is read and written, by
+// options.max_parallel_files workers for a directory. Files rewrapped by an
+// interrupted earlier run are skipped. Files without a file key are
+// rejected, ReencryptToDir changes their data key.
+void RewrapFileKeys(const std::string& path, yacl::ByteContainerView old_key,
+                    yacl::ByteContainerView new_key,
+                    const FileCryptoOptions& options = {});
 
 // Encrypt a plaintext file at src_path to a ciphertext file at dest_path
 // with data_key
+// Blocks are read, encrypted by a pool of options.num_threads workers and
+// written back in order, so the output is the same as the serial one.
+// A src_path that is not a regular file, like a pipe, is read to its end
+// by a StreamingEncryptor.
 void EncryptFile(const std::string& src_path, const std::string& dest_path,
-                 yacl::ByteContainerView data_key);
+                 yacl::ByteContainerView data_key,
+                 const FileCryptoOptions& options = {});
 
+// Encrypt a single file or every regular file under src_path to dest_path,
+// options.num_threads only applies to the single file case, files of a
+// directory are encrypted by options.max_parallel_files workers.
 void EncryptToDir(const std::string& src_path, const std::string& dest_path,
-                  yacl::ByteContainerView data_key);
+                  yacl::ByteContainerView data_key,
+                  const FileCryptoOptions& options = {});
+
+// Encrypts raw data of unknown length to a file as it is produced, for
+// pipes, sockets and apps that stream their results
+// The header is written with a packet count of 0, which readers reject,
+// and completed by Finish, so an unfinished file is never taken for a
+// shorter one. The extension area precedes the data blocks and is sized up
+// front, so there is no integrity index, and compression needs format
+// version 2, whose block index follows the data blocks.
+// Not thread safe.
+class StreamingEncryptor {
+ public:
+  // Create dest_path, options.block_bytes of 0 means 8 KiB data blocks as
+  // the raw data length is unknown
+  StreamingEncryptor(const std::string& dest_path,
+                     yacl::ByteContainerView data_key,
+                     const FileCryptoOptions& options = {});
+
+  StreamingEncryptor(const StreamingEncryptor&) = delete;
+  StreamingEncryptor& operator=(const StreamingEncryptor&) = delete;
+
+  ~StreamingEncryptor();
+
+  // Reopen the encrypted file at path to append to its raw data, the last
+  // data block is decrypted and encrypted again with the appended data by
+  // Finish, with random IVs whatever the IV mode of the file, as counter
+  // IVs would repeat for it. Files with an integrity index and compressed
+  // version 1 files can't be appended to.
+  // Appending is not atomic, an interrupted append may leave the file
+  // unreadable.
+  static std::unique_ptr<StreamingEncryptor> Append(
+      const std::string& path, yacl::ByteContainerView data_key);
+
+  // Append data to the raw data, full data blocks are encrypted and
+  // written in batches
+  void Write(yacl::ByteContainerView data);
+
+  // Encrypt the rest of the raw data as the last data block and complete
+  // the file
+  void Finish();
+
+  // Raw data bytes written so far
+  uint64_t raw_len() const { return layout_.raw_len; }
+
+ private:
+  StreamingEncryptor(const std::string& path, int flags,
+                     yacl::ByteContainerView data_key, IvMode iv_mode);
+
+  // Take the last data block of the file back as the current one
+  void ReopenLastBlock(yacl::ByteContainerView data_key);
+
+  // Encrypt the raw data of the current data block into blocks_
+  void EncryptPending();
+
+  // Write blocks_ after the data blocks written before
+  void FlushBlocks();
+
+  PosixFile out_;
+  DataBlockCipher cipher_;
+  BlockIvSource iv_source_;
+  std::unique_ptr<BlockCompressor> compressor_;
+  uint64_t max_blocks_;
+  EncFileLayout layout_;
+  // codec byte, if compressed, and raw data of the current data block
+  std::vector<uint8_t> pending_;
+  size_t raw_data_offset_ = 0;
+  size_t pending_len_ = 0;
+  // encrypted data blocks not written yet, which start at out_offset_
+  std::vector<uint8_t> blocks_;
+  uint64_t out_offset_ = 0;
+  // whether the file is changed, an appended file only once blocks are
+  // written
+  bool modified_ = false;
+  bool finished_ = false;
+};
+
+// Append data to the raw data of the encrypted file at path, which costs
+// the encryption of data and of the last data block of the file, see
+// StreamingEncryptor::Append
+void AppendEncryptedFile(const std::string& path,
+                         yacl::ByteContainerView data,
+                         yacl::ByteContainerView data_key);
+
+// Overwrite the raw data of the encrypted file at path from offset with
+// data, which must not reach past the end of the raw data
+// Only the data blocks overlapping the range are decrypted and encrypted
+// again, with random IVs, and the integrity index, if any, is updated along
+// their paths, so the cost follows the length of data rather than that of
+// the file. Compressed files are not supported, as patched blocks would
+// change length. Patching is not atomic, an interrupted patch may leave the
+// file unreadable.
+void PatchEncryptedFile(const std::string& path, uint64_t offset,
+                        yacl::ByteContainerView data,
+                        yacl::ByteContainerView data_key);
 
 std::vector<uint8_t> X509CertPemToDer(const std::string& pem_cert);
 
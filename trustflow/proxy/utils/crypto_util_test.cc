@@ -0,0 +1,755 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trustflow/proxy/utils/crypto_util.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "fmt/format.h"
+#include "gtest/gtest.h"
+
+#include "trustflow/proxy/utils/checkpoint.h"
+#include "trustflow/proxy/utils/data_block_cipher.h"
+#include "trustflow/proxy/utils/enc_file_format.h"
+#include "trustflow/proxy/utils/io_util.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+namespace {
+
+// Encrypted by the release before format version 2 with
+// 000102030405060708090a0b0c0d0e0f, 8 KiB blocks
+constexpr char kV1Fixture[] =
+    "trustflow/proxy/utils/testdata/v1_aes128_gcm.enc";
+
+std::string V1FixtureRaw() {
+  std::string raw;
+  for (int i = 0; i < 600; ++i) {
+    raw += fmt::format("line {:05d} of the version 1 fixture\n", i);
+  }
+  return raw;
+}
+
+// Half text, which compresses, half random bytes, which don't
+std::string TestData(size_t len, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::string data(len, '\0');
+  for (size_t i = 0; i < len; ++i) {
+    data[i] = i < len / 2 ? static_cast<char>('a' + i % 23 + (i / 1000) % 3)
+                          : static_cast<char>(rng());
+  }
+  return data;
+}
+
+// Key material of the data blocks
+enum class KeyMode { kDataKey, kWrapKey, kDeriveKey };
+
+class CryptoUtilTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const auto* info = ::testing::UnitTest::GetInstance()->current_test_info();
+    // parameterized names hold slashes
+    std::string name =
+        fmt::format("{}.{}", info->test_suite_name(), info->name());
+    std::replace(name.begin(), name.end(), '/', '_');
+    dir_ = std::filesystem::path(::testing::TempDir()) / "crypto_util_test" /
+           name;
+    std::filesystem::remove_all(dir_);
+    std::filesystem::create_directories(dir_);
+  }
+
+  void TearDown() override { std::filesystem::remove_all(dir_); }
+
+  std::string Path(const std::string& name) const { return dir_ / name; }
+
+  // Encrypt data to name.enc with options, return its path
+  std::string Encrypt(const std::string& name, const std::string& data,
+                      const FileCryptoOptions& options) {
+    WriteFile(Path(name), data);
+    EncryptFile(Path(name), Path(name + ".enc"), data_key_, options);
+    return Path(name + ".enc");
+  }
+
+  std::string Decrypt(const std::string& enc_path,
+                      yacl::ByteContainerView key,
+                      const FileCryptoOptions& options = {}) {
+    const std::string dec_path = enc_path + ".dec";
+    DecryptFile(enc_path, dec_path, key, options);
+    return ReadFile(dec_path);
+  }
+
+  static FileCryptoOptions SmallBlocks() {
+    FileCryptoOptions options;
+    options.block_bytes = 4096;
+    options.num_threads = 2;
+    return options;
+  }
+
+  static void SetKeyMode(KeyMode key_mode, FileCryptoOptions* options) {
+    options->wrap_key = key_mode == KeyMode::kWrapKey;
+    options->derive_key = key_mode == KeyMode::kDeriveKey;
+  }
+
+  std::filesystem::path dir_;
+  const std::vector<uint8_t> data_key_ = std::vector<uint8_t>(16, 0x11);
+  const std::vector<uint8_t> new_key_ = std::vector<uint8_t>(16, 0x22);
+};
+
+using RoundTripParam =
+    std::tuple<uint32_t, IvMode, bool, Compression, uint32_t, KeyMode,
+               CipherSuite>;
+
+class RoundTripTest : public CryptoUtilTest,
+                      public ::testing::WithParamInterface<RoundTripParam> {
+ protected:
+  FileCryptoOptions Options() const {
+    const auto& [block_bytes, iv_mode, index, compression, version, key_mode,
+                 cipher_suite] = GetParam();
+    FileCryptoOptions options = SmallBlocks();
+    options.block_bytes = block_bytes;
+    options.iv_mode = iv_mode;
+    options.integrity_index = index;
+    options.compression = compression;
+    options.format_version = version;
+    SetKeyMode(key_mode, &options);
+    options.cipher_suite = cipher_suite;
+    return options;
+  }
+};
+
+TEST_P(RoundTripTest, DecryptVerifyAndRange) {
+  const std::string data = TestData(50000, 1);
+  const auto enc_path = Encrypt("raw", data, Options());
+  EXPECT_EQ(Decrypt(enc_path, data_key_), data);
+
+  const auto result = VerifyFile(enc_path, data_key_);
+  PosixFile in(enc_path, O_RDONLY);
+  const auto layout = ReadFileLayout(in);
+  EXPECT_EQ(result.blocks, layout.packet_cnt);
+  EXPECT_EQ(layout.cipher_suite, Options().cipher_suite);
+  EXPECT_GT(result.blocks, 1u);
+  EXPECT_TRUE(result.bad_blocks.empty());
+
+  for (const auto& [offset, length] :
+       std::vector<std::pair<uint64_t, uint64_t>>{{0, 1},
+                                                  {4000, 300},
+                                                  {12345, 20000},
+                                                  {49990, 100},
+                                                  {0, 50000},
+                                                  {50000, 1}}) {
+    const auto range = DecryptRange(enc_path, offset, length, data_key_);
+    EXPECT_EQ(std::string(range.begin(), range.end()),
+              data.substr(offset, length))
+        << "offset " << offset << " length " << length;
+  }
+
+  EXPECT_ANY_THROW(Decrypt(enc_path, new_key_));
+  EXPECT_ANY_THROW(DecryptRange(enc_path, 0, 1, new_key_));
+
+  FileCryptoOptions required;
+  required.require_integrity_index = true;
+  if (Options().integrity_index) {
+    EXPECT_EQ(Decrypt(enc_path, data_key_, required), data);
+  } else {
+    EXPECT_ANY_THROW(Decrypt(enc_path, data_key_, required));
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Options, RoundTripTest,
+    ::testing::Combine(::testing::Values(0, 200, 4096),
+                       ::testing::Values(IvMode::kRandom, IvMode::kCounter),
+                       ::testing::Bool(),
+                       ::testing::Values(Compression::kNone,
+                                         Compression::kZstd),
+                       ::testing::Values(kVersion, kVersion2),
+                       ::testing::Values(KeyMode::kDataKey, KeyMode::kWrapKey,
+                                         KeyMode::kDeriveKey),
+                       ::testing::Values(CipherSuite::kAesGcm,
+                                         CipherSuite::kChaCha20Poly1305,
+                                         CipherSuite::kSm4Gcm)));
+
+TEST_F(CryptoUtilTest, BlockBytes) {
+  EXPECT_EQ(AutoBlockBytes(100), 8192u);
+  EXPECT_EQ(AutoBlockBytes(20 << 20), 65536u);
+  EXPECT_EQ(AutoBlockBytes(2ull << 30), 65536u);
+
+  WriteFile(Path("raw"), TestData(1000, 2));
+  for (uint32_t block_bytes : {66u, 0x4000001u}) {
+    FileCryptoOptions options;
+    options.block_bytes = block_bytes;
+    EXPECT_ANY_THROW(
+        EncryptFile(Path("raw"), Path("raw.enc"), data_key_, options))
+        << block_bytes;
+  }
+}
+
+// The parameters are FileCryptoOptions::use_mmap and use_io_uring
+TEST_F(CryptoUtilTest, CompressionShrinksText) {
+  std::string text;
+  while (text.size() < 100000) {
+    text += "a line of text that repeats\n";
+  }
+  FileCryptoOptions options = SmallBlocks();
+  const auto plain_path = Encrypt("plain", text, options);
+  options.compression = Compression::kZstd;
+  const auto compressed_path = Encrypt("compressed", text, options);
+  EXPECT_LT(std::filesystem::file_size(compressed_path) * 5,
+            std::filesystem::file_size(plain_path));
+  EXPECT_EQ(Decrypt(compressed_path, data_key_), text);
+}
+
+TEST_F(CryptoUtilTest, AutoCipherSuite) {
+  FileCryptoOptions options = SmallBlocks();
+  ASSERT_EQ(options.cipher_suite, CipherSuite::kAuto);
+  const std::string data = TestData(20000, 15);
+  PosixFile in(Encrypt("raw", data, options), O_RDONLY);
+  EXPECT_EQ(ReadFileLayout(in).cipher_suite, FasterCipherSuite());
+  EXPECT_EQ(Decrypt(Path("raw.enc"), data_key_), data);
+}
+
+class IoModeTest
+    : public CryptoUtilTest,
+      public ::testing::WithParamInterface<std::tuple<bool, bool>> {};
+
+TEST_P(IoModeTest, RoundTrip) {
+  FileCryptoOptions options = SmallBlocks();
+  options.num_threads = 3;
+  std::tie(options.use_mmap, options.use_io_uring) = GetParam();
+  const std::string data = TestData(300001, 2);
+  const auto enc_path = Encrypt("raw", data, options);
+  EXPECT_EQ(Decrypt(enc_path, data_key_, options), data);
+
+  // no plaintext of a file that fails is left behind
+  std::string tampered = ReadFile(enc_path);
+  tampered[tampered.size() - 10] ^= 1;
+  WriteFile(enc_path, tampered);
+  std::filesystem::remove(enc_path + ".dec");
+  EXPECT_ANY_THROW(Decrypt(enc_path, data_key_, options));
+  EXPECT_FALSE(std::filesystem::exists(enc_path + ".dec"));
+}
+
+INSTANTIATE_TEST_SUITE_P(MmapAndIoUring, IoModeTest,
+                         ::testing::Combine(::testing::Bool(),
+                                            ::testing::Bool()));
+
+TEST_F(CryptoUtilTest, DirectoryRoundTrip) {
+  std::filesystem::create_directories(Path("src/sub"));
+  WriteFile(Path("src/a"), TestData(70000, 3));
+  WriteFile(Path("src/sub/b"), TestData(10, 4));
+  WriteFile(Path("src/sub/c"), TestData(30000, 5));
+  FileCryptoOptions options = SmallBlocks();
+  options.max_parallel_files = 2;
+  EncryptToDir(Path("src"), Path("enc"), data_key_, options);
+  ASSERT_TRUE(std::filesystem::exists(Path("enc/a.enc")));
+  ASSERT_TRUE(std::filesystem::exists(Path("enc/sub/b.enc")));
+  // files without .enc are copied through
+  WriteFile(Path("enc/plain.txt"), "plain");
+
+  DecryptToDir(Path("enc"), Path("dec"), data_key_, options);
+  for (const char* name : {"a", "sub/b", "sub/c"}) {
+    EXPECT_EQ(ReadFile(Path("dec/") + name), ReadFile(Path("src/") + name))
+        << name;
+  }
+  EXPECT_EQ(ReadFile(Path("dec/plain.txt")), "plain");
+}
+
+// Resume of an EncryptToDir job from src to enc, interrupted as recorded
+// in the journal by the test
+class ResumeTest : public CryptoUtilTest {
+ protected:
+  void SetUp() override {
+    CryptoUtilTest::SetUp();
+    std::filesystem::create_directories(Path("src"));
+    WriteFile(Path("src/a"), TestData(30000, 6));
+    WriteFile(Path("src/b"), TestData(20000, 7));
+    options_ = SmallBlocks();
+    options_.max_parallel_files = 2;
+    EncryptToDir(Path("src"), Path("enc"), data_key_, options_);
+    a_enc_ = ReadFile(Path("enc/a.enc"));
+    b_enc_ = ReadFile(Path("enc/b.enc"));
+    PosixFile in(Path("enc/a.enc"), O_RDONLY);
+    a_layout_ = ReadFileLayout(in);
+    options_.checkpoint_path = Path("job.ckpt");
+  }
+
+  // Journal of the job, with the job id of OpenCheckpoint in crypto_util.cc
+  std::unique_ptr<Checkpoint> Journal() {
+    return std::make_unique<Checkpoint>(
+        options_.checkpoint_path,
+        "encrypt\n" + std::filesystem::absolute(Path("src")).string() +
+            "\n" + std::filesystem::absolute(Path("enc")).string(),
+        data_key_);
+  }
+
+  // Rerun the job and check that it decrypts to the source
+  void Resume() {
+    EncryptToDir(Path("src"), Path("enc"), data_key_, options_);
+    EXPECT_FALSE(std::filesystem::exists(options_.checkpoint_path));
+    for (const char* name : {"a", "b"}) {
+      EXPECT_EQ(Decrypt(Path("enc/") + name + ".enc", data_key_),
+                ReadFile(Path("src/") + name))
+          << name;
+    }
+  }
+
+  // Blocks of a.enc up to data block 3, as left by the interrupted job
+  std::string APrefix() const {
+    return a_enc_.substr(0, a_layout_.BlockOffset(3));
+  }
+
+  FileCryptoOptions options_;
+  std::string a_enc_;
+  std::string b_enc_;
+  EncFileLayout a_layout_;
+};
+
+TEST_F(ResumeTest, SkipsFinishedFiles) {
+  Journal()->Record("b", FileStamp::Of(Path("src/b")), Checkpoint::kFileDone,
+                    b_enc_.size());
+  std::filesystem::remove(Path("enc/a.enc"));
+  Resume();
+  // random IVs would differ if b were encrypted again
+  EXPECT_EQ(ReadFile(Path("enc/b.enc")), b_enc_);
+  EXPECT_NE(ReadFile(Path("enc/a.enc")), a_enc_);
+}
+
+TEST_F(ResumeTest, ResumesAfterDurableBlocks) {
+  Journal()->Record("a", FileStamp::Of(Path("src/a")), 3,
+                    a_layout_.BlockOffset(3));
+  WriteFile(Path("enc/a.enc"), APrefix());
+  Resume();
+  const std::string a_enc = ReadFile(Path("enc/a.enc"));
+  EXPECT_EQ(a_enc.substr(0, APrefix().size()), APrefix());
+  EXPECT_NE(a_enc, a_enc_);
+}
+
+TEST_F(ResumeTest, ResumesAfterRealInterruption) {
+  // b.enc can't be written while a directory takes its place
+  std::filesystem::remove(Path("enc/b.enc"));
+  std::filesystem::create_directories(Path("enc/b.enc/blocker"));
+  options_.max_parallel_files = 1;
+  EXPECT_ANY_THROW(
+      EncryptToDir(Path("src"), Path("enc"), data_key_, options_));
+  ASSERT_TRUE(std::filesystem::exists(options_.checkpoint_path));
+  const std::string a_enc = ReadFile(Path("enc/a.enc"));
+
+  std::filesystem::remove_all(Path("enc/b.enc"));
+  Resume();
+  // a was finished before b failed, largest first
+  EXPECT_EQ(ReadFile(Path("enc/a.enc")), a_enc);
+}
+
+TEST_F(ResumeTest, ChangedSourceIsRedone) {
+  Journal()->Record("a", FileStamp::Of(Path("src/a")), 3,
+                    a_layout_.BlockOffset(3));
+  WriteFile(Path("enc/a.enc"), APrefix());
+  WriteFile(Path("src/a"), TestData(30001, 8));
+  Resume();
+  EXPECT_NE(ReadFile(Path("enc/a.enc")).substr(0, APrefix().size()),
+            APrefix());
+}
+
+TEST_F(ResumeTest, ShortDestinationIsRedone) {
+  Journal()->Record("a", FileStamp::Of(Path("src/a")), 3,
+                    a_layout_.BlockOffset(3));
+  WriteFile(Path("enc/a.enc"), APrefix().substr(0, APrefix().size() - 1));
+  Resume();
+  EXPECT_NE(ReadFile(Path("enc/a.enc")).substr(0, APrefix().size()),
+            APrefix());
+}
+
+TEST_F(ResumeTest, RejectsJournalWithBadTag) {
+  Journal()->Record("b", FileStamp::Of(Path("src/b")), Checkpoint::kFileDone,
+                    b_enc_.size());
+  std::string journal = ReadFile(options_.checkpoint_path);
+  journal.back() ^= 1;
+  WriteFile(options_.checkpoint_path, journal);
+  Resume();
+  // the forged record is dropped, so b is encrypted again
+  EXPECT_NE(ReadFile(Path("enc/b.enc")), b_enc_);
+}
+
+TEST_F(ResumeTest, RejectsJournalOfAnotherKey) {
+  Journal()->Record("b", FileStamp::Of(Path("src/b")), Checkpoint::kFileDone,
+                    b_enc_.size());
+  const std::string journal = ReadFile(options_.checkpoint_path);
+  EXPECT_ANY_THROW(
+      EncryptToDir(Path("src"), Path("enc"), new_key_, options_));
+  EXPECT_EQ(ReadFile(options_.checkpoint_path), journal);
+}
+
+TEST_F(CryptoUtilTest, StreamingEncryptor) {
+  const std::string data = TestData(20000, 5);
+  for (uint32_t version : {kVersion, kVersion2}) {
+    FileCryptoOptions options = SmallBlocks();
+    options.format_version = version;
+    if (version == kVersion2) {
+      options.compression = Compression::kZstd;
+    }
+    const std::string enc_path = Path(fmt::format("stream{}.enc", version));
+    {
+      StreamingEncryptor encryptor(enc_path, data_key_, options);
+      for (size_t offset = 0; offset < data.size(); offset += 777) {
+        encryptor.Write(data.substr(offset, 777));
+      }
+      // an unfinished file is rejected rather than read short
+      EXPECT_ANY_THROW(Decrypt(enc_path, data_key_));
+      encryptor.Finish();
+      EXPECT_EQ(encryptor.raw_len(), data.size());
+    }
+    EXPECT_EQ(Decrypt(enc_path, data_key_), data) << "version " << version;
+  }
+
+  FileCryptoOptions options = SmallBlocks();
+  options.compression = Compression::kZstd;
+  EXPECT_ANY_THROW(
+      StreamingEncryptor(Path("compressed_v1.enc"), data_key_, options));
+  options = SmallBlocks();
+  options.integrity_index = true;
+  EXPECT_ANY_THROW(
+      StreamingEncryptor(Path("indexed.enc"), data_key_, options));
+}
+
+TEST_F(CryptoUtilTest, EncryptsPipe) {
+  const std::string data = TestData(50000, 6);
+  ASSERT_EQ(::mkfifo(Path("pipe").c_str(), 0600), 0);
+  std::thread producer([&] { WriteFile(Path("pipe"), data); });
+  EncryptFile(Path("pipe"), Path("pipe.enc"), data_key_, SmallBlocks());
+  producer.join();
+  EXPECT_EQ(Decrypt(Path("pipe.enc"), data_key_), data);
+}
+
+TEST_F(CryptoUtilTest, Append) {
+  for (uint32_t version : {kVersion, kVersion2}) {
+    FileCryptoOptions options = SmallBlocks();
+    options.format_version = version;
+    options.iv_mode = IvMode::kCounter;
+    if (version == kVersion2) {
+      options.compression = Compression::kZstd;
+    }
+    std::string data = TestData(10000, 6);
+    const auto enc_path = Encrypt(fmt::format("raw{}", version), data, options);
+    for (size_t len : {1, 5000, 4096}) {
+      const std::string more = TestData(len, len);
+      AppendEncryptedFile(enc_path, more, data_key_);
+      data += more;
+      EXPECT_EQ(Decrypt(enc_path, data_key_), data) << "version " << version;
+    }
+  }
+
+  FileCryptoOptions options = SmallBlocks();
+  options.integrity_index = true;
+  const auto indexed_path = Encrypt("indexed", TestData(10000, 7), options);
+  EXPECT_ANY_THROW(AppendEncryptedFile(indexed_path, "more", data_key_));
+  options = SmallBlocks();
+  options.compression = Compression::kZstd;
+  const auto compressed_path =
+      Encrypt("compressed", TestData(10000, 7), options);
+  EXPECT_ANY_THROW(AppendEncryptedFile(compressed_path, "more", data_key_));
+  EXPECT_ANY_THROW(
+      AppendEncryptedFile(Path("raw1.enc"), "more", new_key_));
+}
+
+TEST_F(CryptoUtilTest, Patch) {
+  for (bool index : {false, true}) {
+    for (uint32_t version : {kVersion, kVersion2}) {
+      FileCryptoOptions options = SmallBlocks();
+      options.integrity_index = index;
+      options.format_version = version;
+      std::string data = TestData(30000, 8);
+      const auto enc_path =
+          Encrypt(fmt::format("raw{}{}", index ? 1 : 0, version), data,
+                  options);
+      const uint64_t enc_len = std::filesystem::file_size(enc_path);
+      for (const auto& [offset, len] : std::vector<std::pair<size_t, size_t>>{
+               {0, 1}, {4000, 200}, {8000, 9000}, {29999, 1}, {0, 30000}}) {
+        const std::string patch = TestData(len, offset + 100);
+        PatchEncryptedFile(enc_path, offset, patch, data_key_);
+        data.replace(offset, len, patch);
+        EXPECT_EQ(Decrypt(enc_path, data_key_), data);
+      }
+      EXPECT_EQ(std::filesystem::file_size(enc_path), enc_len);
+      EXPECT_ANY_THROW(PatchEncryptedFile(
+          enc_path, 29990, std::string(11, 'x'), data_key_));
+      EXPECT_ANY_THROW(PatchEncryptedFile(enc_path, 0, "x", new_key_));
+      EXPECT_EQ(Decrypt(enc_path, data_key_), data);
+    }
+  }
+
+  FileCryptoOptions options = SmallBlocks();
+  options.compression = Compression::kZstd;
+  const auto enc_path = Encrypt("compressed", TestData(10000, 9), options);
+  EXPECT_ANY_THROW(PatchEncryptedFile(enc_path, 0, "x", data_key_));
+}
+
+TEST_F(CryptoUtilTest, ReencryptRejectsOldKey) {
+  for (KeyMode key_mode :
+       {KeyMode::kDataKey, KeyMode::kWrapKey, KeyMode::kDeriveKey}) {
+    FileCryptoOptions options = SmallBlocks();
+    SetKeyMode(key_mode, &options);
+    options.integrity_index = true;
+    const std::string name = fmt::format("raw{}", static_cast<int>(key_mode));
+    const std::string data = TestData(20000, 10);
+    const auto enc_path = Encrypt(name, data, options);
+
+    ReencryptToDir(enc_path, Path("rotated"), data_key_, new_key_, options);
+    const std::string rotated = Path("rotated/" + name + ".enc");
+    EXPECT_EQ(Decrypt(rotated, new_key_), data);
+    EXPECT_ANY_THROW(Decrypt(rotated, data_key_));
+    EXPECT_TRUE(VerifyFile(rotated, new_key_).bad_blocks.empty());
+    EXPECT_ANY_THROW(ReencryptToDir(enc_path, Path("wrong"), new_key_,
+                                    data_key_, options));
+  }
+}
+
+TEST_F(CryptoUtilTest, ReencryptDirectory) {
+  std::filesystem::create_directories(Path("src/sub"));
+  WriteFile(Path("src/a"), TestData(70000, 11));
+  WriteFile(Path("src/sub/b"), TestData(100, 12));
+  FileCryptoOptions options = SmallBlocks();
+  options.max_parallel_files = 2;
+  EncryptToDir(Path("src"), Path("enc"), data_key_, options);
+  WriteFile(Path("enc/plain.txt"), "plain");
+
+  ReencryptToDir(Path("enc"), Path("rotated"), data_key_, new_key_, options);
+  DecryptToDir(Path("rotated"), Path("dec"), new_key_, options);
+  EXPECT_EQ(ReadFile(Path("dec/a")), ReadFile(Path("src/a")));
+  EXPECT_EQ(ReadFile(Path("dec/sub/b")), ReadFile(Path("src/sub/b")));
+  EXPECT_EQ(ReadFile(Path("dec/plain.txt")), "plain");
+  EXPECT_ANY_THROW(Decrypt(Path("rotated/a.enc"), data_key_));
+}
+
+TEST_F(CryptoUtilTest, RewrapRejectsOldKey) {
+  FileCryptoOptions options = SmallBlocks();
+  options.wrap_key = true;
+  const std::string data = TestData(20000, 11);
+  const auto enc_path = Encrypt("raw", data, options);
+  const std::string before = ReadFile(enc_path);
+
+  RewrapFileKeys(enc_path, data_key_, new_key_);
+  const std::string after = ReadFile(enc_path);
+  // only the wrapped key changes, the data blocks are kept
+  EXPECT_EQ(before.size(), after.size());
+  EXPECT_NE(before, after);
+  EXPECT_EQ(before.substr(before.size() - 10000),
+            after.substr(after.size() - 10000));
+  EXPECT_EQ(Decrypt(enc_path, new_key_), data);
+  EXPECT_ANY_THROW(Decrypt(enc_path, data_key_));
+  // rerunning an interrupted rewrap skips the file
+  RewrapFileKeys(enc_path, data_key_, new_key_);
+  EXPECT_EQ(ReadFile(enc_path), after);
+  EXPECT_ANY_THROW(
+      RewrapFileKeys(enc_path, std::vector<uint8_t>(16, 0x33), data_key_));
+
+  const auto plain_key_path = Encrypt("plain_key", data, SmallBlocks());
+  EXPECT_ANY_THROW(RewrapFileKeys(plain_key_path, data_key_, new_key_));
+}
+
+TEST_F(CryptoUtilTest, RewrapDirectory) {
+  std::filesystem::create_directories(Path("src/sub"));
+  WriteFile(Path("src/a"), TestData(30000, 12));
+  WriteFile(Path("src/sub/b"), TestData(100, 13));
+  FileCryptoOptions options = SmallBlocks();
+  options.wrap_key = true;
+  EncryptToDir(Path("src"), Path("enc"), data_key_, options);
+  RewrapFileKeys(Path("enc"), data_key_, new_key_);
+  EXPECT_EQ(Decrypt(Path("enc/a.enc"), new_key_), ReadFile(Path("src/a")));
+  EXPECT_EQ(Decrypt(Path("enc/sub/b.enc"), new_key_),
+            ReadFile(Path("src/sub/b")));
+}
+
+TEST_F(CryptoUtilTest, DerivedKeysDifferPerFile) {
+  FileCryptoOptions options = SmallBlocks();
+  options.derive_key = true;
+  const std::string data = TestData(20000, 14);
+  PosixFile first(Encrypt("first", data, options), O_RDONLY);
+  PosixFile second(Encrypt("second", data, options), O_RDONLY);
+  const auto first_key = FileKey(ReadFileLayout(first), data_key_);
+  const auto second_key = FileKey(ReadFileLayout(second), data_key_);
+  EXPECT_EQ(first_key.size(), data_key_.size());
+  EXPECT_NE(first_key, second_key);
+  EXPECT_NE(first_key, data_key_);
+
+  options.wrap_key = true;
+  EXPECT_ANY_THROW(Encrypt("both", data, options));
+}
+
+class TamperTest : public CryptoUtilTest,
+                   public ::testing::WithParamInterface<uint32_t> {
+ protected:
+  // Encrypt 20000 bytes with an integrity index, return the layout
+  EncFileLayout EncryptIndexed(std::string* enc_path) {
+    FileCryptoOptions options = SmallBlocks();
+    options.format_version = GetParam();
+    options.integrity_index = true;
+    *enc_path = Encrypt("raw", TestData(20000, 12), options);
+    PosixFile in(*enc_path, O_RDONLY);
+    return ReadFileLayout(in);
+  }
+
+  // Decryption throws and leaves no output behind
+  void ExpectDecryptFails(const std::string& enc_path) {
+    EXPECT_ANY_THROW(Decrypt(enc_path, data_key_));
+    EXPECT_FALSE(std::filesystem::exists(enc_path + ".dec"));
+  }
+};
+
+TEST_P(TamperTest, BitFlip) {
+  std::string enc_path;
+  const auto layout = EncryptIndexed(&enc_path);
+  const std::string original = ReadFile(enc_path);
+  for (uint64_t block = 0; block < layout.packet_cnt; ++block) {
+    std::string tampered = original;
+    tampered[layout.BlockOffset(block) + layout.BlockHeaderBytes() + 5] ^= 1;
+    WriteFile(enc_path, tampered);
+    ExpectDecryptFails(enc_path);
+    EXPECT_EQ(VerifyFile(enc_path, data_key_).bad_blocks,
+              std::vector<uint64_t>{block});
+    EXPECT_ANY_THROW(DecryptRange(enc_path, layout.RawOffset(block), 1,
+                                  data_key_));
+  }
+
+  // the header is authenticated by the integrity index
+  std::string tampered = original;
+  tampered[kVersionBytes + kSchemaBytes] ^= 1;
+  WriteFile(enc_path, tampered);
+  ExpectDecryptFails(enc_path);
+}
+
+TEST_P(TamperTest, BlockSwap) {
+  std::string enc_path;
+  const auto layout = EncryptIndexed(&enc_path);
+  ASSERT_GT(layout.packet_cnt, 2u);
+  std::string tampered = ReadFile(enc_path);
+  const uint64_t first = layout.BlockOffset(0);
+  const uint64_t second = layout.BlockOffset(1);
+  const uint64_t len = second - first;
+  ASSERT_EQ(layout.BlockOffset(2) - second, len);
+  const std::string block0 = tampered.substr(first, len);
+  tampered.replace(first, len, tampered.substr(second, len));
+  tampered.replace(second, len, block0);
+  WriteFile(enc_path, tampered);
+  ExpectDecryptFails(enc_path);
+  EXPECT_EQ(VerifyFile(enc_path, data_key_).bad_blocks,
+            (std::vector<uint64_t>{0, 1}));
+}
+
+TEST_P(TamperTest, Truncation) {
+  std::string enc_path;
+  EncryptIndexed(&enc_path);
+  const std::string original = ReadFile(enc_path);
+  for (size_t cut : {1, 100, 5000}) {
+    WriteFile(enc_path, original.substr(0, original.size() - cut));
+    ExpectDecryptFails(enc_path);
+  }
+}
+
+TEST_P(TamperTest, StripIndexAndReorder) {
+  std::string enc_path;
+  const auto layout = EncryptIndexed(&enc_path);
+  const std::string original = ReadFile(enc_path);
+  // drop the extension area with the index and swap blocks 0 and 1
+  std::string stripped = original.substr(0, kHeaderBytes);
+  const uint32_t schema = kSchema;
+  std::memcpy(stripped.data() + kVersionBytes, &schema, sizeof(schema));
+  const uint64_t len = layout.BlockOffset(1) - layout.BlockOffset(0);
+  stripped += original.substr(layout.BlockOffset(1), len);
+  stripped += original.substr(layout.BlockOffset(0), len);
+  stripped += original.substr(layout.BlockOffset(2));
+  WriteFile(enc_path, stripped);
+
+  // the blocks still authenticate on their own
+  const std::string raw = ReadFile(Path("raw"));
+  const uint64_t raw_len = layout.RawOffset(1);
+  EXPECT_EQ(Decrypt(enc_path, data_key_),
+            raw.substr(raw_len, raw_len) + raw.substr(0, raw_len) +
+                raw.substr(2 * raw_len));
+  std::filesystem::remove(enc_path + ".dec");
+
+  FileCryptoOptions required;
+  required.require_integrity_index = true;
+  EXPECT_ANY_THROW(Decrypt(enc_path, data_key_, required));
+  EXPECT_FALSE(std::filesystem::exists(enc_path + ".dec"));
+  EXPECT_ANY_THROW(VerifyFile(enc_path, data_key_, required));
+  EXPECT_ANY_THROW(DecryptRange(enc_path, 0, 10, data_key_, required));
+  EXPECT_ANY_THROW(ReencryptToDir(enc_path, Path("rotated"), data_key_,
+                                  new_key_, required));
+}
+
+INSTANTIATE_TEST_SUITE_P(Versions, TamperTest,
+                         ::testing::Values(kVersion, kVersion2));
+
+TEST_F(CryptoUtilTest, VersionTwoPacksBlockHeaders) {
+  const std::string data = TestData(100000, 9);
+  FileCryptoOptions options = SmallBlocks();
+  options.block_bytes = 1024;
+  const auto v1_path = Encrypt("v1", data, options);
+  options.format_version = kVersion2;
+  const auto v2_path = Encrypt("v2", data, options);
+  PosixFile v1(v1_path, O_RDONLY);
+  PosixFile v2(v2_path, O_RDONLY);
+  const auto v1_layout = ReadFileLayout(v1);
+  const auto v2_layout = ReadFileLayout(v2);
+  EXPECT_EQ(v2_layout.BlockHeaderBytes(), kBlockHeaderBytesV2);
+  // more raw data per block, and an 8 byte index entry per block
+  EXPECT_LT(v2_layout.packet_cnt, v1_layout.packet_cnt);
+  EXPECT_LT(std::filesystem::file_size(v2_path),
+            std::filesystem::file_size(v1_path));
+}
+
+TEST_F(CryptoUtilTest, VersionOneFixture) {
+  const std::vector<uint8_t> key = {0, 1, 2,  3,  4,  5,  6,  7,
+                                    8, 9, 10, 11, 12, 13, 14, 15};
+  const std::string raw = V1FixtureRaw();
+  std::filesystem::copy(kV1Fixture, Path("fixture.enc"));
+  EXPECT_EQ(Decrypt(Path("fixture.enc"), key), raw);
+  EXPECT_TRUE(VerifyFile(Path("fixture.enc"), key).bad_blocks.empty());
+  const auto range = DecryptRange(Path("fixture.enc"), 8000, 400, key);
+  EXPECT_EQ(std::string(range.begin(), range.end()), raw.substr(8000, 400));
+
+  // the defaults still write files of the same layout with AES-GCM
+  FileCryptoOptions options;
+  options.cipher_suite = CipherSuite::kAesGcm;
+  const auto enc_path = Encrypt("raw", raw, options);
+  PosixFile fixture(Path("fixture.enc"), O_RDONLY);
+  PosixFile encrypted(enc_path, O_RDONLY);
+  const auto fixture_layout = ReadFileLayout(fixture);
+  const auto layout = ReadFileLayout(encrypted);
+  EXPECT_EQ(layout.version, fixture_layout.version);
+  EXPECT_EQ(layout.schema, fixture_layout.schema);
+  EXPECT_EQ(layout.block_len, fixture_layout.block_len);
+  EXPECT_EQ(layout.packet_cnt, fixture_layout.packet_cnt);
+  EXPECT_EQ(std::filesystem::file_size(enc_path),
+            std::filesystem::file_size(Path("fixture.enc")));
+}
+
+}  // namespace
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
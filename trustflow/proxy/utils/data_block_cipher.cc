@@ -0,0 +1,242 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trustflow/proxy/utils/data_block_cipher.h"
+
+#if defined(__aarch64__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#include "openssl/kdf.h"
+#include "yacl/base/exception.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+namespace {
+
+const EVP_CIPHER* GetGcmCipher(size_t key_len) {
+  if (key_len == kAes128KeyLen) {
+    return EVP_aes_128_gcm();
+  } else if (key_len == kAes256KeyLen) {
+    return EVP_aes_256_gcm();
+  }
+  YACL_THROW("data_key size error got {}", key_len);
+}
+
+// HKDF info of the expansion of 16 byte keys for ChaCha20-Poly1305
+constexpr char kChaCha20KeyInfo[] = "trustflow chacha20-poly1305 key";
+
+// HKDF info of the reduction of 32 byte keys for SM4-GCM
+constexpr char kSm4KeyInfo[] = "trustflow sm4-gcm key";
+
+// Whether AES-GCM runs on AES and carry-less multiplication instructions,
+// without them OpenSSL falls back to constant time software AES and GHASH,
+// which run several times slower than ChaCha20-Poly1305
+bool HasAesGcmInstructions() {
+#if defined(__x86_64__)
+  return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__)
+  const unsigned long hwcap = ::getauxval(AT_HWCAP);
+  return (hwcap & HWCAP_AES) != 0 && (hwcap & HWCAP_PMULL) != 0;
+#else
+  return false;
+#endif
+}
+
+}  // namespace
+
+CipherSuite CipherSuiteFromName(const std::string& name) {
+  if (name.empty() || name == "aes-gcm") {
+    return CipherSuite::kAesGcm;
+  }
+  if (name == "chacha20-poly1305") {
+    return CipherSuite::kChaCha20Poly1305;
+  }
+  if (name == "sm4-gcm") {
+    return CipherSuite::kSm4Gcm;
+  }
+  if (name == "auto") {
+    return CipherSuite::kAuto;
+  }
+  YACL_THROW("Unsupported cipher suite {}", name);
+}
+
+const char* CipherSuiteName(CipherSuite suite) {
+  switch (suite) {
+    case CipherSuite::kAesGcm:
+      return "aes-gcm";
+    case CipherSuite::kChaCha20Poly1305:
+      return "chacha20-poly1305";
+    case CipherSuite::kSm4Gcm:
+      return "sm4-gcm";
+    case CipherSuite::kAuto:
+      return "auto";
+  }
+  return "unknown";
+}
+
+CipherSuite FasterCipherSuite() {
+  static const CipherSuite suite = HasAesGcmInstructions()
+                                       ? CipherSuite::kAesGcm
+                                       : CipherSuite::kChaCha20Poly1305;
+  return suite;
+}
+
+std::vector<uint8_t> HkdfSha256(yacl::ByteContainerView key,
+                                yacl::ByteContainerView salt,
+                                const std::string& info, size_t len) {
+  YACL_ENFORCE(!key.empty(), "HKDF key is empty");
+  std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> ctx(
+      EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr), EVP_PKEY_CTX_free);
+  YACL_ENFORCE(ctx != nullptr, "EVP_PKEY_CTX_new_id failed");
+  std::vector<uint8_t> out(len);
+  // no salt means a zero one, RFC 5869 2.2
+  YACL_ENFORCE(
+      EVP_PKEY_derive_init(ctx.get()) > 0 &&
+          EVP_PKEY_CTX_set_hkdf_md(ctx.get(), EVP_sha256()) > 0 &&
+          (salt.empty() ||
+           EVP_PKEY_CTX_set1_hkdf_salt(ctx.get(), salt.data(),
+                                       static_cast<int>(salt.size())) > 0) &&
+          EVP_PKEY_CTX_set1_hkdf_key(ctx.get(), key.data(),
+                                     static_cast<int>(key.size())) > 0 &&
+          EVP_PKEY_CTX_add1_hkdf_info(
+              ctx.get(), reinterpret_cast<const uint8_t*>(info.data()),
+              static_cast<int>(info.size())) > 0 &&
+          EVP_PKEY_derive(ctx.get(), out.data(), &len) > 0,
+      "HKDF derivation failed");
+  return out;
+}
+
+DataBlockCipher::DataBlockCipher(yacl::ByteContainerView key,
+                                 CipherSuite suite)
+    : suite_(suite),
+      encrypt_ctx_(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free),
+      decrypt_ctx_(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free) {
+  const EVP_CIPHER* cipher = nullptr;
+  std::vector<uint8_t> expanded_key;
+  if (suite_ == CipherSuite::kChaCha20Poly1305) {
+    cipher = EVP_chacha20_poly1305();
+    if (key.size() == kAes128KeyLen) {
+      expanded_key =
+          HkdfSha256(key, {}, kChaCha20KeyInfo, kChaCha20KeyLen);
+      key = expanded_key;
+    }
+    YACL_ENFORCE_EQ(key.size(), kChaCha20KeyLen, "data_key size error");
+  } else if (suite_ == CipherSuite::kSm4Gcm) {
+    if (key.size() == kAes256KeyLen) {
+      expanded_key = HkdfSha256(key, {}, kSm4KeyInfo, kSm4KeyLen);
+      key = expanded_key;
+    }
+    YACL_ENFORCE_EQ(key.size(), kSm4KeyLen, "data_key size error");
+    // not the SM4-GCM of OpenSSL, which older builds lack and which runs
+    // the table based SM4 on x86
+    sm4_gcm_ = std::make_unique<Sm4Gcm>(key);
+    return;
+  } else {
+    YACL_ENFORCE(suite_ == CipherSuite::kAesGcm, "Unsupported cipher suite {}",
+                 static_cast<int>(suite_));
+    cipher = GetGcmCipher(key.size());
+  }
+  YACL_ENFORCE(encrypt_ctx_ != nullptr && decrypt_ctx_ != nullptr,
+               "EVP_CIPHER_CTX_new failed");
+
+  // expand the key once, blocks only set their IV later
+  YACL_ENFORCE_EQ(EVP_EncryptInit_ex(encrypt_ctx_.get(), cipher, nullptr,
+                                     nullptr, nullptr),
+                  1);
+  YACL_ENFORCE_EQ(EVP_CIPHER_CTX_ctrl(encrypt_ctx_.get(),
+                                      EVP_CTRL_AEAD_SET_IVLEN, kIvBytes,
+                                      nullptr),
+                  1);
+  YACL_ENFORCE_EQ(EVP_EncryptInit_ex(encrypt_ctx_.get(), nullptr, nullptr,
+                                     key.data(), nullptr),
+                  1);
+
+  YACL_ENFORCE_EQ(EVP_DecryptInit_ex(decrypt_ctx_.get(), cipher, nullptr,
+                                     nullptr, nullptr),
+                  1);
+  YACL_ENFORCE_EQ(EVP_CIPHER_CTX_ctrl(decrypt_ctx_.get(),
+                                      EVP_CTRL_AEAD_SET_IVLEN, kIvBytes,
+                                      nullptr),
+                  1);
+  YACL_ENFORCE_EQ(EVP_DecryptInit_ex(decrypt_ctx_.get(), nullptr, nullptr,
+                                     key.data(), nullptr),
+                  1);
+}
+
+void DataBlockCipher::Encrypt(yacl::ByteContainerView iv,
+                              yacl::ByteContainerView plaintext,
+                              absl::Span<uint8_t> ciphertext,
+                              absl::Span<uint8_t> mac) {
+  YACL_ENFORCE_EQ(iv.size(), kIvBytes, "IV length error");
+  YACL_ENFORCE_EQ(mac.size(), kMacBytes, "MAC length error");
+  YACL_ENFORCE_EQ(ciphertext.size(), plaintext.size(),
+                  "Ciphertext size mismatch");
+  if (sm4_gcm_ != nullptr) {
+    sm4_gcm_->Encrypt(iv, {}, plaintext, ciphertext, mac);
+    return;
+  }
+
+  EVP_CIPHER_CTX* ctx = encrypt_ctx_.get();
+  int out_len = 0;
+  YACL_ENFORCE_EQ(
+      EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, iv.data()), 1);
+  YACL_ENFORCE_EQ(EVP_EncryptUpdate(ctx, ciphertext.data(), &out_len,
+                                    plaintext.data(), plaintext.size()),
+                  1);
+  YACL_ENFORCE_EQ(EVP_EncryptFinal_ex(ctx, ciphertext.data() + out_len,
+                                      &out_len),
+                  1);
+  YACL_ENFORCE_EQ(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, kMacBytes,
+                                      mac.data()),
+                  1);
+}
+
+void DataBlockCipher::Decrypt(yacl::ByteContainerView iv,
+                              yacl::ByteContainerView ciphertext,
+                              yacl::ByteContainerView mac,
+                              absl::Span<uint8_t> plaintext) {
+  YACL_ENFORCE_EQ(iv.size(), kIvBytes, "IV length error");
+  YACL_ENFORCE_EQ(mac.size(), kMacBytes, "MAC length error");
+  YACL_ENFORCE_EQ(plaintext.size(), ciphertext.size(),
+                  "Plaintext size mismatch");
+  if (sm4_gcm_ != nullptr) {
+    YACL_ENFORCE(sm4_gcm_->Decrypt(iv, {}, ciphertext, mac, plaintext),
+                 "Decrypt error, {} mac check failed.",
+                 CipherSuiteName(suite_));
+    return;
+  }
+
+  EVP_CIPHER_CTX* ctx = decrypt_ctx_.get();
+  int out_len = 0;
+  YACL_ENFORCE_EQ(
+      EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, iv.data()), 1);
+  YACL_ENFORCE_EQ(EVP_DecryptUpdate(ctx, plaintext.data(), &out_len,
+                                    ciphertext.data(), ciphertext.size()),
+                  1);
+  YACL_ENFORCE_EQ(
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, kMacBytes,
+                          const_cast<uint8_t*>(mac.data())),
+      1);
+  YACL_ENFORCE(
+      EVP_DecryptFinal_ex(ctx, plaintext.data() + out_len, &out_len) > 0,
+      "Decrypt error, {} mac check failed.", CipherSuiteName(suite_));
+}
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
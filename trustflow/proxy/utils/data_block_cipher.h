@@ -0,0 +1,101 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/types/span.h"
+#include "openssl/evp.h"
+#include "yacl/base/byte_container_view.h"
+
+#include "trustflow/proxy/utils/sm4_gcm.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+constexpr uint8_t kIvBytes = 12;
+constexpr uint8_t kMacBytes = 16;
+constexpr uint8_t kAes128KeyLen = 16;
+constexpr uint8_t kAes256KeyLen = 32;
+constexpr uint8_t kChaCha20KeyLen = 32;
+
+// AEAD of the data blocks, the value is stored in encrypted files
+// Every suite takes a 12 byte IV and makes a 16 byte MAC.
+enum class CipherSuite : uint8_t {
+  kAesGcm = 0,
+  kChaCha20Poly1305 = 1,
+  // SM4-GCM of RFC 8998, for deployments bound to the SM cipher series
+  kSm4Gcm = 2,
+  // not stored, encryption picks the faster suite of the host, see
+  // FasterCipherSuite
+  kAuto = 0xff,
+};
+
+// Parse "aes-gcm", "chacha20-poly1305", "sm4-gcm" or "auto"
+CipherSuite CipherSuiteFromName(const std::string& name);
+
+const char* CipherSuiteName(CipherSuite suite);
+
+// The faster of kAesGcm and kChaCha20Poly1305 on this host, kAesGcm where
+// the CPU has AES and carry-less multiplication instructions, on x86 and
+// ARMv8, and kChaCha20Poly1305 otherwise, as it runs several times faster
+// than AES-GCM in software. Deterministic for a host, so that the suite
+// does not vary between runs or with the load.
+CipherSuite FasterCipherSuite();
+
+// HKDF-SHA256 of len bytes from key, salt and info
+std::vector<uint8_t> HkdfSha256(yacl::ByteContainerView key,
+                                yacl::ByteContainerView salt,
+                                const std::string& info, size_t len);
+
+// AEAD engine for the data blocks of one file. For kAesGcm the key length
+// picks AES-128 or AES-256, kChaCha20Poly1305 takes a 32 byte key or
+// expands a 16 byte one with HKDF and kSm4Gcm takes a 16 byte key or reduces
+// a 32 byte one with HKDF. The key schedule is set up once, then each block
+// only sets a new IV on the kept contexts.
+// Not thread safe, every thread should own its engine.
+class DataBlockCipher {
+ public:
+  explicit DataBlockCipher(yacl::ByteContainerView key,
+                           CipherSuite suite = CipherSuite::kAesGcm);
+
+  DataBlockCipher(DataBlockCipher&&) = default;
+  DataBlockCipher& operator=(DataBlockCipher&&) = default;
+
+  void Encrypt(yacl::ByteContainerView iv, yacl::ByteContainerView plaintext,
+               absl::Span<uint8_t> ciphertext, absl::Span<uint8_t> mac);
+
+  // Throw if the mac does not match
+  void Decrypt(yacl::ByteContainerView iv, yacl::ByteContainerView ciphertext,
+               yacl::ByteContainerView mac, absl::Span<uint8_t> plaintext);
+
+ private:
+  using UniqueCipherCtx =
+      std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)>;
+
+  CipherSuite suite_;
+  UniqueCipherCtx encrypt_ctx_;
+  UniqueCipherCtx decrypt_ctx_;
+  // engine of kSm4Gcm, which leaves the contexts unused
+  std::unique_ptr<Sm4Gcm> sm4_gcm_;
+};
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
@@ -0,0 +1,152 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trustflow/proxy/utils/decrypting_random_access_file.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "yacl/base/exception.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+DecryptingRandomAccessFile::DecryptingRandomAccessFile(
+    const std::string& path, yacl::ByteContainerView data_key,
+    size_t cache_blocks, bool require_integrity_index)
+    : file_(path, O_RDONLY), cache_blocks_(cache_blocks) {
+  layout_ = ReadFileLayout(file_);
+  file_key_ = FileKey(layout_, data_key);
+  // check the key length up front and keep the engine for the first read
+  engines_.push_back(std::make_unique<Engine>(*this));
+  index_ = IntegrityIndex::Open(file_, layout_, file_key_,
+                                require_integrity_index);
+  length_ = layout_.RawOffset(layout_.packet_cnt);
+}
+
+size_t DecryptingRandomAccessFile::ReadAt(uint64_t offset,
+                                          absl::Span<uint8_t> buf) {
+  if (offset >= length_ || buf.empty()) {
+    return 0;
+  }
+  const size_t len = std::min<uint64_t>(buf.size(), length_ - offset);
+
+  size_t done = 0;
+  while (done < len) {
+    const uint64_t pos = offset + done;
+    const uint64_t index = layout_.BlockOf(pos);
+    const uint64_t block_offset = pos - layout_.RawOffset(index);
+    auto block = GetBlock(index);
+    const size_t n = std::min<uint64_t>(len - done,
+                                        block->size() - block_offset);
+    std::memcpy(buf.data() + done, block->data() + block_offset, n);
+    done += n;
+  }
+  return len;
+}
+
+std::vector<uint8_t> DecryptingRandomAccessFile::ReadAt(uint64_t offset,
+                                                        size_t len) {
+  if (offset >= length_) {
+    return {};
+  }
+  std::vector<uint8_t> buf(std::min<uint64_t>(len, length_ - offset));
+  ReadAt(offset, absl::MakeSpan(buf));
+  return buf;
+}
+
+DecryptingRandomAccessFile::Block DecryptingRandomAccessFile::GetBlock(
+    uint64_t index) {
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    auto it = cache_.find(index);
+    if (it != cache_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      return it->second->second;
+    }
+  }
+
+  // decrypt outside the lock so that readers of other blocks don't wait,
+  // concurrent misses on the same block may decrypt it twice
+  auto block = DecryptBlock(index);
+  if (cache_blocks_ == 0) {
+    return block;
+  }
+
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  auto it = cache_.find(index);
+  if (it != cache_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->second;
+  }
+  lru_.emplace_front(index, block);
+  cache_[index] = lru_.begin();
+  if (lru_.size() > cache_blocks_) {
+    cache_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+  return block;
+}
+
+DecryptingRandomAccessFile::Block DecryptingRandomAccessFile::DecryptBlock(
+    uint64_t index) {
+  YACL_ENFORCE_LT(index, layout_.packet_cnt, "Block index out of range");
+  const uint64_t begin = layout_.BlockOffset(index);
+  std::vector<uint8_t> data_block(layout_.BlockOffset(index + 1) - begin);
+  file_.ReadAt(begin, absl::MakeSpan(data_block));
+
+  std::unique_ptr<Engine> engine;
+  {
+    std::lock_guard<std::mutex> lock(engine_mutex_);
+    if (!engines_.empty()) {
+      engine = std::move(engines_.back());
+      engines_.pop_back();
+    }
+  }
+  if (!engine) {
+    engine = std::make_unique<Engine>(*this);
+  }
+
+  auto raw_data = std::make_shared<std::vector<uint8_t>>(
+      layout_.RawOffset(index + 1) - layout_.RawOffset(index));
+  if (engine->decompressor != nullptr) {
+    DecryptDataBlock(layout_.version, data_block, engine->cipher,
+                     *engine->decompressor, absl::MakeSpan(*raw_data));
+  } else {
+    DecryptDataBlock(layout_.version, data_block, engine->cipher,
+                     absl::MakeSpan(*raw_data));
+  }
+  if (index_ != nullptr) {
+    index_->CheckBlock(index, BlockTag(layout_.version, data_block));
+  }
+
+  std::lock_guard<std::mutex> lock(engine_mutex_);
+  engines_.push_back(std::move(engine));
+  return raw_data;
+}
+
+DecryptingRandomAccessFile::Engine::Engine(
+    const DecryptingRandomAccessFile& file)
+    : cipher(file.file_key_, file.layout_.cipher_suite) {
+  if (file.layout_.compression != Compression::kNone) {
+    decompressor = std::make_unique<BlockDecompressor>();
+  }
+}
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
@@ -0,0 +1,108 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "absl/types/span.h"
+#include "yacl/base/byte_container_view.h"
+
+#include "trustflow/proxy/utils/compression.h"
+#include "trustflow/proxy/utils/data_block_cipher.h"
+#include "trustflow/proxy/utils/enc_file_format.h"
+#include "trustflow/proxy/utils/integrity_index.h"
+#include "trustflow/proxy/utils/io_util.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+// Random access to the plaintext of an encrypted file without decrypting it
+// to disk. Only the data blocks covering a read are decrypted, and the most
+// recently used ones are cached. If the file has an integrity index, each
+// decrypted block is checked against its path to the Merkle root.
+// ReadAt is thread safe.
+class DecryptingRandomAccessFile {
+ public:
+  static constexpr size_t kDefaultCacheBlocks = 8;
+
+  // cache_blocks is the number of decrypted data blocks kept, 0 disables
+  // the cache. require_integrity_index rejects files without an index, see
+  // FileCryptoOptions::require_integrity_index.
+  DecryptingRandomAccessFile(const std::string& path,
+                             yacl::ByteContainerView data_key,
+                             size_t cache_blocks = kDefaultCacheBlocks,
+                             bool require_integrity_index = false);
+
+  DecryptingRandomAccessFile(const DecryptingRandomAccessFile&) = delete;
+  DecryptingRandomAccessFile& operator=(const DecryptingRandomAccessFile&) =
+      delete;
+
+  // Length of the plaintext
+  uint64_t GetLength() const { return length_; }
+
+  // Read up to buf.size() bytes of plaintext from offset into buf
+  // Return the number of bytes read, which is less than buf.size() only if
+  // the plaintext ends before
+  size_t ReadAt(uint64_t offset, absl::Span<uint8_t> buf);
+
+  std::vector<uint8_t> ReadAt(uint64_t offset, size_t len);
+
+ private:
+  using Block = std::shared_ptr<const std::vector<uint8_t>>;
+
+  // Plaintext of data block index, from the cache if present
+  Block GetBlock(uint64_t index);
+
+  Block DecryptBlock(uint64_t index);
+
+  // cipher engine and, for compressed files, decompressor of a decryption
+  struct Engine {
+    explicit Engine(const DecryptingRandomAccessFile& file);
+
+    DataBlockCipher cipher;
+    std::unique_ptr<BlockDecompressor> decompressor;
+  };
+
+  PosixFile file_;
+  // key of the data blocks, see FileKey
+  std::vector<uint8_t> file_key_;
+
+  // idle engines, one is taken by each decryption in flight
+  std::mutex engine_mutex_;
+  std::vector<std::unique_ptr<Engine>> engines_;
+
+  EncFileLayout layout_;
+  std::unique_ptr<IntegrityIndex> index_;
+  uint64_t length_ = 0;
+
+  // LRU of decrypted blocks, most recently used first
+  size_t cache_blocks_ = 0;
+  std::mutex cache_mutex_;
+  std::list<std::pair<uint64_t, Block>> lru_;
+  std::unordered_map<uint64_t, std::list<std::pair<uint64_t, Block>>::iterator>
+      cache_;
+};
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
@@ -0,0 +1,221 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trustflow/proxy/utils/decrypting_random_access_file.h"
+
+#include <fcntl.h>
+
+#include <filesystem>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "trustflow/proxy/utils/crypto_util.h"
+#include "trustflow/proxy/utils/enc_file_format.h"
+#include "trustflow/proxy/utils/io_util.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+namespace {
+
+constexpr size_t kRawBytes = 20000;
+
+std::string AsString(const std::vector<uint8_t>& bytes) {
+  return std::string(bytes.begin(), bytes.end());
+}
+
+class DecryptingRandomAccessFileTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    dir_ = std::filesystem::path(::testing::TempDir()) /
+           "decrypting_random_access_file_test" /
+           ::testing::UnitTest::GetInstance()->current_test_info()->name();
+    std::filesystem::remove_all(dir_);
+    std::filesystem::create_directories(dir_);
+
+    std::mt19937 rng(1);
+    data_.resize(kRawBytes);
+    for (auto& c : data_) {
+      c = static_cast<char>(rng());
+    }
+    raw_path_ = dir_ / "raw";
+    enc_path_ = dir_ / "raw.enc";
+    WriteFile(raw_path_, data_);
+    FileCryptoOptions options;
+    options.block_bytes = 4096;
+    EncryptFile(raw_path_, enc_path_, data_key_, options);
+    PosixFile in(enc_path_, O_RDONLY);
+    layout_ = ReadFileLayout(in);
+  }
+
+  void TearDown() override { std::filesystem::remove_all(dir_); }
+
+  // Flip a ciphertext bit of data block index in place, which open readers
+  // see on their next read of the block
+  void TamperBlock(uint64_t index) {
+    PosixFile file(enc_path_, O_RDWR);
+    const uint64_t offset =
+        layout_.BlockOffset(index) + layout_.BlockHeaderBytes();
+    uint8_t byte = 0;
+    file.ReadAt(offset, absl::MakeSpan(&byte, 1));
+    byte ^= 1;
+    file.WriteAt(offset, yacl::ByteContainerView(&byte, 1));
+  }
+
+  // Raw data of data block index
+  std::string Block(uint64_t index) const {
+    return data_.substr(layout_.RawOffset(index),
+                        layout_.RawOffset(index + 1) -
+                            layout_.RawOffset(index));
+  }
+
+  std::filesystem::path dir_;
+  std::string raw_path_;
+  std::string enc_path_;
+  std::string data_;
+  EncFileLayout layout_;
+  const std::vector<uint8_t> data_key_ = std::vector<uint8_t>(16, 0x11);
+};
+
+TEST_F(DecryptingRandomAccessFileTest, ReadsAcrossBlocks) {
+  DecryptingRandomAccessFile file(enc_path_, data_key_);
+  ASSERT_EQ(file.GetLength(), kRawBytes);
+  ASSERT_GT(layout_.packet_cnt, 4u);
+  const uint64_t boundary = layout_.RawOffset(1);
+  for (const auto& [offset, len] : std::vector<std::pair<uint64_t, size_t>>{
+           {0, 1},
+           {boundary - 1, 2},
+           {boundary, 1},
+           {boundary - 100, layout_.RawOffset(3) - boundary + 200},
+           {0, kRawBytes}}) {
+    EXPECT_EQ(AsString(file.ReadAt(offset, len)), data_.substr(offset, len))
+        << "offset " << offset << " length " << len;
+  }
+}
+
+TEST_F(DecryptingRandomAccessFileTest, ReadsPastEnd) {
+  DecryptingRandomAccessFile file(enc_path_, data_key_);
+  std::vector<uint8_t> buf(100);
+  EXPECT_EQ(file.ReadAt(kRawBytes - 10, absl::MakeSpan(buf)), 10u);
+  EXPECT_EQ(std::string(buf.begin(), buf.begin() + 10),
+            data_.substr(kRawBytes - 10));
+  EXPECT_EQ(file.ReadAt(kRawBytes, absl::MakeSpan(buf)), 0u);
+  EXPECT_EQ(file.ReadAt(kRawBytes + 1000, absl::MakeSpan(buf)), 0u);
+  EXPECT_EQ(AsString(file.ReadAt(kRawBytes - 10, 100)),
+            data_.substr(kRawBytes - 10));
+  EXPECT_TRUE(file.ReadAt(kRawBytes, 100).empty());
+}
+
+TEST_F(DecryptingRandomAccessFileTest, WithoutCacheEveryReadDecrypts) {
+  DecryptingRandomAccessFile file(enc_path_, data_key_, 0);
+  EXPECT_EQ(AsString(file.ReadAt(0, 10)), data_.substr(0, 10));
+  TamperBlock(0);
+  EXPECT_ANY_THROW(file.ReadAt(0, 10));
+}
+
+TEST_F(DecryptingRandomAccessFileTest, CacheOfOneBlock) {
+  DecryptingRandomAccessFile file(enc_path_, data_key_, 1);
+  EXPECT_EQ(AsString(file.ReadAt(0, 10)), data_.substr(0, 10));
+  TamperBlock(0);
+  // still cached
+  EXPECT_EQ(AsString(file.ReadAt(5, 10)), data_.substr(5, 10));
+  // evicted by block 1
+  EXPECT_EQ(AsString(file.ReadAt(layout_.RawOffset(1), 10)),
+            Block(1).substr(0, 10));
+  EXPECT_ANY_THROW(file.ReadAt(0, 10));
+}
+
+TEST_F(DecryptingRandomAccessFileTest, CacheEvictsLeastRecentlyUsed) {
+  DecryptingRandomAccessFile file(enc_path_, data_key_, 2);
+  for (uint64_t index : {0, 1, 0, 2}) {
+    EXPECT_EQ(AsString(file.ReadAt(layout_.RawOffset(index), 10)),
+              Block(index).substr(0, 10));
+  }
+  TamperBlock(0);
+  TamperBlock(1);
+  TamperBlock(2);
+  // blocks 0 and 2 are cached, block 1 was evicted by block 2
+  EXPECT_EQ(AsString(file.ReadAt(layout_.RawOffset(0), 10)),
+            Block(0).substr(0, 10));
+  EXPECT_EQ(AsString(file.ReadAt(layout_.RawOffset(2), 10)),
+            Block(2).substr(0, 10));
+  EXPECT_ANY_THROW(file.ReadAt(layout_.RawOffset(1), 10));
+}
+
+TEST_F(DecryptingRandomAccessFileTest, ConcurrentReads) {
+  for (size_t cache_blocks : {0, 2, 8}) {
+    DecryptingRandomAccessFile file(enc_path_, data_key_, cache_blocks);
+    std::vector<std::thread> threads;
+    std::vector<int> failures(8);
+    for (size_t t = 0; t < failures.size(); ++t) {
+      threads.emplace_back([&, t] {
+        std::mt19937 rng(t);
+        for (int i = 0; i < 200; ++i) {
+          const uint64_t offset = rng() % kRawBytes;
+          const size_t len = rng() % 6000;
+          if (AsString(file.ReadAt(offset, len)) !=
+              data_.substr(offset, len)) {
+            ++failures[t];
+          }
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    for (size_t t = 0; t < failures.size(); ++t) {
+      EXPECT_EQ(failures[t], 0)
+          << "thread " << t << " cache blocks " << cache_blocks;
+    }
+  }
+}
+
+TEST_F(DecryptingRandomAccessFileTest, TamperedBlockThrows) {
+  TamperBlock(2);
+  DecryptingRandomAccessFile file(enc_path_, data_key_);
+  EXPECT_ANY_THROW(file.ReadAt(layout_.RawOffset(2) + 100, 1));
+  EXPECT_ANY_THROW(file.ReadAt(0, kRawBytes));
+  // other blocks still read
+  EXPECT_EQ(AsString(file.ReadAt(layout_.RawOffset(3), 10)),
+            Block(3).substr(0, 10));
+
+  EXPECT_ANY_THROW(
+      DecryptingRandomAccessFile(enc_path_, std::vector<uint8_t>(16, 0x22))
+          .ReadAt(0, 1));
+}
+
+TEST_F(DecryptingRandomAccessFileTest, RequiresIntegrityIndex) {
+  constexpr size_t kCacheBlocks =
+      DecryptingRandomAccessFile::kDefaultCacheBlocks;
+  EXPECT_ANY_THROW(
+      DecryptingRandomAccessFile(enc_path_, data_key_, kCacheBlocks, true));
+
+  FileCryptoOptions options;
+  options.block_bytes = 4096;
+  options.integrity_index = true;
+  EncryptFile(raw_path_, enc_path_, data_key_, options);
+  DecryptingRandomAccessFile file(enc_path_, data_key_, kCacheBlocks, true);
+  EXPECT_EQ(AsString(file.ReadAt(0, kRawBytes)), data_);
+}
+
+}  // namespace
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
@@ -0,0 +1,569 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trustflow/proxy/utils/enc_file_format.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "yacl/crypto/rand/rand.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+BlockIvSource::BlockIvSource(IvMode mode) : mode_(mode) {
+  if (mode_ == IvMode::kCounter) {
+    yacl::crypto::FillRand(reinterpret_cast<char*>(fixed_field_.data()),
+                           fixed_field_.size());
+  }
+}
+
+void BlockIvSource::Generate(uint64_t index, absl::Span<uint8_t> iv) const {
+  YACL_ENFORCE_EQ(iv.size(), kIvBytes, "IV length error");
+  if (mode_ == IvMode::kRandom) {
+    yacl::crypto::FillRand(reinterpret_cast<char*>(iv.data()), iv.size(),
+                           true);
+    return;
+  }
+  YACL_ENFORCE_LT(index, kMaxCounterIvBlocks,
+                  "Block index {} exceeds the counter IV space", index);
+  const auto counter = static_cast<uint32_t>(index);
+  std::copy(fixed_field_.begin(), fixed_field_.end(), iv.begin());
+  std::memcpy(iv.data() + kIvFixedFieldBytes, &counter,
+              kIvInvocationFieldBytes);
+}
+
+uint64_t EncFileLayout::BlockOf(uint64_t raw_offset) const {
+  if (raw_offsets.empty()) {
+    return raw_offset / (block_len - BlockHeaderBytes());
+  }
+  return std::upper_bound(raw_offsets.begin(), raw_offsets.end(),
+                          raw_offset) -
+         raw_offsets.begin() - 1;
+}
+
+const ExtensionEntry* EncFileLayout::FindExtension(uint16_t type) const {
+  for (const auto& entry : extensions) {
+    if (entry.type == type) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+namespace {
+
+// HKDF info of the file key derivation
+constexpr char kFileKeyInfo[] = "trustflow file key";
+
+// Parse the entries of the extension area of in into layout
+void ReadExtensions(const PosixFile& in, uint64_t file_len,
+                    EncFileLayout* layout) {
+  YACL_ENFORCE_GE(file_len, kHeaderBytes + kExtLenBytes,
+                  "File length {} is less than required header length {}",
+                  file_len, kHeaderBytes + kExtLenBytes);
+  std::vector<uint8_t> buf(kExtEntryHeaderBytes);
+  in.ReadAt(kHeaderBytes, absl::MakeSpan(buf.data(), kExtLenBytes));
+  const auto ext_len =
+      Bytes2Int<uint32_t>(yacl::ByteContainerView(buf.data(), kExtLenBytes));
+  layout->data_offset = kHeaderBytes + kExtLenBytes + ext_len;
+  YACL_ENFORCE_GE(file_len, layout->data_offset,
+                  "Extension length {} is more than the file length {}",
+                  ext_len, file_len);
+
+  uint64_t offset = kHeaderBytes + kExtLenBytes;
+  while (offset < layout->data_offset) {
+    YACL_ENFORCE_GE(layout->data_offset - offset, kExtEntryHeaderBytes,
+                    "Extension entry header at {} is truncated", offset);
+    in.ReadAt(offset, absl::MakeSpan(buf));
+    ExtensionEntry entry;
+    entry.type = Bytes2Int<uint16_t>(
+        yacl::ByteContainerView(buf).subspan(0, kExtTypeBytes));
+    entry.len = Bytes2Int<uint32_t>(
+        yacl::ByteContainerView(buf).subspan(kExtTypeBytes));
+    entry.offset = offset + kExtEntryHeaderBytes;
+    YACL_ENFORCE_GE(layout->data_offset - entry.offset, entry.len,
+                    "Extension entry at {} is truncated", offset);
+    layout->extensions.push_back(entry);
+    offset = entry.offset + entry.len;
+  }
+}
+
+// Read the codec and the raw data length of a compressed file into layout
+void ReadCompression(const PosixFile& in, const ExtensionEntry& compression,
+                     EncFileLayout* layout) {
+  YACL_ENFORCE_EQ(compression.len, kExtCompressionBytes,
+                  "Compression extension length error");
+  std::vector<uint8_t> buf(kExtCompressionBytes);
+  in.ReadAt(compression.offset, absl::MakeSpan(buf));
+  layout->compression = static_cast<Compression>(buf[0]);
+  YACL_ENFORCE(layout->compression == Compression::kZstd,
+               "Unsupported compression {}", buf[0]);
+  layout->raw_len = Bytes2Int<uint64_t>(
+      yacl::ByteContainerView(buf).subspan(sizeof(Compression)));
+}
+
+// Read the data block bounds of a compressed version 1 file from its
+// kExtBlockLens entry into layout
+void ReadBlockLens(const PosixFile& in, uint64_t file_len,
+                   EncFileLayout* layout) {
+  const uint64_t packet_cnt = layout->packet_cnt;
+  const uint64_t raw_block_len = layout->block_len - kBlockHeaderBytes;
+  YACL_ENFORCE(raw_block_len != 0, "Raw data block len should not be 0");
+  YACL_ENFORCE(layout->raw_len > (packet_cnt - 1) * raw_block_len &&
+                   layout->raw_len <= packet_cnt * raw_block_len,
+               "Raw data len {} does not match {} data blocks",
+               layout->raw_len, packet_cnt);
+
+  const auto* lens = layout->FindExtension(kExtBlockLens);
+  YACL_ENFORCE(lens != nullptr && lens->len == packet_cnt * kExtBlockLenBytes,
+               "Data block lengths of {} are missing", in.path());
+  std::vector<uint8_t> buf(lens->len);
+  in.ReadAt(lens->offset, absl::MakeSpan(buf));
+  layout->block_offsets.resize(packet_cnt + 1);
+  layout->block_offsets[0] = layout->data_offset;
+  for (uint64_t i = 0; i < packet_cnt; ++i) {
+    const auto len = Bytes2Int<uint32_t>(yacl::ByteContainerView(buf).subspan(
+        i * kExtBlockLenBytes, kExtBlockLenBytes));
+    const uint64_t raw_len =
+        std::min(raw_block_len, layout->raw_len - i * raw_block_len);
+    YACL_ENFORCE(len >= kBlockHeaderBytes + kBlockCodecBytes &&
+                     len <= kBlockHeaderBytes + kBlockCodecBytes + raw_len,
+                 "Data block {} len {} is out of range", i, len);
+    layout->block_offsets[i + 1] = layout->block_offsets[i] + len;
+    layout->last_block_len = len;
+  }
+  YACL_ENFORCE_EQ(layout->block_offsets.back(), file_len,
+                  "Data block lens do not match the file length");
+}
+
+// Read the data block and raw data bounds of a version 2 file from its
+// index into layout
+void ReadBlockIndex(const PosixFile& in, uint64_t file_len,
+                    EncFileLayout* layout) {
+  const uint64_t packet_cnt = layout->packet_cnt;
+  YACL_ENFORCE_LE(packet_cnt, (file_len - layout->data_offset) /
+                                  kIndexEntryBytes,
+                  "File length {} is less than the index of {} data blocks",
+                  file_len, packet_cnt);
+  const uint64_t index_offset = file_len - packet_cnt * kIndexEntryBytes;
+  std::vector<uint8_t> buf(packet_cnt * kIndexEntryBytes);
+  in.ReadAt(index_offset, absl::MakeSpan(buf));
+
+  const bool compressed = layout->compression != Compression::kNone;
+  const uint64_t max_raw_len = layout->block_len - kBlockHeaderBytesV2;
+  layout->block_offsets.resize(packet_cnt + 1);
+  layout->raw_offsets.resize(packet_cnt + 1);
+  layout->block_offsets[0] = layout->data_offset;
+  layout->raw_offsets[0] = 0;
+  for (uint64_t i = 0; i < packet_cnt; ++i) {
+    const auto entry =
+        yacl::ByteContainerView(buf).subspan(i * kIndexEntryBytes);
+    const auto len = Bytes2Int<uint32_t>(entry.subspan(0, sizeof(uint32_t)));
+    const auto raw_len = Bytes2Int<uint32_t>(
+        entry.subspan(sizeof(uint32_t), sizeof(uint32_t)));
+    YACL_ENFORCE_LE(raw_len, max_raw_len,
+                    "Raw data len {} of data block {} is out of range",
+                    raw_len, i);
+    if (compressed) {
+      YACL_ENFORCE(len >= kBlockHeaderBytesV2 + kBlockCodecBytes &&
+                       len <= kBlockHeaderBytesV2 + kBlockCodecBytes + raw_len,
+                   "Data block {} len {} is out of range", i, len);
+    } else {
+      YACL_ENFORCE_EQ(len, kBlockHeaderBytesV2 + raw_len,
+                      "Data block {} len does not match its raw data", i);
+    }
+    layout->block_offsets[i + 1] = layout->block_offsets[i] + len;
+    layout->raw_offsets[i + 1] = layout->raw_offsets[i] + raw_len;
+    layout->last_block_len = len;
+  }
+  YACL_ENFORCE_EQ(layout->block_offsets.back(), index_offset,
+                  "Data block lens do not match the file length");
+  YACL_ENFORCE(!compressed || layout->raw_len == layout->raw_offsets.back(),
+               "Raw data len does not match the index");
+  layout->raw_len = layout->raw_offsets.back();
+}
+
+void ReadWrappedKey(const PosixFile& in, const ExtensionEntry& wrapped_key,
+                    EncFileLayout* layout) {
+  YACL_ENFORCE(wrapped_key.len == WrappedKeyBytes(kAes128KeyLen) ||
+                   wrapped_key.len == WrappedKeyBytes(kAes256KeyLen),
+               "Wrapped key length {} error", wrapped_key.len);
+  layout->wrapped_key.resize(wrapped_key.len);
+  in.ReadAt(wrapped_key.offset, absl::MakeSpan(layout->wrapped_key));
+}
+
+void ReadKeySalt(const PosixFile& in, const ExtensionEntry& key_salt,
+                 EncFileLayout* layout) {
+  YACL_ENFORCE_EQ(key_salt.len, kKeySaltBytes, "Key salt length error");
+  layout->key_salt.resize(key_salt.len);
+  in.ReadAt(key_salt.offset, absl::MakeSpan(layout->key_salt));
+}
+
+void ReadCipherSuite(const PosixFile& in, const ExtensionEntry& cipher_suite,
+                     EncFileLayout* layout) {
+  YACL_ENFORCE_EQ(cipher_suite.len, kExtCipherSuiteBytes,
+                  "Cipher suite length error");
+  uint8_t suite = 0;
+  in.ReadAt(cipher_suite.offset, absl::MakeSpan(&suite, 1));
+  YACL_ENFORCE(suite == static_cast<uint8_t>(CipherSuite::kAesGcm) ||
+                   suite == static_cast<uint8_t>(
+                                CipherSuite::kChaCha20Poly1305) ||
+                   suite == static_cast<uint8_t>(CipherSuite::kSm4Gcm),
+               "Unsupported cipher suite {}", suite);
+  layout->cipher_suite = static_cast<CipherSuite>(suite);
+}
+
+}  // namespace
+
+EncFileLayout ReadFileLayout(const PosixFile& in) {
+  auto file_len = in.GetLength();
+  YACL_ENFORCE_GT(file_len, kHeaderBytes,
+                  "File length {} is less than required header length {}",
+                  file_len, kHeaderBytes);
+
+  std::vector<uint8_t> buf(kHeaderBytes);
+  in.ReadAt(0, absl::MakeSpan(buf));
+
+  // versions other than kVersion2 and schemas other than kSchemaExtended
+  // are read as kVersion and kSchema, as before they existed
+  EncFileLayout layout;
+  if (Bytes2Int<uint32_t>(yacl::ByteContainerView(buf).subspan(
+          0, kVersionBytes)) == kVersion2) {
+    layout.version = kVersion2;
+  }
+  if (Bytes2Int<uint32_t>(yacl::ByteContainerView(buf).subspan(
+          kVersionBytes, kSchemaBytes)) == kSchemaExtended) {
+    layout.schema = kSchemaExtended;
+    ReadExtensions(in, file_len, &layout);
+  }
+
+  // read packet count
+  const auto counts =
+      yacl::ByteContainerView(buf).subspan(kVersionBytes + kSchemaBytes);
+  layout.packet_cnt =
+      Bytes2Int<uint64_t>(counts.subspan(0, kPacketCntBytes));
+  YACL_ENFORCE_GE(layout.packet_cnt, 1u, "Packet cnt is less than 1");
+  const uint64_t packet_cnt = layout.packet_cnt;
+
+  // read block len
+  layout.block_len =
+      Bytes2Int<uint32_t>(counts.subspan(kPacketCntBytes, kBlockLenBytes));
+  const uint32_t block_len = layout.block_len;
+
+  // avoid mul overflow
+  YACL_ENFORCE(block_len != 0, "block len should not be 0");
+  YACL_ENFORCE_GE(block_len, layout.BlockHeaderBytes(),
+                  "block len is less than data block header length");
+  YACL_ENFORCE_EQ((packet_cnt - 1) * block_len / block_len, (packet_cnt - 1),
+                  "uint64 overflow in DecryptFile");
+  YACL_ENFORCE_EQ(packet_cnt * block_len / block_len, packet_cnt,
+                  "uint64 overflow in DecryptFile");
+
+  const auto* wrapped_key = layout.FindExtension(kExtWrappedKey);
+  if (wrapped_key != nullptr) {
+    ReadWrappedKey(in, *wrapped_key, &layout);
+  }
+  const auto* key_salt = layout.FindExtension(kExtKeySalt);
+  if (key_salt != nullptr) {
+    YACL_ENFORCE(wrapped_key == nullptr,
+                 "File has both a wrapped key and a key salt");
+    ReadKeySalt(in, *key_salt, &layout);
+  }
+  const auto* cipher_suite = layout.FindExtension(kExtCipherSuite);
+  if (cipher_suite != nullptr) {
+    ReadCipherSuite(in, *cipher_suite, &layout);
+  }
+  const auto* compression = layout.FindExtension(kExtCompression);
+  if (compression != nullptr) {
+    ReadCompression(in, *compression, &layout);
+  }
+  if (layout.version == kVersion2) {
+    ReadBlockIndex(in, file_len, &layout);
+    return layout;
+  }
+  if (compression != nullptr) {
+    ReadBlockLens(in, file_len, &layout);
+    return layout;
+  }
+
+  // check length
+  const uint64_t data_len = file_len - layout.data_offset;
+  YACL_ENFORCE_GE(data_len, (packet_cnt - 1) * block_len,
+                  "N - 1 Data block len is more than required file length");
+  YACL_ENFORCE_GE(block_len * packet_cnt, data_len,
+                  "N Data block len is less than required file length");
+  layout.last_block_len = data_len - (packet_cnt - 1) * block_len;
+  YACL_ENFORCE_GE(layout.last_block_len, kBlockHeaderBytes,
+                  "Last data block len is less than data block header length");
+  layout.raw_len = (packet_cnt - 1) * (block_len - kBlockHeaderBytes) +
+                   layout.last_block_len - kBlockHeaderBytes;
+
+  return layout;
+}
+
+std::vector<uint8_t> WrapFileKey(yacl::ByteContainerView data_key,
+                                 yacl::ByteContainerView file_key) {
+  YACL_ENFORCE_EQ(file_key.size(), data_key.size(),
+                  "File key length should be the data key length");
+  std::vector<uint8_t> wrapped_key(WrappedKeyBytes(file_key.size()));
+  auto iv = absl::MakeSpan(wrapped_key.data(), kIvBytes);
+  yacl::crypto::FillRand(reinterpret_cast<char*>(iv.data()), iv.size());
+  DataBlockCipher(data_key).Encrypt(
+      iv, file_key,
+      absl::MakeSpan(wrapped_key.data() + kIvBytes, file_key.size()),
+      absl::MakeSpan(wrapped_key.data() + kIvBytes + file_key.size(),
+                     kMacBytes));
+  return wrapped_key;
+}
+
+std::vector<uint8_t> UnwrapFileKey(yacl::ByteContainerView data_key,
+                                   yacl::ByteContainerView wrapped_key) {
+  YACL_ENFORCE_EQ(wrapped_key.size(), WrappedKeyBytes(data_key.size()),
+                  "Wrapped key length does not match the data key");
+  std::vector<uint8_t> file_key(data_key.size());
+  DataBlockCipher(data_key).Decrypt(
+      wrapped_key.subspan(0, kIvBytes),
+      wrapped_key.subspan(kIvBytes, file_key.size()),
+      wrapped_key.subspan(kIvBytes + file_key.size()),
+      absl::MakeSpan(file_key));
+  return file_key;
+}
+
+std::vector<uint8_t> DeriveFileKey(yacl::ByteContainerView data_key,
+                                   yacl::ByteContainerView salt) {
+  return HkdfSha256(data_key, salt, kFileKeyInfo, data_key.size());
+}
+
+std::vector<uint8_t> FileKey(const EncFileLayout& layout,
+                             yacl::ByteContainerView data_key) {
+  if (!layout.wrapped_key.empty()) {
+    return UnwrapFileKey(data_key, layout.wrapped_key);
+  }
+  if (!layout.key_salt.empty()) {
+    return DeriveFileKey(data_key, layout.key_salt);
+  }
+  return std::vector<uint8_t>(data_key.begin(), data_key.end());
+}
+
+std::vector<uint8_t> EncodeHeader(uint64_t packet_cnt, uint32_t block_len,
+                                  uint32_t schema, uint32_t version) {
+  std::vector<uint8_t> header(kHeaderBytes);
+  uint8_t* ptr = header.data();
+  std::memcpy(ptr, &version, kVersionBytes);
+  ptr += kVersionBytes;
+  std::memcpy(ptr, &schema, kSchemaBytes);
+  ptr += kSchemaBytes;
+  std::memcpy(ptr, &packet_cnt, kPacketCntBytes);
+  ptr += kPacketCntBytes;
+  std::memcpy(ptr, &block_len, kBlockLenBytes);
+  return header;
+}
+
+std::vector<uint8_t> EncodeBlockIndex(const EncFileLayout& layout) {
+  std::vector<uint8_t> index(layout.packet_cnt * kIndexEntryBytes);
+  uint8_t* ptr = index.data();
+  for (uint64_t i = 0; i < layout.packet_cnt; ++i) {
+    const auto len = static_cast<uint32_t>(layout.BlockOffset(i + 1) -
+                                           layout.BlockOffset(i));
+    const auto raw_len =
+        static_cast<uint32_t>(layout.RawOffset(i + 1) - layout.RawOffset(i));
+    std::memcpy(ptr, &len, sizeof(len));
+    std::memcpy(ptr + sizeof(len), &raw_len, sizeof(raw_len));
+    ptr += kIndexEntryBytes;
+  }
+  return index;
+}
+
+void AppendExtension(std::vector<uint8_t>* area, uint16_t type,
+                     yacl::ByteContainerView value) {
+  YACL_ENFORCE_LE(value.size(), UINT32_MAX, "Extension value too long");
+  const auto len = static_cast<uint32_t>(value.size());
+  const size_t offset = area->size();
+  area->resize(offset + kExtEntryHeaderBytes);
+  std::memcpy(area->data() + offset, &type, kExtTypeBytes);
+  std::memcpy(area->data() + offset + kExtTypeBytes, &len, kExtValueLenBytes);
+  area->insert(area->end(), value.begin(), value.end());
+}
+
+uint64_t KeyExtensionBytes(const EncFileLayout& layout) {
+  if (!layout.wrapped_key.empty()) {
+    return kExtEntryHeaderBytes + layout.wrapped_key.size();
+  }
+  if (!layout.key_salt.empty()) {
+    return kExtEntryHeaderBytes + layout.key_salt.size();
+  }
+  return 0;
+}
+
+void AppendKeyExtension(const EncFileLayout& layout,
+                        std::vector<uint8_t>* area) {
+  if (!layout.wrapped_key.empty()) {
+    AppendExtension(area, kExtWrappedKey, layout.wrapped_key);
+  } else if (!layout.key_salt.empty()) {
+    AppendExtension(area, kExtKeySalt, layout.key_salt);
+  }
+}
+
+uint64_t CipherSuiteExtensionBytes(const EncFileLayout& layout) {
+  return layout.cipher_suite == CipherSuite::kAesGcm
+             ? 0
+             : kExtEntryHeaderBytes + kExtCipherSuiteBytes;
+}
+
+void AppendCipherSuiteExtension(const EncFileLayout& layout,
+                                std::vector<uint8_t>* area) {
+  if (layout.cipher_suite != CipherSuite::kAesGcm) {
+    const auto suite = static_cast<uint8_t>(layout.cipher_suite);
+    AppendExtension(area, kExtCipherSuite,
+                    yacl::ByteContainerView(&suite, 1));
+  }
+}
+
+uint64_t CompressionExtensionBytes(uint32_t version, uint64_t packet_cnt) {
+  if (version == kVersion2) {
+    return kExtEntryHeaderBytes + kExtCompressionBytes;
+  }
+  return 2 * kExtEntryHeaderBytes + kExtCompressionBytes +
+         packet_cnt * kExtBlockLenBytes;
+}
+
+void AppendCompressionExtensions(const EncFileLayout& layout,
+                                 std::vector<uint8_t>* area) {
+  std::vector<uint8_t> value(kExtCompressionBytes);
+  value[0] = static_cast<uint8_t>(layout.compression);
+  std::memcpy(value.data() + sizeof(Compression), &layout.raw_len,
+              sizeof(layout.raw_len));
+  AppendExtension(area, kExtCompression, value);
+  if (layout.version == kVersion2) {
+    return;
+  }
+
+  YACL_ENFORCE_EQ(layout.block_offsets.size(), layout.packet_cnt + 1,
+                  "Data block bounds are missing");
+  value.resize(layout.packet_cnt * kExtBlockLenBytes);
+  for (uint64_t i = 0; i < layout.packet_cnt; ++i) {
+    const auto len = static_cast<uint32_t>(layout.block_offsets[i + 1] -
+                                           layout.block_offsets[i]);
+    std::memcpy(value.data() + i * kExtBlockLenBytes, &len, sizeof(len));
+  }
+  AppendExtension(area, kExtBlockLens, value);
+}
+
+yacl::ByteContainerView BlockTag(uint32_t version,
+                                 yacl::ByteContainerView data_block) {
+  YACL_ENFORCE_GE(data_block.size(), BlockHeaderBytes(version),
+                  "Data block format is not correct");
+  if (version == kVersion2) {
+    return data_block.subspan(kIvBytes, kMacBytes);
+  }
+  const size_t mac_offset = kIvLenBytes + kIvFieldBytes;
+  const auto mac_len = data_block[mac_offset];
+  YACL_ENFORCE_LE(mac_len, kMacFieldBytes, "Data block format is not correct");
+  return data_block.subspan(mac_offset + kMacLenBytes, mac_len);
+}
+
+// Step 1: parse data block header
+// Step 2: decrypt data
+void DecryptDataBlock(uint32_t version, yacl::ByteContainerView data_block,
+                      DataBlockCipher& cipher, absl::Span<uint8_t> raw_data) {
+  if (version == kVersion2) {
+    YACL_ENFORCE_GE(data_block.size(), kBlockHeaderBytesV2,
+                    "Data block format is not correct");
+    YACL_ENFORCE_EQ(raw_data.size(), data_block.size() - kBlockHeaderBytesV2,
+                    "Raw data size mismatch");
+    cipher.Decrypt(data_block.subspan(0, kIvBytes),
+                   data_block.subspan(kBlockHeaderBytesV2),
+                   data_block.subspan(kIvBytes, kMacBytes), raw_data);
+    return;
+  }
+
+  YACL_ENFORCE_GE(data_block.size(), kIvLenBytes,
+                  "Data block format is not correct");
+  // parse iv length
+  uint64_t offset = 0;
+  uint64_t iv_len =
+      Bytes2Int<uint64_t>(data_block.subspan(offset, kIvLenBytes));
+  offset += kIvLenBytes;
+
+  // get iv
+  YACL_ENFORCE_GE(data_block.size(), offset + kIvFieldBytes,
+                  "Data block format is not correct");
+  yacl::ByteContainerView iv = data_block.subspan(offset, iv_len);
+  offset += kIvFieldBytes;
+
+  // parse mac length
+  YACL_ENFORCE_GE(data_block.size(), offset + kMacLenBytes,
+                  "Data block format is not correct");
+  uint64_t mac_len =
+      Bytes2Int<uint64_t>(data_block.subspan(offset, kMacLenBytes));
+  offset += kMacLenBytes;
+
+  // get mac
+  YACL_ENFORCE_GE(data_block.size(), offset + kMacFieldBytes,
+                  "Data block format is not correct");
+  yacl::ByteContainerView mac = data_block.subspan(offset, mac_len);
+  offset += kMacFieldBytes;
+
+  // get data
+  yacl::ByteContainerView encrypted_data = data_block.subspan(offset);
+  YACL_ENFORCE_EQ(raw_data.size(), encrypted_data.size(),
+                  "Raw data size mismatch");
+
+  // decrypt data
+  cipher.Decrypt(iv, encrypted_data, mac, raw_data);
+}
+
+void DecryptDataBlock(uint32_t version, yacl::ByteContainerView data_block,
+                      DataBlockCipher& cipher, BlockDecompressor& decompressor,
+                      absl::Span<uint8_t> raw_data) {
+  const size_t header_bytes = BlockHeaderBytes(version);
+  YACL_ENFORCE_GE(data_block.size(), header_bytes,
+                  "Data block format is not correct");
+  auto plaintext = decompressor.Buffer(data_block.size() - header_bytes);
+  DecryptDataBlock(version, data_block, cipher, plaintext);
+  decompressor.Decompress(plaintext, raw_data);
+}
+
+void EncryptDataBlock(uint32_t version, yacl::ByteContainerView raw_data,
+                      absl::Span<uint8_t> data_block, DataBlockCipher& cipher,
+                      const BlockIvSource& iv_source, uint64_t index) {
+  const size_t header_bytes = BlockHeaderBytes(version);
+  YACL_ENFORCE_EQ(data_block.size(), header_bytes + raw_data.size(),
+                  "Data block size mismatch");
+  auto encrypted_data = data_block.subspan(header_bytes);
+  if (version == kVersion2) {
+    auto iv = data_block.subspan(0, kIvBytes);
+    iv_source.Generate(index, iv);
+    cipher.Encrypt(iv, raw_data, encrypted_data,
+                   data_block.subspan(kIvBytes, kMacBytes));
+    return;
+  }
+
+  // write iv and mac length, padding the unused bytes of iv and mac fields
+  std::fill_n(data_block.begin(), kBlockHeaderBytes, 0);
+  data_block[0] = kIvBytes;
+  auto iv = data_block.subspan(kIvLenBytes, kIvBytes);
+  iv_source.Generate(index, iv);
+  data_block[kIvLenBytes + kIvFieldBytes] = kMacBytes;
+  auto mac = data_block.subspan(kIvLenBytes + kIvFieldBytes + kMacLenBytes,
+                                kMacBytes);
+
+  cipher.Encrypt(iv, raw_data, encrypted_data, mac);
+}
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
@@ -0,0 +1,354 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "absl/types/span.h"
+#include "yacl/base/byte_container_view.h"
+#include "yacl/base/exception.h"
+
+#include "trustflow/proxy/utils/compression.h"
+#include "trustflow/proxy/utils/data_block_cipher.h"
+#include "trustflow/proxy/utils/io_util.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+// Encrypted file format
+//
+// Header:
+//  Version: 4 bytes
+//  Schema: 4 bytes
+//  Packet count: 8 bytes
+//  Block length: 4 bytes
+// followed by packet count data blocks of block length bytes, but the last
+// one which may be shorter.
+//
+// Reserve 32 bytes for IV and MAC, the actual used bytes should be inferred
+// from IV length and MAC length fields.
+// Data block:
+//  IV length: 1 byte
+//  IV: 32 bytes
+//  MAC length: 1 byte
+//  MAC: 32 bytes
+//  Encrypted data: the rest of the data block
+//
+// Version kVersion2 packs the data block header and appends an index of the
+// data blocks, which may then vary in length:
+// Data block:
+//  IV: 12 bytes
+//  MAC: 16 bytes
+//  Encrypted data: the rest of the data block
+// Index, after the last data block, packet count entries of
+//  Data block length: 4 bytes
+//  Raw data length: 4 bytes
+// No data block is longer than block length, but a compressed one by its
+// codec byte.
+//
+// Schema kSchemaExtended inserts an extension area between the header and
+// the data blocks:
+//  Extension length: 4 bytes, length of the entries
+//  Entries of
+//   Type: 2 bytes
+//   Length: 4 bytes
+//   Value: length bytes
+// Readers skip entries of unknown type.
+//
+// Files with kExtCompression compress the raw data of each data block
+// before encryption, the encrypted data is then the codec byte followed by
+// the compressed data, see compression.h. Each block still holds block
+// length minus the data block header bytes of raw data, but the data blocks
+// vary in length, which kExtBlockLens lists in version 1 files and the
+// index in version 2 files.
+//
+// Files with kExtWrappedKey encrypt their data blocks, and key their
+// integrity index, with a random file key, which the entry holds wrapped
+// by the data key. Changing the data key then only rewrites the entry,
+// which authenticates itself with its own tag rather than through the
+// header MAC. Files with kExtKeySalt instead derive their file key from
+// the data key and the random salt of the entry, which spreads the GCM
+// invocations under one data key over a key per file. Either entry comes
+// first in the extension area, so that it is found without reading the
+// rest.
+//
+// Files with kExtCipherSuite encrypt their data blocks with the AEAD of the
+// entry instead of AES-GCM, with the same data block header, see
+// CipherSuite. The entry follows the key entry, if any, or comes first.
+//
+// Integers are little-endian.
+
+constexpr uint32_t kVersion = 1;
+constexpr uint32_t kVersion2 = 2;
+constexpr uint32_t kSchema = 1;
+constexpr uint32_t kSchemaExtended = 2;
+constexpr size_t kVersionBytes = sizeof(kVersion);
+constexpr size_t kSchemaBytes = sizeof(kSchema);
+constexpr size_t kPacketCntBytes = sizeof(uint64_t);
+constexpr size_t kBlockLenBytes = sizeof(uint32_t);
+constexpr size_t kHeaderBytes =
+    kVersionBytes + kSchemaBytes + kPacketCntBytes + kBlockLenBytes;
+
+constexpr uint8_t kIvFieldBytes = 32;
+constexpr uint8_t kMacFieldBytes = 32;
+constexpr size_t kIvLenBytes = sizeof(kIvBytes);
+constexpr size_t kMacLenBytes = sizeof(kMacBytes);
+constexpr size_t kBlockHeaderBytes =
+    kIvLenBytes + kIvFieldBytes + kMacLenBytes + kMacFieldBytes;
+constexpr size_t kBlockHeaderBytesV2 = kIvBytes + kMacBytes;
+constexpr size_t kIndexEntryBytes = 2 * sizeof(uint32_t);
+
+// Length of the data block header of format version
+constexpr size_t BlockHeaderBytes(uint32_t version) {
+  return version == kVersion2 ? kBlockHeaderBytesV2 : kBlockHeaderBytes;
+}
+
+constexpr size_t kExtLenBytes = sizeof(uint32_t);
+constexpr size_t kExtTypeBytes = sizeof(uint16_t);
+constexpr size_t kExtValueLenBytes = sizeof(uint32_t);
+constexpr size_t kExtEntryHeaderBytes = kExtTypeBytes + kExtValueLenBytes;
+
+// Extension entry types
+// root of the Merkle tree over the data block tags, see integrity_index.h
+constexpr uint16_t kExtMerkleRoot = 1;
+// the Merkle tree itself
+constexpr uint16_t kExtMerkleTree = 2;
+// HMAC of the header, the extension length and all entries but the Merkle
+// tree, which is authenticated through its root, the wrapped key, which has
+// its own tag, and the HMAC itself
+constexpr uint16_t kExtHeaderMac = 3;
+// codec of the data blocks, 1 byte, and the raw data length, 8 bytes
+constexpr uint16_t kExtCompression = 4;
+// length of each data block, 4 bytes each
+constexpr uint16_t kExtBlockLens = 5;
+// file key wrapped by the data key with AES-GCM, IV followed by the
+// encrypted file key, as long as the data key, and the MAC
+constexpr uint16_t kExtWrappedKey = 6;
+// salt of the HKDF-SHA256 derivation of the file key from the data key
+constexpr uint16_t kExtKeySalt = 7;
+constexpr size_t kKeySaltBytes = 32;
+// AEAD of the data blocks, 1 byte, see CipherSuite
+constexpr uint16_t kExtCipherSuite = 8;
+constexpr size_t kExtCipherSuiteBytes = sizeof(CipherSuite);
+constexpr size_t kExtCompressionBytes = sizeof(Compression) + sizeof(uint64_t);
+constexpr size_t kExtBlockLenBytes = sizeof(uint32_t);
+// offset of the value of the kExtWrappedKey or kExtKeySalt entry
+constexpr uint64_t kKeyEntryOffset =
+    kHeaderBytes + kExtLenBytes + kExtEntryHeaderBytes;
+
+// Length of a wrapped file key of key_len bytes
+constexpr size_t WrappedKeyBytes(size_t key_len) {
+  return kIvBytes + key_len + kMacBytes;
+}
+
+// Convert byte array to int
+template <typename T>
+T Bytes2Int(yacl::ByteContainerView bytes) {
+  size_t len = bytes.size();
+  YACL_ENFORCE_LE(len, sizeof(T), "Converting bytes to integer overflow");
+  T ret = 0;
+  // Little-endian
+  for (size_t i = 0; i < len; i++) {
+    ret = (ret << 8 | bytes[len - i - 1]);
+  }
+  return ret;
+}
+
+// How encryption makes the IV of each data block, decryption reads it from
+// the IV field either way
+enum class IvMode {
+  // random bytes from the DRBG per block
+  kRandom,
+  // deterministic construction of NIST SP 800-38D 8.2.1, a random fixed
+  // field drawn once per file followed by the block index as invocation
+  // field, which limits a file to 2^32 blocks
+  kCounter,
+};
+
+constexpr size_t kIvFixedFieldBytes = 8;
+constexpr size_t kIvInvocationFieldBytes = kIvBytes - kIvFixedFieldBytes;
+constexpr uint64_t kMaxCounterIvBlocks = 1ULL << (8 * kIvInvocationFieldBytes);
+
+// IVs of the data blocks of one file, Generate is thread safe
+class BlockIvSource {
+ public:
+  explicit BlockIvSource(IvMode mode);
+
+  // Write the IV of data block index into iv of kIvBytes bytes
+  void Generate(uint64_t index, absl::Span<uint8_t> iv) const;
+
+ private:
+  IvMode mode_;
+  std::array<uint8_t, kIvFixedFieldBytes> fixed_field_{};
+};
+
+// Position of the value of an extension entry in the file
+struct ExtensionEntry {
+  uint16_t type = 0;
+  uint64_t offset = 0;
+  uint32_t len = 0;
+};
+
+// Layout of an encrypted file, all data blocks but the last one are
+// block_len bytes, so the position of every block follows from the header,
+// unless the blocks are compressed or indexed
+struct EncFileLayout {
+  uint32_t version = kVersion;
+  uint32_t schema = kSchema;
+  uint64_t packet_cnt = 0;
+  uint32_t block_len = 0;
+  uint64_t last_block_len = 0;
+  // length of the plaintext file
+  uint64_t raw_len = 0;
+  // offset of the first data block, after the extension area if any
+  uint64_t data_offset = kHeaderBytes;
+  std::vector<ExtensionEntry> extensions;
+  Compression compression = Compression::kNone;
+  // offsets of the packet_cnt + 1 data block bounds of compressed or
+  // indexed files
+  std::vector<uint64_t> block_offsets;
+  // offsets of the packet_cnt + 1 raw data bounds of indexed files
+  std::vector<uint64_t> raw_offsets;
+  // value of the kExtWrappedKey entry, empty if the file has none
+  std::vector<uint8_t> wrapped_key;
+  // value of the kExtKeySalt entry, empty if the file has none
+  std::vector<uint8_t> key_salt;
+  CipherSuite cipher_suite = CipherSuite::kAesGcm;
+
+  // First extension entry of type, nullptr if there is none
+  const ExtensionEntry* FindExtension(uint16_t type) const;
+
+  size_t BlockHeaderBytes() const { return utils::BlockHeaderBytes(version); }
+
+  // Offset of data block i in the encrypted file, i may be packet_cnt
+  uint64_t BlockOffset(uint64_t i) const {
+    if (!block_offsets.empty()) {
+      return block_offsets[i];
+    }
+    if (i == packet_cnt) {
+      return BlockOffset(i - 1) + last_block_len;
+    }
+    return data_offset + i * block_len;
+  }
+
+  // Offset of the raw data of block i in the plaintext file, i may be
+  // packet_cnt
+  uint64_t RawOffset(uint64_t i) const {
+    if (!raw_offsets.empty()) {
+      return raw_offsets[i];
+    }
+    if (i == packet_cnt) {
+      return raw_len;
+    }
+    return i * (block_len - BlockHeaderBytes());
+  }
+
+  // Index of the data block holding raw data offset, which is less than
+  // raw_len
+  uint64_t BlockOf(uint64_t raw_offset) const;
+};
+
+// Parse and check the file header and the extension area against the file
+// length
+EncFileLayout ReadFileLayout(const PosixFile& in);
+
+// Wrap file_key, as long as data_key, with data_key
+std::vector<uint8_t> WrapFileKey(yacl::ByteContainerView data_key,
+                                 yacl::ByteContainerView file_key);
+
+// Unwrap a file key wrapped by WrapFileKey, throw if data_key is wrong
+std::vector<uint8_t> UnwrapFileKey(yacl::ByteContainerView data_key,
+                                   yacl::ByteContainerView wrapped_key);
+
+// Derive a file key, as long as data_key, from data_key and salt with
+// HKDF-SHA256
+std::vector<uint8_t> DeriveFileKey(yacl::ByteContainerView data_key,
+                                   yacl::ByteContainerView salt);
+
+// Key of the data blocks and the integrity index of a file of layout, its
+// file key unwrapped or derived with data_key, or data_key itself if it
+// has none
+std::vector<uint8_t> FileKey(const EncFileLayout& layout,
+                             yacl::ByteContainerView data_key);
+
+std::vector<uint8_t> EncodeHeader(uint64_t packet_cnt, uint32_t block_len,
+                                  uint32_t schema = kSchema,
+                                  uint32_t version = kVersion);
+
+// Index of the data blocks of a version 2 file, written after them
+std::vector<uint8_t> EncodeBlockIndex(const EncFileLayout& layout);
+
+// Append an extension entry of type with value to area
+void AppendExtension(std::vector<uint8_t>* area, uint16_t type,
+                     yacl::ByteContainerView value);
+
+// Length of the kExtWrappedKey or kExtKeySalt entry of layout, 0 if it
+// has none
+uint64_t KeyExtensionBytes(const EncFileLayout& layout);
+
+// Append the kExtWrappedKey or kExtKeySalt entry of layout, if any, to area
+void AppendKeyExtension(const EncFileLayout& layout,
+                        std::vector<uint8_t>* area);
+
+// Length of the kExtCipherSuite entry of layout, 0 for kAesGcm, which has
+// none
+uint64_t CipherSuiteExtensionBytes(const EncFileLayout& layout);
+
+// Append the kExtCipherSuite entry of layout, if any, to area
+void AppendCipherSuiteExtension(const EncFileLayout& layout,
+                                std::vector<uint8_t>* area);
+
+// Length of the kExtCompression and, for version 1, kExtBlockLens entries
+// of a compressed file of packet_cnt data blocks
+uint64_t CompressionExtensionBytes(uint32_t version, uint64_t packet_cnt);
+
+// Append the kExtCompression and, for version 1, kExtBlockLens entries of
+// layout to area
+void AppendCompressionExtensions(const EncFileLayout& layout,
+                                 std::vector<uint8_t>* area);
+
+// The data block functions take the format version of the file.
+
+// Authentication tag in the data block header of data_block
+yacl::ByteContainerView BlockTag(uint32_t version,
+                                 yacl::ByteContainerView data_block);
+
+// Decrypt data_block into raw_data, which holds the data block length minus
+// the data block header bytes and may be the encrypted data of data_block
+// itself to decrypt in place
+void DecryptDataBlock(uint32_t version, yacl::ByteContainerView data_block,
+                      DataBlockCipher& cipher, absl::Span<uint8_t> raw_data);
+
+// Decrypt data_block of a compressed file into the buffer of decompressor
+// and decompress it into raw_data, which holds the raw data length of the
+// block
+void DecryptDataBlock(uint32_t version, yacl::ByteContainerView data_block,
+                      DataBlockCipher& cipher, BlockDecompressor& decompressor,
+                      absl::Span<uint8_t> raw_data);
+
+// Encrypt raw_data into data_block, which holds the data block header
+// followed by raw_data.size() bytes of encrypted data. raw_data may be the
+// encrypted data part of data_block itself to encrypt in place.
+// index is the position of the block in its file.
+void EncryptDataBlock(uint32_t version, yacl::ByteContainerView raw_data,
+                      absl::Span<uint8_t> data_block, DataBlockCipher& cipher,
+                      const BlockIvSource& iv_source, uint64_t index);
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
@@ -0,0 +1,144 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Check encrypted files without decrypting them to disk.
+//
+//   trustflow_enc_verify --data_key_file=<path> <file or directory>...
+//
+// The data key is read in hex from --data_key_file, from stdin if that is
+// -, or else from the TRUSTFLOW_DATA_KEY environment variable, so that it
+// does not show up in the process list or the shell history.
+// Every data block tag of each file, and every .enc file under each
+// directory, is checked by --num_threads workers. One line per file reports
+// the throughput and the bad data blocks, the exit code is 1 if any file is
+// bad or can't be read.
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/escaping.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_join.h"
+#include "fmt/format.h"
+#include "gflags/gflags.h"
+#include "spdlog/spdlog.h"
+
+#include "trustflow/proxy/utils/crypto_util.h"
+
+DEFINE_string(data_key_file, "",
+              "File holding the data key of the files in hex, - reads it "
+              "from stdin, empty takes the TRUSTFLOW_DATA_KEY environment "
+              "variable");
+DEFINE_uint64(num_threads, 0,
+              "Workers checking the blocks of a file, 0 means all cores");
+DEFINE_bool(use_io_uring, false, "Whether reading with io_uring file I/O");
+DEFINE_bool(require_integrity_index, false,
+            "Whether files without an integrity index are bad, which catches "
+            "files whose index was stripped");
+
+namespace {
+
+constexpr char kEncSuffix[] = ".enc";
+constexpr char kDataKeyEnv[] = "TRUSTFLOW_DATA_KEY";
+
+// Data key from --data_key_file or kDataKeyEnv, empty if missing or not hex
+std::string ReadDataKey() {
+  std::string hex;
+  if (FLAGS_data_key_file == "-") {
+    hex.assign(std::istreambuf_iterator<char>(std::cin), {});
+  } else if (!FLAGS_data_key_file.empty()) {
+    std::ifstream in(FLAGS_data_key_file);
+    if (!in) {
+      fmt::print(stderr, "Failed to open {}\n", FLAGS_data_key_file);
+      return "";
+    }
+    hex.assign(std::istreambuf_iterator<char>(in), {});
+  } else if (const char* env = std::getenv(kDataKeyEnv)) {
+    hex = env;
+  }
+  absl::StripAsciiWhitespace(&hex);
+  const bool is_hex = !hex.empty() && hex.size() % 2 == 0 &&
+                      std::all_of(hex.begin(), hex.end(), [](char c) {
+                        return absl::ascii_isxdigit(c);
+                      });
+  return is_hex ? absl::HexStringToBytes(hex) : "";
+}
+
+// Verify path and print its line, return whether it is good
+bool VerifyPath(const std::string& path, const std::string& data_key,
+                const trustflow::proxy::utils::FileCryptoOptions& options) {
+  try {
+    const auto result =
+        trustflow::proxy::utils::VerifyFile(path, data_key, options);
+    const double mb = static_cast<double>(result.bytes) / 1e6;
+    if (result.bad_blocks.empty()) {
+      fmt::print("OK   {}: {} blocks, {:.1f} MB, {:.1f} MB/s\n", path,
+                 result.blocks, mb, mb / result.seconds);
+      return true;
+    }
+    fmt::print("BAD  {}: {} of {} blocks bad: {}\n", path,
+               result.bad_blocks.size(), result.blocks,
+               absl::StrJoin(result.bad_blocks, ","));
+  } catch (const std::exception& e) {
+    fmt::print("FAIL {}: {}\n", path, e.what());
+  }
+  return false;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  gflags::SetUsageMessage(
+      "trustflow_enc_verify --data_key_file=<path> <path>...");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  spdlog::set_level(spdlog::level::err);
+
+  const std::string data_key = ReadDataKey();
+  if (data_key.empty() || argc < 2) {
+    gflags::ShowUsageWithFlags(argv[0]);
+    return 2;
+  }
+  trustflow::proxy::utils::FileCryptoOptions options;
+  options.num_threads = FLAGS_num_threads;
+  options.use_io_uring = FLAGS_use_io_uring;
+  options.require_integrity_index = FLAGS_require_integrity_index;
+
+  bool all_good = true;
+  uint64_t files = 0;
+  for (int i = 1; i < argc; ++i) {
+    const std::string path = argv[i];
+    if (!std::filesystem::is_directory(path)) {
+      all_good = VerifyPath(path, data_key, options) && all_good;
+      ++files;
+      continue;
+    }
+    for (const auto& entry :
+         std::filesystem::recursive_directory_iterator(path)) {
+      if (entry.is_regular_file() &&
+          absl::EndsWith(entry.path().string(), kEncSuffix)) {
+        all_good = VerifyPath(entry.path(), data_key, options) && all_good;
+        ++files;
+      }
+    }
+  }
+  fmt::print("{} files, {}\n", files, all_good ? "all good" : "some bad");
+  return all_good ? 0 : 1;
+}
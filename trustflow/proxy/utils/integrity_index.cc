@@ -0,0 +1,307 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trustflow/proxy/utils/integrity_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include "openssl/crypto.h"
+#include "yacl/base/exception.h"
+#include "yacl/crypto/hash/hash_utils.h"
+#include "yacl/crypto/hmac/hmac_sha256.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+namespace {
+
+constexpr uint8_t kLeafPrefix = 0;
+constexpr uint8_t kNodePrefix = 1;
+constexpr char kHeaderMacLabel[] = "trustflow header mac";
+
+MerkleNode MerkleParent(const MerkleNode& left, const MerkleNode& right) {
+  std::array<uint8_t, 1 + 2 * kMerkleNodeBytes> buf;
+  buf[0] = kNodePrefix;
+  std::memcpy(buf.data() + 1, left.data(), kMerkleNodeBytes);
+  std::memcpy(buf.data() + 1 + kMerkleNodeBytes, right.data(),
+              kMerkleNodeBytes);
+  return yacl::crypto::Sha256(buf);
+}
+
+// HMAC of the header and the extension area without the Merkle tree, the
+// wrapped key and the HMAC itself, under a key derived from data_key, which
+// is the file key of files with one
+std::vector<uint8_t> HeaderMac(yacl::ByteContainerView data_key,
+                               yacl::ByteContainerView authenticated) {
+  const auto mac_key = yacl::crypto::HmacSha256(data_key)
+                           .Update(std::string(kHeaderMacLabel))
+                           .CumulativeMac();
+  return yacl::crypto::HmacSha256(mac_key)
+      .Update(authenticated)
+      .CumulativeMac();
+}
+
+bool IsAuthenticated(uint16_t type) {
+  return type != kExtMerkleTree && type != kExtHeaderMac &&
+         type != kExtWrappedKey;
+}
+
+// Header, extension length and the authenticated entries of in, in file
+// order
+std::vector<uint8_t> ReadAuthenticated(const PosixFile& in,
+                                       const EncFileLayout& layout) {
+  std::vector<uint8_t> authenticated(kHeaderBytes + kExtLenBytes);
+  in.ReadAt(0, absl::MakeSpan(authenticated));
+  for (const auto& entry : layout.extensions) {
+    if (IsAuthenticated(entry.type)) {
+      const size_t size = authenticated.size();
+      authenticated.resize(size + kExtEntryHeaderBytes + entry.len);
+      in.ReadAt(entry.offset - kExtEntryHeaderBytes,
+                absl::MakeSpan(authenticated.data() + size,
+                               kExtEntryHeaderBytes + entry.len));
+    }
+  }
+  return authenticated;
+}
+
+}  // namespace
+
+uint64_t MerkleNodeCount(uint64_t leaves) {
+  uint64_t total = leaves;
+  for (uint64_t count = leaves; count > 1; count = (count + 1) / 2) {
+    total += (count + 1) / 2;
+  }
+  return total;
+}
+
+MerkleNode MerkleLeaf(uint64_t index, yacl::ByteContainerView tag) {
+  std::vector<uint8_t> buf(1 + sizeof(index) + tag.size());
+  buf[0] = kLeafPrefix;
+  std::memcpy(buf.data() + 1, &index, sizeof(index));
+  std::memcpy(buf.data() + 1 + sizeof(index), tag.data(), tag.size());
+  return yacl::crypto::Sha256(buf);
+}
+
+void BuildMerkleTree(std::vector<MerkleNode>* tree) {
+  tree->reserve(MerkleNodeCount(tree->size()));
+  size_t begin = 0;
+  for (size_t count = tree->size(); count > 1; count = (count + 1) / 2) {
+    for (size_t i = 0; i < count; i += 2) {
+      // copy, as the push may reallocate
+      const MerkleNode left = (*tree)[begin + i];
+      tree->push_back(i + 1 < count
+                          ? MerkleParent(left, (*tree)[begin + i + 1])
+                          : left);
+    }
+    begin += count;
+  }
+}
+
+uint64_t IntegrityExtensionBytes(uint64_t packet_cnt) {
+  return 2 * (kExtEntryHeaderBytes + kMerkleNodeBytes) + kExtEntryHeaderBytes +
+         MerkleNodeCount(packet_cnt) * kMerkleNodeBytes;
+}
+
+void AppendIntegrityIndex(const PosixFile& out, const EncFileLayout& layout,
+                          yacl::ByteContainerView data_key,
+                          std::vector<uint8_t>* area) {
+  YACL_ENFORCE_EQ(kHeaderBytes + area->size() +
+                      IntegrityExtensionBytes(layout.packet_cnt),
+                  layout.data_offset, "No room for the integrity index");
+
+  std::vector<MerkleNode> tree;
+  std::vector<uint8_t> block_header(layout.BlockHeaderBytes());
+  for (uint64_t i = 0; i < layout.packet_cnt; ++i) {
+    out.ReadAt(layout.BlockOffset(i), absl::MakeSpan(block_header));
+    tree.push_back(MerkleLeaf(i, BlockTag(layout.version, block_header)));
+  }
+  BuildMerkleTree(&tree);
+
+  // root, header MAC and tree, the MAC covers everything before it
+  AppendExtension(area, kExtMerkleRoot, tree.back());
+
+  std::vector<uint8_t> authenticated(kHeaderBytes);
+  out.ReadAt(0, absl::MakeSpan(authenticated));
+  authenticated.insert(authenticated.end(), area->begin(),
+                       area->begin() + kExtLenBytes);
+  for (size_t offset = kExtLenBytes; offset < area->size();) {
+    const size_t entry_len =
+        kExtEntryHeaderBytes +
+        Bytes2Int<uint32_t>(yacl::ByteContainerView(
+            area->data() + offset + kExtTypeBytes, kExtValueLenBytes));
+    if (IsAuthenticated(Bytes2Int<uint16_t>(
+            yacl::ByteContainerView(area->data() + offset, kExtTypeBytes)))) {
+      authenticated.insert(authenticated.end(), area->begin() + offset,
+                           area->begin() + offset + entry_len);
+    }
+    offset += entry_len;
+  }
+  AppendExtension(area, kExtHeaderMac, HeaderMac(data_key, authenticated));
+
+  AppendExtension(area, kExtMerkleTree,
+                  yacl::ByteContainerView(tree.data()->data(),
+                                          tree.size() * kMerkleNodeBytes));
+}
+
+void UpdateIntegrityIndex(const PosixFile& file, const EncFileLayout& layout,
+                          yacl::ByteContainerView data_key, uint64_t begin,
+                          const std::vector<std::vector<uint8_t>>& tags) {
+  const auto* root = layout.FindExtension(kExtMerkleRoot);
+  const auto* tree = layout.FindExtension(kExtMerkleTree);
+  const auto* mac = layout.FindExtension(kExtHeaderMac);
+  YACL_ENFORCE(root != nullptr && tree != nullptr && mac != nullptr,
+               "Integrity index of {} is incomplete", file.path());
+  YACL_ENFORCE(!tags.empty() && begin + tags.size() <= layout.packet_cnt,
+               "Block range out of range");
+
+  std::vector<MerkleNode> nodes;
+  for (size_t i = 0; i < tags.size(); ++i) {
+    nodes.push_back(MerkleLeaf(begin + i, tags[i]));
+  }
+  // nodes are the changed nodes [lo, lo + nodes.size()) of the level of
+  // count nodes starting at level_begin
+  uint64_t level_begin = 0;
+  uint64_t count = layout.packet_cnt;
+  uint64_t lo = begin;
+  while (true) {
+    file.WriteAt(tree->offset + (level_begin + lo) * kMerkleNodeBytes,
+                 yacl::ByteContainerView(nodes.data()->data(),
+                                         nodes.size() * kMerkleNodeBytes));
+    if (count <= 1) {
+      break;
+    }
+    // the children of the parents of the changed nodes
+    const uint64_t child_lo = lo / 2 * 2;
+    const uint64_t child_hi = std::min(count, (lo + nodes.size() + 1) / 2 * 2);
+    std::vector<MerkleNode> children(child_hi - child_lo);
+    file.ReadAt(tree->offset + (level_begin + child_lo) * kMerkleNodeBytes,
+                absl::MakeSpan(children.data()->data(),
+                               children.size() * kMerkleNodeBytes));
+    std::copy(nodes.begin(), nodes.end(), children.begin() + (lo - child_lo));
+    nodes.clear();
+    for (size_t i = 0; i < children.size(); i += 2) {
+      nodes.push_back(i + 1 < children.size()
+                          ? MerkleParent(children[i], children[i + 1])
+                          : children[i]);
+    }
+    lo = child_lo / 2;
+    level_begin += count;
+    count = (count + 1) / 2;
+  }
+
+  // the root is authenticated by the header MAC
+  file.WriteAt(root->offset, nodes.back());
+  file.WriteAt(mac->offset,
+               HeaderMac(data_key, ReadAuthenticated(file, layout)));
+}
+
+std::unique_ptr<IntegrityIndex> IntegrityIndex::Open(
+    const PosixFile& in, const EncFileLayout& layout,
+    yacl::ByteContainerView data_key, bool required) {
+  const auto* root = layout.FindExtension(kExtMerkleRoot);
+  if (root == nullptr) {
+    YACL_ENFORCE(!required, "{} has no integrity index", in.path());
+    return nullptr;
+  }
+  const auto* tree = layout.FindExtension(kExtMerkleTree);
+  const auto* mac = layout.FindExtension(kExtHeaderMac);
+  YACL_ENFORCE(tree != nullptr && mac != nullptr,
+               "Integrity index of {} is incomplete", in.path());
+  YACL_ENFORCE_EQ(root->len, kMerkleNodeBytes, "Merkle root length error");
+  YACL_ENFORCE_EQ(tree->len,
+                  MerkleNodeCount(layout.packet_cnt) * kMerkleNodeBytes,
+                  "Merkle tree length error");
+
+  const auto expected = HeaderMac(data_key, ReadAuthenticated(in, layout));
+  std::vector<uint8_t> actual(mac->len);
+  in.ReadAt(mac->offset, absl::MakeSpan(actual));
+  YACL_ENFORCE(actual.size() == expected.size() &&
+                   CRYPTO_memcmp(actual.data(), expected.data(),
+                                 expected.size()) == 0,
+               "Header MAC check of {} failed", in.path());
+
+  MerkleNode root_node;
+  in.ReadAt(root->offset, absl::MakeSpan(root_node));
+  return std::unique_ptr<IntegrityIndex>(
+      new IntegrityIndex(in, *tree, root_node, layout.packet_cnt));
+}
+
+IntegrityIndex::IntegrityIndex(const PosixFile& in, const ExtensionEntry& tree,
+                               const MerkleNode& root, uint64_t leaves)
+    : in_(in), tree_(tree), root_(root), leaves_cnt_(leaves) {
+  uint64_t begin = 0;
+  uint64_t count = leaves;
+  while (true) {
+    level_begin_.push_back(begin);
+    begin += count;
+    if (count <= 1) {
+      break;
+    }
+    count = (count + 1) / 2;
+  }
+  // end of the last level
+  level_begin_.push_back(begin);
+}
+
+void IntegrityIndex::LoadLeaves() {
+  std::vector<MerkleNode> tree(leaves_cnt_);
+  in_.ReadAt(tree_.offset,
+             absl::MakeSpan(tree.data()->data(),
+                            leaves_cnt_ * kMerkleNodeBytes));
+  BuildMerkleTree(&tree);
+  YACL_ENFORCE(tree.back() == root_,
+               "Merkle tree of {} does not match its root", in_.path());
+  tree.resize(leaves_cnt_);
+  leaves_ = std::move(tree);
+}
+
+void IntegrityIndex::CheckBlock(uint64_t index,
+                                yacl::ByteContainerView tag) const {
+  YACL_ENFORCE_LT(index, leaves_cnt_, "Block index out of range");
+  MerkleNode node = MerkleLeaf(index, tag);
+  if (!leaves_.empty()) {
+    YACL_ENFORCE(node == leaves_[index],
+                 "Data block {} of {} does not match the integrity index",
+                 index, in_.path());
+    return;
+  }
+
+  uint64_t pos = index;
+  for (size_t level = 0; level + 2 < level_begin_.size(); ++level) {
+    const uint64_t count = level_begin_[level + 1] - level_begin_[level];
+    const uint64_t sibling = pos ^ 1;
+    if (sibling < count) {
+      const auto other = ReadNode(level_begin_[level] + sibling);
+      node = pos % 2 == 0 ? MerkleParent(node, other)
+                          : MerkleParent(other, node);
+    }
+    pos /= 2;
+  }
+  YACL_ENFORCE(node == root_,
+               "Data block {} of {} does not match the integrity index",
+               index, in_.path());
+}
+
+MerkleNode IntegrityIndex::ReadNode(uint64_t node) const {
+  MerkleNode value;
+  in_.ReadAt(tree_.offset + node * kMerkleNodeBytes, absl::MakeSpan(value));
+  return value;
+}
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
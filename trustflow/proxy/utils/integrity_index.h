@@ -0,0 +1,114 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "yacl/base/byte_container_view.h"
+
+#include "trustflow/proxy/utils/enc_file_format.h"
+#include "trustflow/proxy/utils/io_util.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+// Integrity index of an encrypted file
+//
+// Each data block is only authenticated on its own by its tag, so blocks
+// could be reordered, dropped or taken from another file of the same key.
+// The index is a Merkle tree over the block tags, which binds each tag to
+// its block index:
+//  leaf i = SHA-256(0x00 || i || tag of block i), i as 8 bytes
+//  node = SHA-256(0x01 || left child || right child)
+// The last node of a level with an odd number of nodes moves up unchanged.
+// The tree is stored level by level from the leaves to the root in the
+// kExtMerkleTree extension entry, and the root in kExtMerkleRoot, which the
+// kExtHeaderMac entry authenticates together with the header and thus the
+// number of blocks. Any set of blocks can then be verified on its own,
+// against the leaves or the path of each block to the root.
+
+constexpr size_t kMerkleNodeBytes = 32;
+using MerkleNode = std::array<uint8_t, kMerkleNodeBytes>;
+
+// Number of nodes of the tree over leaves leaves
+uint64_t MerkleNodeCount(uint64_t leaves);
+
+MerkleNode MerkleLeaf(uint64_t index, yacl::ByteContainerView tag);
+
+// Append the levels above the leaves in tree, the root ends up last
+void BuildMerkleTree(std::vector<MerkleNode>* tree);
+
+// Length of the integrity index entries of a file of packet_cnt data blocks
+uint64_t IntegrityExtensionBytes(uint64_t packet_cnt);
+
+// Append the integrity index entries of out, whose header and data blocks
+// are written already, to area, which holds the extension area from its
+// length field up to them and must end with them
+void AppendIntegrityIndex(const PosixFile& out, const EncFileLayout& layout,
+                          yacl::ByteContainerView data_key,
+                          std::vector<uint8_t>* area);
+
+// Replace the leaves of data blocks [begin, begin + tags.size()) of file,
+// whose tags changed to tags, and update the nodes above them, the root and
+// the header MAC in place
+void UpdateIntegrityIndex(const PosixFile& file, const EncFileLayout& layout,
+                          yacl::ByteContainerView data_key, uint64_t begin,
+                          const std::vector<std::vector<uint8_t>>& tags);
+
+// Checks data blocks against the integrity index of a file, thread safe
+class IntegrityIndex {
+ public:
+  // Check the header MAC of in with data_key
+  // Return nullptr if in has no integrity index, or throw if required, as
+  // the index can be stripped along with the extension area and then no
+  // longer binds the blocks to their positions.
+  static std::unique_ptr<IntegrityIndex> Open(const PosixFile& in,
+                                              const EncFileLayout& layout,
+                                              yacl::ByteContainerView data_key,
+                                              bool required = false);
+
+  IntegrityIndex(const IntegrityIndex&) = delete;
+  IntegrityIndex& operator=(const IntegrityIndex&) = delete;
+
+  // Read and check all leaves at once, after which CheckBlock needs no
+  // reads, for callers that go through the whole file
+  void LoadLeaves();
+
+  // Throw unless tag is the tag of data block index. Without loaded leaves
+  // the path of the block is read and hashed up to the root.
+  void CheckBlock(uint64_t index, yacl::ByteContainerView tag) const;
+
+ private:
+  IntegrityIndex(const PosixFile& in, const ExtensionEntry& tree,
+                 const MerkleNode& root, uint64_t leaves);
+
+  MerkleNode ReadNode(uint64_t node) const;
+
+  const PosixFile& in_;
+  ExtensionEntry tree_;
+  MerkleNode root_;
+  uint64_t leaves_cnt_;
+  // first node of each level
+  std::vector<uint64_t> level_begin_;
+  std::vector<MerkleNode> leaves_;
+};
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
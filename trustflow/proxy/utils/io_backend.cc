@@ -0,0 +1,502 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trustflow/proxy/utils/io_backend.h"
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+#include "spdlog/spdlog.h"
+#include "yacl/base/exception.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+namespace {
+
+// Submission queue entries, the wakeup read takes one of them and the rest
+// bound the requests in flight
+constexpr unsigned kRingEntries = 256;
+constexpr uint64_t kWakeupUserData = 0;
+
+std::string ErrnoMessage(int err) {
+  return std::system_category().message(err);
+}
+
+int IoUringSetup(unsigned entries, io_uring_params* params) {
+  return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int IoUringEnter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                 unsigned flags) {
+  return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                    min_complete, flags, nullptr, 0));
+}
+
+// io_uring driven by one I/O thread. Callers queue their request and sleep,
+// the I/O thread moves all queued requests into the submission queue at
+// once, submits them with a single io_uring_enter and wakes each caller
+// when its completion arrives. Short transfers are resubmitted for the
+// rest. An eventfd read stays armed in the ring so that callers can wake
+// the I/O thread while it waits for completions.
+// A failing io_uring_enter breaks the ring: the queued requests fail with
+// its errno, the ones in flight are waited for and failed as well, and
+// later calls take the blocking path of SyncIoBackend.
+class IoUringBackend : public IoBackend {
+ public:
+  // Return nullptr if the ring can not be set up
+  static std::unique_ptr<IoUringBackend> Create();
+
+  IoUringBackend(const IoUringBackend&) = delete;
+  IoUringBackend& operator=(const IoUringBackend&) = delete;
+
+  ~IoUringBackend() override;
+
+  void ReadVAt(const PosixFile& file, uint64_t offset,
+               absl::Span<iovec> iov) override {
+    Submit(IORING_OP_READV, file, offset, iov);
+  }
+
+  void WriteVAt(const PosixFile& file, uint64_t offset,
+                absl::Span<iovec> iov) override {
+    Submit(IORING_OP_WRITEV, file, offset, iov);
+  }
+
+ private:
+  // A ReadVAt or WriteVAt call, living on the stack of its caller
+  struct Request {
+    uint8_t opcode = 0;
+    const PosixFile* file = nullptr;
+    // offset and iovecs of the part not transferred yet
+    uint64_t offset = 0;
+    absl::Span<iovec> iov;
+    // errno of a failed transfer
+    int error = 0;
+    bool eof = false;
+    bool done = false;
+    std::condition_variable cv;
+  };
+
+  IoUringBackend() = default;
+
+  bool Init();
+
+  void Submit(uint8_t opcode, const PosixFile& file, uint64_t offset,
+              absl::Span<iovec> iov);
+
+  void WakeUp() const;
+
+  // Methods below run on the I/O thread only
+  void Run();
+
+  void PushSqe(uint8_t opcode, int fd, const iovec* iov, unsigned iov_cnt,
+               uint64_t offset, uint64_t user_data);
+
+  void PushRequest(Request* request);
+
+  void ArmWakeup();
+
+  void ReapCompletions();
+
+  void Complete(Request* request, int res);
+
+  // Push request again for the rest of its transfer, or fail it on a
+  // broken ring
+  void Resubmit(Request* request);
+
+  void Finish(Request* request);
+
+  // Fail all requests after io_uring_enter failed with err
+  void Break(int err);
+
+  int ring_fd_ = -1;
+  int event_fd_ = -1;
+
+  void* sq_ring_ = MAP_FAILED;
+  size_t sq_ring_len_ = 0;
+  void* cq_ring_ = MAP_FAILED;
+  size_t cq_ring_len_ = 0;
+  io_uring_sqe* sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+  size_t sqes_len_ = 0;
+
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_mask_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned* cq_mask_ = nullptr;
+  io_uring_cqe* cqes_ = nullptr;
+  size_t capacity_ = 0;
+
+  std::mutex mutex_;
+  std::deque<Request*> pending_;
+  // whether the I/O thread waits in the kernel with nothing queued, so
+  // that the next caller has to wake it
+  bool sleeping_ = false;
+  bool stopping_ = false;
+  // errno of the io_uring_enter that broke the ring, 0 while it works
+  int broken_error_ = 0;
+  std::thread thread_;
+  SyncIoBackend fallback_;
+
+  // owned by the I/O thread
+  size_t in_flight_ = 0;
+  uint64_t wakeup_value_ = 0;
+  iovec wakeup_iov_ = {&wakeup_value_, sizeof(wakeup_value_)};
+};
+
+std::unique_ptr<IoUringBackend> IoUringBackend::Create() {
+  std::unique_ptr<IoUringBackend> backend(new IoUringBackend());
+  if (!backend->Init()) {
+    return nullptr;
+  }
+  return backend;
+}
+
+bool IoUringBackend::Init() {
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  ring_fd_ = IoUringSetup(kRingEntries, &params);
+  if (ring_fd_ < 0) {
+    SPDLOG_WARN("io_uring setup failed: {}", ErrnoMessage(errno));
+    return false;
+  }
+
+  sq_ring_len_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_len_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_len_ = cq_ring_len_ = std::max(sq_ring_len_, cq_ring_len_);
+  }
+  sq_ring_ = ::mmap(nullptr, sq_ring_len_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ != MAP_FAILED && !single_mmap) {
+    cq_ring_ = ::mmap(nullptr, cq_ring_len_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+  }
+  sqes_len_ = params.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = static_cast<io_uring_sqe*>(
+      ::mmap(nullptr, sqes_len_, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+  if (sq_ring_ == MAP_FAILED || (!single_mmap && cq_ring_ == MAP_FAILED) ||
+      sqes_ == MAP_FAILED) {
+    SPDLOG_WARN("io_uring mmap failed: {}", ErrnoMessage(errno));
+    return false;
+  }
+
+  auto* sq = static_cast<uint8_t*>(sq_ring_);
+  auto* cq = static_cast<uint8_t*>(single_mmap ? sq_ring_ : cq_ring_);
+  sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  capacity_ = std::min(params.sq_entries, params.cq_entries) - 1;
+
+  event_fd_ = ::eventfd(0, EFD_CLOEXEC);
+  if (event_fd_ < 0) {
+    SPDLOG_WARN("eventfd failed: {}", ErrnoMessage(errno));
+    return false;
+  }
+
+  thread_ = std::thread(&IoUringBackend::Run, this);
+  return true;
+}
+
+IoUringBackend::~IoUringBackend() {
+  if (thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+      if (sleeping_) {
+        sleeping_ = false;
+        WakeUp();
+      }
+    }
+    thread_.join();
+  }
+  if (sqes_ != MAP_FAILED) {
+    ::munmap(sqes_, sqes_len_);
+  }
+  if (cq_ring_ != MAP_FAILED) {
+    ::munmap(cq_ring_, cq_ring_len_);
+  }
+  if (sq_ring_ != MAP_FAILED) {
+    ::munmap(sq_ring_, sq_ring_len_);
+  }
+  if (event_fd_ >= 0) {
+    ::close(event_fd_);
+  }
+  if (ring_fd_ >= 0) {
+    ::close(ring_fd_);
+  }
+}
+
+void IoUringBackend::Submit(uint8_t opcode, const PosixFile& file,
+                            uint64_t offset, absl::Span<iovec> iov) {
+  const size_t total = TotalBytes(iov);
+  if (total == 0) {
+    return;
+  }
+  Request request;
+  request.opcode = opcode;
+  request.file = &file;
+  request.offset = offset;
+  request.iov = iov;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (broken_error_ != 0) {
+      lock.unlock();
+      if (opcode == IORING_OP_READV) {
+        fallback_.ReadVAt(file, offset, iov);
+      } else {
+        fallback_.WriteVAt(file, offset, iov);
+      }
+      return;
+    }
+    pending_.push_back(&request);
+    if (sleeping_) {
+      sleeping_ = false;
+      WakeUp();
+    }
+    request.cv.wait(lock, [&] { return request.done; });
+  }
+
+  const bool read = opcode == IORING_OP_READV;
+  if (request.error != 0 || request.eof) {
+    YACL_THROW_IO_ERROR(
+        "Failed to {} {} bytes at {} {} {}: {}", read ? "read" : "write",
+        total, offset, read ? "from" : "to", file.path(),
+        request.eof ? "unexpected end of file" : ErrnoMessage(request.error));
+  }
+}
+
+void IoUringBackend::WakeUp() const {
+  // the counter only has to become non zero, a failure means it already
+  // overflowed which wakes the reader as well
+  ::eventfd_write(event_fd_, 1);
+}
+
+void IoUringBackend::Run() {
+  ArmWakeup();
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      while (!pending_.empty() && in_flight_ < capacity_) {
+        PushRequest(pending_.front());
+        pending_.pop_front();
+      }
+      if (stopping_ && pending_.empty() && in_flight_ == 0) {
+        break;
+      }
+      // with requests still queued the ring is full and the next
+      // completion wakes this thread anyway
+      sleeping_ = pending_.empty();
+    }
+
+    const unsigned to_submit =
+        *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    int ret = IoUringEnter(ring_fd_, to_submit, 1, IORING_ENTER_GETEVENTS);
+    if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      Break(errno);
+      return;
+    }
+    ReapCompletions();
+  }
+}
+
+void IoUringBackend::Break(int err) {
+  SPDLOG_ERROR("io_uring_enter failed, falling back to blocking I/O: {}",
+               ErrnoMessage(err));
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    broken_error_ = err;
+    sleeping_ = false;
+    for (Request* request : pending_) {
+      request->error = err;
+      request->done = true;
+      request->cv.notify_one();
+    }
+    pending_.clear();
+  }
+
+  // entries the kernel has not consumed yet are taken back, it never saw
+  // their buffers
+  const unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  for (unsigned i = head; i != *sq_tail_; ++i) {
+    const uint64_t user_data = sqes_[sq_array_[i & *sq_mask_]].user_data;
+    if (user_data != kWakeupUserData) {
+      --in_flight_;
+      auto* request = reinterpret_cast<Request*>(user_data);
+      request->error = err;
+      Finish(request);
+    }
+  }
+  __atomic_store_n(sq_tail_, head, __ATOMIC_RELEASE);
+
+  // the buffers of submitted entries belong to blocked callers and the
+  // kernel may still write them, so wait for their completions, which it
+  // posts to the shared completion queue without io_uring_enter
+  while (in_flight_ > 0) {
+    if (IoUringEnter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+        errno != EINTR) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ReapCompletions();
+  }
+}
+
+void IoUringBackend::PushSqe(uint8_t opcode, int fd, const iovec* iov,
+                             unsigned iov_cnt, uint64_t offset,
+                             uint64_t user_data) {
+  // the I/O thread is the only producer
+  const unsigned tail = *sq_tail_;
+  const unsigned index = tail & *sq_mask_;
+  io_uring_sqe& sqe = sqes_[index];
+  std::memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = opcode;
+  sqe.fd = fd;
+  sqe.addr = reinterpret_cast<uint64_t>(iov);
+  sqe.len = iov_cnt;
+  sqe.off = offset;
+  sqe.user_data = user_data;
+  sq_array_[index] = index;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+}
+
+void IoUringBackend::PushRequest(Request* request) {
+  ++in_flight_;
+  PushSqe(request->opcode, request->file->fd(), request->iov.data(),
+          std::min<size_t>(request->iov.size(), IOV_MAX), request->offset,
+          reinterpret_cast<uint64_t>(request));
+}
+
+void IoUringBackend::ArmWakeup() {
+  PushSqe(IORING_OP_READV, event_fd_, &wakeup_iov_, 1, 0, kWakeupUserData);
+}
+
+void IoUringBackend::ReapCompletions() {
+  unsigned head = *cq_head_;
+  const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+    if (cqe.user_data == kWakeupUserData) {
+      if (broken_error_ == 0) {
+        ArmWakeup();
+      }
+      continue;
+    }
+    --in_flight_;
+    Complete(reinterpret_cast<Request*>(cqe.user_data), cqe.res);
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+void IoUringBackend::Complete(Request* request, int res) {
+  if (res == -EINTR || res == -EAGAIN) {
+    Resubmit(request);
+    return;
+  }
+  if (res < 0) {
+    request->error = -res;
+  } else if (res == 0) {
+    // a write that makes no progress fails like pwrite would
+    if (request->opcode == IORING_OP_READV) {
+      request->eof = true;
+    } else {
+      request->error = EIO;
+    }
+  } else {
+    request->offset += res;
+    request->iov = AdvanceIovecs(request->iov, res);
+    if (!request->iov.empty()) {
+      Resubmit(request);
+      return;
+    }
+  }
+  Finish(request);
+}
+
+void IoUringBackend::Resubmit(Request* request) {
+  if (broken_error_ != 0) {
+    request->error = broken_error_;
+    Finish(request);
+    return;
+  }
+  PushRequest(request);
+}
+
+void IoUringBackend::Finish(Request* request) {
+  // notify under the lock, the request is gone once its caller sees done
+  std::lock_guard<std::mutex> lock(mutex_);
+  request->done = true;
+  request->cv.notify_one();
+}
+
+}  // namespace
+
+void IoBackend::ReadAt(const PosixFile& file, uint64_t offset,
+                       absl::Span<uint8_t> buf) {
+  iovec iov = {buf.data(), buf.size()};
+  ReadVAt(file, offset, absl::MakeSpan(&iov, 1));
+}
+
+void IoBackend::WriteAt(const PosixFile& file, uint64_t offset,
+                        yacl::ByteContainerView buf) {
+  iovec iov = {const_cast<uint8_t*>(buf.data()), buf.size()};
+  WriteVAt(file, offset, absl::MakeSpan(&iov, 1));
+}
+
+void SyncIoBackend::ReadVAt(const PosixFile& file, uint64_t offset,
+                            absl::Span<iovec> iov) {
+  file.ReadVAt(offset, iov);
+}
+
+void SyncIoBackend::WriteVAt(const PosixFile& file, uint64_t offset,
+                             absl::Span<iovec> iov) {
+  file.WriteVAt(offset, iov);
+}
+
+std::unique_ptr<IoBackend> CreateIoBackend(bool use_io_uring) {
+  if (use_io_uring) {
+    if (auto backend = IoUringBackend::Create()) {
+      return backend;
+    }
+    SPDLOG_WARN("io_uring is unavailable, falling back to blocking I/O");
+  }
+  return std::make_unique<SyncIoBackend>();
+}
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
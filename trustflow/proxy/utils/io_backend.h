@@ -0,0 +1,68 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <sys/uio.h>
+
+#include <memory>
+
+#include "absl/types/span.h"
+#include "yacl/base/byte_container_view.h"
+
+#include "trustflow/proxy/utils/io_util.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+// Positional file I/O of the crypto workers. Calls block until the whole
+// transfer is done and may come from any number of threads at once.
+class IoBackend {
+ public:
+  virtual ~IoBackend() = default;
+
+  // iov is consumed, a read past the end of file throws
+  virtual void ReadVAt(const PosixFile& file, uint64_t offset,
+                       absl::Span<iovec> iov) = 0;
+
+  virtual void WriteVAt(const PosixFile& file, uint64_t offset,
+                        absl::Span<iovec> iov) = 0;
+
+  void ReadAt(const PosixFile& file, uint64_t offset, absl::Span<uint8_t> buf);
+
+  void WriteAt(const PosixFile& file, uint64_t offset,
+               yacl::ByteContainerView buf);
+};
+
+// Blocking preadv(2) and pwritev(2) on the calling thread
+class SyncIoBackend : public IoBackend {
+ public:
+  void ReadVAt(const PosixFile& file, uint64_t offset,
+               absl::Span<iovec> iov) override;
+
+  void WriteVAt(const PosixFile& file, uint64_t offset,
+                absl::Span<iovec> iov) override;
+};
+
+// With use_io_uring, an io_uring backend whose I/O thread submits the
+// requests of all callers, across files and blocks, in batches and wakes
+// each caller from the completion queue. Falls back to SyncIoBackend where
+// io_uring is not usable, e.g. old kernels or seccomp filtered containers,
+// and once io_uring_enter fails, after throwing from the calls in progress.
+std::unique_ptr<IoBackend> CreateIoBackend(bool use_io_uring);
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
@@ -14,12 +14,32 @@
 
 #include "trustflow/proxy/utils/io_util.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <new>
+#include <system_error>
+
+#include "spdlog/spdlog.h"
+#include "yacl/base/exception.h"
 #include "yacl/io/stream/file_io.h"
 
 namespace trustflow {
 namespace proxy {
 namespace utils {
 
+namespace {
+
+std::string ErrnoMessage() { return std::system_category().message(errno); }
+
+
+}  // namespace
+
 std::string ReadFile(const std::string& file_path) {
   yacl::io::FileInputStream in(file_path);
   std::string content;
@@ -35,6 +55,190 @@ void WriteFile(const std::string& file_path, yacl::ByteContainerView content) {
   out.Close();
 }
 
+size_t TotalBytes(absl::Span<const iovec> iov) {
+  size_t total = 0;
+  for (const auto& v : iov) {
+    total += v.iov_len;
+  }
+  return total;
+}
+
+absl::Span<iovec> AdvanceIovecs(absl::Span<iovec> iov, size_t done) {
+  while (!iov.empty() && done >= iov.front().iov_len) {
+    done -= iov.front().iov_len;
+    iov.remove_prefix(1);
+  }
+  if (done > 0) {
+    iov.front().iov_base = static_cast<uint8_t*>(iov.front().iov_base) + done;
+    iov.front().iov_len -= done;
+  }
+  return iov;
+}
+
+PosixFile::PosixFile(const std::string& path, int flags) : path_(path) {
+  fd_ = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    YACL_THROW_IO_ERROR("Failed to open {}: {}", path, ErrnoMessage());
+  }
+}
+
+PosixFile::~PosixFile() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+}
+
+uint64_t PosixFile::GetLength() const {
+  struct stat st;
+  if (::fstat(fd_, &st) != 0) {
+    YACL_THROW_IO_ERROR("Failed to stat {}: {}", path_, ErrnoMessage());
+  }
+  return st.st_size;
+}
+
+void PosixFile::ReadAt(uint64_t offset, absl::Span<uint8_t> buf) const {
+  size_t done = 0;
+  while (done < buf.size()) {
+    ssize_t ret =
+        ::pread(fd_, buf.data() + done, buf.size() - done, offset + done);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      YACL_THROW_IO_ERROR(
+          "Failed to read {} bytes at {} from {}: {}", buf.size(), offset,
+          path_, ret == 0 ? "unexpected end of file" : ErrnoMessage());
+    }
+    done += ret;
+  }
+}
+
+void PosixFile::WriteAt(uint64_t offset, yacl::ByteContainerView buf) const {
+  size_t done = 0;
+  while (done < buf.size()) {
+    ssize_t ret =
+        ::pwrite(fd_, buf.data() + done, buf.size() - done, offset + done);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret < 0) {
+      YACL_THROW_IO_ERROR("Failed to write {} bytes at {} to {}: {}",
+                          buf.size(), offset, path_, ErrnoMessage());
+    }
+    done += ret;
+  }
+}
+
+void PosixFile::ReadVAt(uint64_t offset, absl::Span<iovec> iov) const {
+  const size_t total = TotalBytes(iov);
+  size_t done = 0;
+  while (!iov.empty()) {
+    ssize_t ret =
+        ::preadv(fd_, iov.data(), std::min<size_t>(iov.size(), IOV_MAX),
+                 offset + done);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      YACL_THROW_IO_ERROR(
+          "Failed to read {} bytes at {} from {}: {}", total, offset, path_,
+          ret == 0 ? "unexpected end of file" : ErrnoMessage());
+    }
+    done += ret;
+    iov = AdvanceIovecs(iov, ret);
+  }
+}
+
+void PosixFile::WriteVAt(uint64_t offset, absl::Span<iovec> iov) const {
+  const size_t total = TotalBytes(iov);
+  size_t done = 0;
+  while (!iov.empty()) {
+    ssize_t ret =
+        ::pwritev(fd_, iov.data(), std::min<size_t>(iov.size(), IOV_MAX),
+                  offset + done);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret < 0) {
+      YACL_THROW_IO_ERROR("Failed to write {} bytes at {} to {}: {}", total,
+                          offset, path_, ErrnoMessage());
+    }
+    done += ret;
+    iov = AdvanceIovecs(iov, ret);
+  }
+}
+
+bool PosixFile::Allocate(uint64_t len) const {
+  bool reserved = len == 0 || ::fallocate(fd_, 0, 0, len) == 0;
+  if (!reserved) {
+    SPDLOG_DEBUG("fallocate {} bytes for {} failed: {}", len, path_,
+                 ErrnoMessage());
+  }
+  if (::ftruncate(fd_, len) != 0) {
+    YACL_THROW_IO_ERROR("Failed to truncate {} to {} bytes: {}", path_, len,
+                        ErrnoMessage());
+  }
+  return reserved;
+}
+
+void PosixFile::Truncate(uint64_t len) const {
+  if (::ftruncate(fd_, len) != 0) {
+    YACL_THROW_IO_ERROR("Failed to truncate {} to {} bytes: {}", path_, len,
+                        ErrnoMessage());
+  }
+}
+
+void PosixFile::Sync() const {
+  if (::fdatasync(fd_) != 0) {
+    YACL_THROW_IO_ERROR("Failed to sync {}: {}", path_, ErrnoMessage());
+  }
+}
+
+void PosixFile::Close() {
+  int fd = fd_;
+  fd_ = -1;
+  if (::close(fd) != 0) {
+    YACL_THROW_IO_ERROR("Failed to close {}: {}", path_, ErrnoMessage());
+  }
+}
+
+void AlignedBuffer::Resize(size_t size) {
+  if (size > capacity_) {
+    // round up as aligned_alloc requires a multiple of the alignment
+    size_t capacity = (size + kAlignment - 1) / kAlignment * kAlignment;
+    auto* ptr = static_cast<uint8_t*>(std::aligned_alloc(kAlignment, capacity));
+    if (ptr == nullptr) {
+      throw std::bad_alloc();
+    }
+    data_.reset(ptr);
+    capacity_ = capacity;
+  }
+  size_ = size;
+}
+
+MappedFile::MappedFile(const PosixFile& file, uint64_t len, bool writable)
+    : len_(len) {
+  // pages past the end of the file raise SIGBUS on access, so a file that
+  // shrank since its length was read must fail here
+  const uint64_t file_len = file.GetLength();
+  if (file_len < len) {
+    YACL_THROW_IO_ERROR("Failed to map {} bytes of {}, it shrank to {} bytes",
+                        len, file.path(), file_len);
+  }
+  void* addr =
+      ::mmap(nullptr, len, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+             MAP_SHARED, file.fd(), 0);
+  if (addr == MAP_FAILED) {
+    YACL_THROW_IO_ERROR("Failed to map {} bytes of {}: {}", len, file.path(),
+                        ErrnoMessage());
+  }
+  data_ = static_cast<uint8_t*>(addr);
+  // blocks are mostly visited in order, let the kernel read ahead
+  ::madvise(data_, len_, MADV_SEQUENTIAL);
+}
+
+MappedFile::~MappedFile() { ::munmap(data_, len_); }
+
 }  // namespace utils
 }  // namespace proxy
-}  // namespace trustflow
\ No newline at end of file
+}  // namespace trustflow
@@ -14,6 +14,13 @@
 
 #pragma once
 
+#include <sys/uio.h>
+
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include "absl/types/span.h"
 #include "yacl/base/byte_container_view.h"
 
 namespace trustflow {
@@ -24,6 +31,96 @@ std::string ReadFile(const std::string& file_path);
 
 void WriteFile(const std::string& file_path, yacl::ByteContainerView content);
 
+size_t TotalBytes(absl::Span<const iovec> iov);
+
+// Drop the first done bytes of iov after a short transfer
+absl::Span<iovec> AdvanceIovecs(absl::Span<iovec> iov, size_t done);
+
+// POSIX file descriptor for positional reads and writes, which lets several
+// threads work on disjoint ranges of one file
+class PosixFile {
+ public:
+  // flags are passed to open(2), created files get mode 0644
+  PosixFile(const std::string& path, int flags);
+
+  PosixFile(const PosixFile&) = delete;
+  PosixFile& operator=(const PosixFile&) = delete;
+
+  ~PosixFile();
+
+  uint64_t GetLength() const;
+
+  // Fill buf from offset, throw if the file ends before
+  void ReadAt(uint64_t offset, absl::Span<uint8_t> buf) const;
+
+  void WriteAt(uint64_t offset, yacl::ByteContainerView buf) const;
+
+  // Vectored ReadAt and WriteAt with as few preadv(2) and pwritev(2) calls
+  // as the IOV_MAX limit allows, iov is consumed
+  void ReadVAt(uint64_t offset, absl::Span<iovec> iov) const;
+
+  void WriteVAt(uint64_t offset, absl::Span<iovec> iov) const;
+
+  // Reserve len bytes of disk space and set the file length to len, the
+  // reservation is best effort as not every file system supports it
+  // Return whether the disk space is reserved
+  bool Allocate(uint64_t len) const;
+
+  // Cut or extend the file to len bytes
+  void Truncate(uint64_t len) const;
+
+  // Flush the written data, including that of shared mappings, to disk
+  void Sync() const;
+
+  int fd() const { return fd_; }
+  const std::string& path() const { return path_; }
+
+  void Close();
+
+ private:
+  std::string path_;
+  int fd_ = -1;
+};
+
+// Page aligned scratch buffer that keeps its memory when resized to a
+// smaller size, so a worker can reuse it without allocating per block
+class AlignedBuffer {
+ public:
+  static constexpr size_t kAlignment = 4096;
+
+  // Content is not kept when growing
+  void Resize(size_t size);
+
+  uint8_t* data() const { return data_.get(); }
+  size_t size() const { return size_; }
+
+ private:
+  struct Free {
+    void operator()(uint8_t* ptr) const { std::free(ptr); }
+  };
+
+  std::unique_ptr<uint8_t[], Free> data_;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+};
+
+// Shared mapping of the first len bytes of a file
+class MappedFile {
+ public:
+  MappedFile(const PosixFile& file, uint64_t len, bool writable);
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile();
+
+  uint8_t* data() const { return data_; }
+
+ private:
+  uint8_t* data_ = nullptr;
+  uint64_t len_ = 0;
+};
+
 }  // namespace utils
 }  // namespace proxy
-}  // namespace trustflow
\ No newline at end of file
+}  // namespace trustflow
@@ -0,0 +1,523 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trustflow/proxy/utils/sm4_gcm.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "openssl/crypto.h"
+#include "yacl/base/exception.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+namespace {
+
+constexpr size_t kBlockBytes = 16;
+constexpr size_t kGcmIvBytes = 12;
+
+uint64_t LoadBigEndian64(const uint8_t* p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; ++i) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+void StoreBigEndian64(uint64_t v, uint8_t* p) {
+  for (int i = 7; i >= 0; --i) {
+    p[i] = static_cast<uint8_t>(v);
+    v >>= 8;
+  }
+}
+
+// Carry-less product of x and y truncated to 64 bits, by integer products
+// of the bits of x and y spread 4 apart, so that the carries of each sum
+// land in the bits in between and are masked off. Runs in constant time
+// where integer multiplication does, unlike tables indexed by secret data.
+uint64_t ClmulLow64(uint64_t x, uint64_t y) {
+  constexpr uint64_t kMask[4] = {0x1111111111111111ULL, 0x2222222222222222ULL,
+                                 0x4444444444444444ULL, 0x8888888888888888ULL};
+  uint64_t xs[4];
+  uint64_t ys[4];
+  for (int i = 0; i < 4; ++i) {
+    xs[i] = x & kMask[i];
+    ys[i] = y & kMask[i];
+  }
+  uint64_t z = 0;
+  for (int i = 0; i < 4; ++i) {
+    uint64_t zi = 0;
+    for (int j = 0; j < 4; ++j) {
+      zi ^= xs[j] * ys[(i - j + 4) % 4];
+    }
+    z |= zi & kMask[i];
+  }
+  return z;
+}
+
+uint64_t ReverseBits64(uint64_t x) {
+  x = ((x & 0x5555555555555555ULL) << 1) | ((x >> 1) & 0x5555555555555555ULL);
+  x = ((x & 0x3333333333333333ULL) << 2) | ((x >> 2) & 0x3333333333333333ULL);
+  x = ((x & 0x0F0F0F0F0F0F0F0FULL) << 4) | ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL);
+  x = ((x & 0x00FF00FF00FF00FFULL) << 8) | ((x >> 8) & 0x00FF00FF00FF00FFULL);
+  x = ((x & 0x0000FFFF0000FFFFULL) << 16) |
+      ((x >> 16) & 0x0000FFFF0000FFFFULL);
+  return (x << 32) | (x >> 32);
+}
+
+// xi = (xi ^ block) * H for blocks blocks by integer multiplication, with
+// H as big endian halves
+// Karatsuba on the 64 bit halves, where the high halves of the products
+// come from the products of the bit reversed operands, then the reduction
+// of the bit reflected GCM field, after the constant time GHASH of BearSSL.
+void GhashInteger(const std::array<uint64_t, 2>& h, const uint8_t* data,
+                  size_t blocks, uint8_t* xi) {
+  const uint64_t h1 = h[0];
+  const uint64_t h0 = h[1];
+  const uint64_t h2 = h0 ^ h1;
+  const uint64_t h0r = ReverseBits64(h0);
+  const uint64_t h1r = ReverseBits64(h1);
+  const uint64_t h2r = h0r ^ h1r;
+  uint64_t y1 = LoadBigEndian64(xi);
+  uint64_t y0 = LoadBigEndian64(xi + 8);
+  for (size_t b = 0; b < blocks; ++b, data += kBlockBytes) {
+    y1 ^= LoadBigEndian64(data);
+    y0 ^= LoadBigEndian64(data + 8);
+    const uint64_t y0r = ReverseBits64(y0);
+    const uint64_t y1r = ReverseBits64(y1);
+    const uint64_t y2 = y0 ^ y1;
+    const uint64_t y2r = y0r ^ y1r;
+    const uint64_t z0 = ClmulLow64(y0, h0);
+    const uint64_t z1 = ClmulLow64(y1, h1);
+    uint64_t z2 = ClmulLow64(y2, h2);
+    uint64_t z0h = ClmulLow64(y0r, h0r);
+    uint64_t z1h = ClmulLow64(y1r, h1r);
+    uint64_t z2h = ClmulLow64(y2r, h2r);
+    z2 ^= z0 ^ z1;
+    z2h ^= z0h ^ z1h;
+    z0h = ReverseBits64(z0h) >> 1;
+    z1h = ReverseBits64(z1h) >> 1;
+    z2h = ReverseBits64(z2h) >> 1;
+
+    // the 256 bit product v3:v2:v1:v0, shifted by one for the reflection
+    uint64_t v0 = z0;
+    uint64_t v1 = z0h ^ z2;
+    uint64_t v2 = z1 ^ z2h;
+    uint64_t v3 = z1h;
+    v3 = (v3 << 1) | (v2 >> 63);
+    v2 = (v2 << 1) | (v1 >> 63);
+    v1 = (v1 << 1) | (v0 >> 63);
+    v0 = v0 << 1;
+
+    // reduction modulo x^128 + x^7 + x^2 + x + 1
+    v2 ^= v0 ^ (v0 >> 1) ^ (v0 >> 2) ^ (v0 >> 7);
+    v1 ^= (v0 << 63) ^ (v0 << 62) ^ (v0 << 57);
+    v3 ^= v1 ^ (v1 >> 1) ^ (v1 >> 2) ^ (v1 >> 7);
+    v2 ^= (v1 << 63) ^ (v1 << 62) ^ (v1 << 57);
+    y0 = v2;
+    y1 = v3;
+  }
+  StoreBigEndian64(y1, xi);
+  StoreBigEndian64(y0, xi + 8);
+}
+
+#if defined(__x86_64__)
+
+// SM4 S-box by the AES one: S(x) = post(AES S-box(pre(x))) for the affine
+// maps pre and post through the isomorphism of GF(2^8) mod
+// x^8 + x^7 + x^6 + x^5 + x^4 + x^2 + 1 onto the AES field taking x to 0x23,
+// each map as tables of its low and high nibble, the constant in the low one
+alignas(16) constexpr uint8_t kSboxPreLo[16] = {
+    0x3E, 0xB2, 0x0E, 0x82, 0xBB, 0x37, 0x8B, 0x07,
+    0xA1, 0x2D, 0x91, 0x1D, 0x24, 0xA8, 0x14, 0x98};
+alignas(16) constexpr uint8_t kSboxPreHi[16] = {
+    0x00, 0xDC, 0x2E, 0xF2, 0xC5, 0x19, 0xEB, 0x37,
+    0x08, 0xD4, 0x26, 0xFA, 0xCD, 0x11, 0xE3, 0x3F};
+alignas(16) constexpr uint8_t kSboxPostLo[16] = {
+    0x6C, 0xD4, 0xA6, 0x1E, 0x52, 0xEA, 0x98, 0x20,
+    0x0B, 0xB3, 0xC1, 0x79, 0x35, 0x8D, 0xFF, 0x47};
+alignas(16) constexpr uint8_t kSboxPostHi[16] = {
+    0x00, 0xE0, 0x50, 0xB0, 0x9D, 0x7D, 0xCD, 0x2D,
+    0xC0, 0x20, 0x90, 0x70, 0x5D, 0xBD, 0x0D, 0xED};
+
+// SM4 key schedule constants
+constexpr uint32_t kSm4Fk[4] = {0xa3b1bac6, 0x56aa3350, 0x677d9197,
+                                0xb27022dc};
+constexpr int kSm4Rounds = 32;
+
+// blocks per SM4 call of the AES instruction path, four groups of four
+// interleaved to hide the latency of the rounds
+constexpr size_t kSm4ParallelBlocks = 16;
+
+__attribute__((target("aes,ssse3"))) inline __m128i AffineNibbles(
+    __m128i x, const uint8_t* lo_table, const uint8_t* hi_table) {
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  const __m128i lo = _mm_and_si128(x, nibble);
+  const __m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), nibble);
+  return _mm_xor_si128(
+      _mm_shuffle_epi8(
+          _mm_load_si128(reinterpret_cast<const __m128i*>(lo_table)), lo),
+      _mm_shuffle_epi8(
+          _mm_load_si128(reinterpret_cast<const __m128i*>(hi_table)), hi));
+}
+
+// SM4 S-box on every byte of x
+__attribute__((target("aes,ssse3"))) inline __m128i Sm4Sbox(__m128i x) {
+  // undo the ShiftRows of AESENCLAST in advance
+  const __m128i inv_shift_rows =
+      _mm_setr_epi8(0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3);
+  x = AffineNibbles(x, kSboxPreLo, kSboxPreHi);
+  x = _mm_aesenclast_si128(_mm_shuffle_epi8(x, inv_shift_rows),
+                           _mm_setzero_si128());
+  return AffineNibbles(x, kSboxPostLo, kSboxPostHi);
+}
+
+__attribute__((target("ssse3"))) inline __m128i RotateLeft2(__m128i x) {
+  return _mm_or_si128(_mm_slli_epi32(x, 2), _mm_srli_epi32(x, 30));
+}
+
+// x0 ^ L(S-box(x1 ^ x2 ^ x3 ^ rk)) on the words of four blocks, where
+// L(b) = b ^ (b <<< 2) ^ (b <<< 10) ^ (b <<< 18) ^ (b <<< 24)
+__attribute__((target("aes,ssse3"))) inline __m128i Sm4Round(
+    __m128i x0, __m128i x1, __m128i x2, __m128i x3, __m128i rk) {
+  const __m128i rotate8 =
+      _mm_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+  const __m128i rotate16 =
+      _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+  const __m128i rotate24 =
+      _mm_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+  const __m128i b = Sm4Sbox(
+      _mm_xor_si128(_mm_xor_si128(x1, x2), _mm_xor_si128(x3, rk)));
+  const __m128i b_8_16 = _mm_xor_si128(
+      b, _mm_xor_si128(_mm_shuffle_epi8(b, rotate8),
+                       _mm_shuffle_epi8(b, rotate16)));
+  return _mm_xor_si128(
+      _mm_xor_si128(x0, b),
+      _mm_xor_si128(_mm_shuffle_epi8(b, rotate24), RotateLeft2(b_8_16)));
+}
+
+uint32_t RotateLeft(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+uint32_t LoadBigEndian32(const uint8_t* p) {
+  return (static_cast<uint32_t>(p[0]) << 24) |
+         (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+__attribute__((target("aes,ssse3"))) void Sm4KeySchedule(
+    const uint8_t* key, std::array<uint32_t, 32>* round_keys) {
+  uint32_t k[4];
+  for (int j = 0; j < 4; ++j) {
+    k[j] = LoadBigEndian32(key + 4 * j) ^ kSm4Fk[j];
+  }
+  for (int i = 0; i < kSm4Rounds; ++i) {
+    // byte j of CK i is (4i + j) * 7 mod 256
+    uint32_t ck = 0;
+    for (int j = 0; j < 4; ++j) {
+      ck = (ck << 8) | (((4 * i + j) * 7) & 0xff);
+    }
+    uint32_t t = k[1] ^ k[2] ^ k[3] ^ ck;
+    t = static_cast<uint32_t>(_mm_cvtsi128_si32(
+        Sm4Sbox(_mm_cvtsi32_si128(static_cast<int>(t)))));
+    const uint32_t rk = k[0] ^ t ^ RotateLeft(t, 13) ^ RotateLeft(t, 23);
+    (*round_keys)[i] = rk;
+    k[0] = k[1];
+    k[1] = k[2];
+    k[2] = k[3];
+    k[3] = rk;
+  }
+}
+
+// SM4 of kSm4ParallelBlocks blocks from in to out
+__attribute__((target("aes,ssse3"))) void Sm4EncryptBlocks(
+    const std::array<uint32_t, 32>& round_keys, const uint8_t* in,
+    uint8_t* out) {
+  constexpr size_t kGroups = kSm4ParallelBlocks / 4;
+  const __m128i swap32 =
+      _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  // x[g][j] holds word j of the four blocks of group g
+  __m128i x[kGroups][4];
+  for (size_t g = 0; g < kGroups; ++g) {
+    __m128i b[4];
+    for (size_t i = 0; i < 4; ++i) {
+      b[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128(
+              reinterpret_cast<const __m128i*>(in + (4 * g + i) * 16)),
+          swap32);
+    }
+    const __m128i t0 = _mm_unpacklo_epi32(b[0], b[1]);
+    const __m128i t1 = _mm_unpacklo_epi32(b[2], b[3]);
+    const __m128i t2 = _mm_unpackhi_epi32(b[0], b[1]);
+    const __m128i t3 = _mm_unpackhi_epi32(b[2], b[3]);
+    x[g][0] = _mm_unpacklo_epi64(t0, t1);
+    x[g][1] = _mm_unpackhi_epi64(t0, t1);
+    x[g][2] = _mm_unpacklo_epi64(t2, t3);
+    x[g][3] = _mm_unpackhi_epi64(t2, t3);
+  }
+  for (int i = 0; i < kSm4Rounds; i += 4) {
+    const __m128i rk0 = _mm_set1_epi32(static_cast<int>(round_keys[i]));
+    const __m128i rk1 = _mm_set1_epi32(static_cast<int>(round_keys[i + 1]));
+    const __m128i rk2 = _mm_set1_epi32(static_cast<int>(round_keys[i + 2]));
+    const __m128i rk3 = _mm_set1_epi32(static_cast<int>(round_keys[i + 3]));
+    for (size_t g = 0; g < kGroups; ++g) {
+      x[g][0] = Sm4Round(x[g][0], x[g][1], x[g][2], x[g][3], rk0);
+    }
+    for (size_t g = 0; g < kGroups; ++g) {
+      x[g][1] = Sm4Round(x[g][1], x[g][2], x[g][3], x[g][0], rk1);
+    }
+    for (size_t g = 0; g < kGroups; ++g) {
+      x[g][2] = Sm4Round(x[g][2], x[g][3], x[g][0], x[g][1], rk2);
+    }
+    for (size_t g = 0; g < kGroups; ++g) {
+      x[g][3] = Sm4Round(x[g][3], x[g][0], x[g][1], x[g][2], rk3);
+    }
+  }
+  for (size_t g = 0; g < kGroups; ++g) {
+    // the output words are X35, X34, X33, X32
+    const __m128i t0 = _mm_unpacklo_epi32(x[g][3], x[g][2]);
+    const __m128i t1 = _mm_unpacklo_epi32(x[g][1], x[g][0]);
+    const __m128i t2 = _mm_unpackhi_epi32(x[g][3], x[g][2]);
+    const __m128i t3 = _mm_unpackhi_epi32(x[g][1], x[g][0]);
+    const __m128i b[4] = {
+        _mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1),
+        _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3)};
+    for (size_t i = 0; i < 4; ++i) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + (4 * g + i) * 16),
+                       _mm_shuffle_epi8(b[i], swap32));
+    }
+  }
+}
+
+// a * b in GF(2^128) on byte reversed operands, from the Intel carry-less
+// multiplication white paper of Gueron and Kounavis
+__attribute__((target("pclmul,ssse3"))) __m128i GfMul(__m128i a, __m128i b) {
+  __m128i lo = _mm_clmulepi64_si128(a, b, 0x00);
+  __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10),
+                              _mm_clmulepi64_si128(a, b, 0x01));
+  __m128i hi = _mm_clmulepi64_si128(a, b, 0x11);
+  lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+  hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+  // shift the 256 bit product left by one for the bit reflection
+  __m128i lo_carry = _mm_srli_epi32(lo, 31);
+  __m128i hi_carry = _mm_srli_epi32(hi, 31);
+  lo = _mm_slli_epi32(lo, 1);
+  hi = _mm_slli_epi32(hi, 1);
+  __m128i cross = _mm_srli_si128(lo_carry, 12);
+  hi_carry = _mm_slli_si128(hi_carry, 4);
+  lo_carry = _mm_slli_si128(lo_carry, 4);
+  lo = _mm_or_si128(lo, lo_carry);
+  hi = _mm_or_si128(_mm_or_si128(hi, hi_carry), cross);
+
+  // reduce modulo x^128 + x^7 + x^2 + x + 1
+  __m128i t = _mm_xor_si128(
+      _mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)),
+      _mm_slli_epi32(lo, 25));
+  __m128i t_hi = _mm_srli_si128(t, 4);
+  lo = _mm_xor_si128(lo, _mm_slli_si128(t, 12));
+  __m128i u = _mm_xor_si128(
+      _mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)),
+      _mm_xor_si128(_mm_srli_epi32(lo, 7), t_hi));
+  return _mm_xor_si128(hi, _mm_xor_si128(lo, u));
+}
+
+// xi = (xi ^ block) * H with carry-less multiplication, for blocks blocks
+__attribute__((target("pclmul,ssse3"))) void GhashClmul(
+    const uint8_t* h_reversed, const uint8_t* data, size_t blocks,
+    uint8_t* xi) {
+  const __m128i reverse =
+      _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  const __m128i h =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(h_reversed));
+  __m128i x = _mm_shuffle_epi8(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(xi)), reverse);
+  for (size_t b = 0; b < blocks; ++b, data += kBlockBytes) {
+    __m128i block = _mm_shuffle_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data)), reverse);
+    x = GfMul(_mm_xor_si128(x, block), h);
+  }
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(xi),
+                   _mm_shuffle_epi8(x, reverse));
+}
+
+#endif
+
+bool UseAesni() {
+#if defined(__x86_64__)
+  static const bool use_aesni =
+      __builtin_cpu_supports("aes") && __builtin_cpu_supports("ssse3");
+  return use_aesni;
+#else
+  return false;
+#endif
+}
+
+bool UseClmul() {
+#if defined(__x86_64__)
+  static const bool use_clmul = __builtin_cpu_supports("pclmul");
+  return use_clmul;
+#else
+  return false;
+#endif
+}
+
+}  // namespace
+
+Sm4Gcm::Sm4Gcm(yacl::ByteContainerView key, bool use_cpu_instructions)
+    : use_aesni_(use_cpu_instructions && UseAesni()),
+      use_clmul_(use_cpu_instructions && UseClmul()),
+      ctr_ctx_(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free) {
+  YACL_ENFORCE_EQ(key.size(), kSm4KeyLen, "SM4 key size error");
+  if (use_aesni_) {
+#if defined(__x86_64__)
+    Sm4KeySchedule(key.data(), &round_keys_);
+#endif
+  } else {
+    YACL_ENFORCE(ctr_ctx_ != nullptr, "EVP_CIPHER_CTX_new failed");
+    // expand the key once, each block only sets its counter later
+    YACL_ENFORCE_EQ(EVP_EncryptInit_ex(ctr_ctx_.get(), EVP_sm4_ctr(),
+                                       nullptr, key.data(), nullptr),
+                    1);
+  }
+
+  const Block h = EncryptBlock(Block{});
+  std::reverse_copy(h.begin(), h.end(), h_reversed_.begin());
+  h_words_ = {LoadBigEndian64(h.data()), LoadBigEndian64(h.data() + 8)};
+}
+
+void Sm4Gcm::Encrypt(yacl::ByteContainerView iv, yacl::ByteContainerView aad,
+                     yacl::ByteContainerView plaintext,
+                     absl::Span<uint8_t> ciphertext,
+                     absl::Span<uint8_t> tag) {
+  YACL_ENFORCE_EQ(iv.size(), kGcmIvBytes, "IV length error");
+  YACL_ENFORCE_EQ(tag.size(), kBlockBytes, "MAC length error");
+  // J0 = iv || 1 masks the tag, the text starts at iv || 2
+  Block counter{};
+  std::copy(iv.begin(), iv.end(), counter.begin());
+  counter[kBlockBytes - 1] = 2;
+  ApplyCounter(counter, plaintext, ciphertext);
+  counter[kBlockBytes - 1] = 1;
+  const Block computed = Tag(counter, aad, ciphertext);
+  std::copy(computed.begin(), computed.end(), tag.begin());
+}
+
+bool Sm4Gcm::Decrypt(yacl::ByteContainerView iv, yacl::ByteContainerView aad,
+                     yacl::ByteContainerView ciphertext,
+                     yacl::ByteContainerView tag,
+                     absl::Span<uint8_t> plaintext) {
+  YACL_ENFORCE_EQ(iv.size(), kGcmIvBytes, "IV length error");
+  YACL_ENFORCE_EQ(tag.size(), kBlockBytes, "MAC length error");
+  Block counter{};
+  std::copy(iv.begin(), iv.end(), counter.begin());
+  counter[kBlockBytes - 1] = 1;
+  const Block computed = Tag(counter, aad, ciphertext);
+  if (CRYPTO_memcmp(computed.data(), tag.data(), kBlockBytes) != 0) {
+    return false;
+  }
+  counter[kBlockBytes - 1] = 2;
+  ApplyCounter(counter, ciphertext, plaintext);
+  return true;
+}
+
+Sm4Gcm::Block Sm4Gcm::EncryptBlock(const Block& in) {
+  Block out{};
+  ApplyCounter(in, out, absl::MakeSpan(out));
+  return out;
+}
+
+void Sm4Gcm::ApplyCounter(const Block& counter, yacl::ByteContainerView in,
+                          absl::Span<uint8_t> out) {
+  YACL_ENFORCE_EQ(out.size(), in.size(), "Counter output size mismatch");
+  if (!use_aesni_) {
+    // OpenSSL carries into all 128 bits, which matches the low 32 bits of
+    // GCM as long as a data block stays far below 64 GiB
+    int out_len = 0;
+    YACL_ENFORCE(
+        EVP_EncryptInit_ex(ctr_ctx_.get(), nullptr, nullptr, nullptr,
+                           counter.data()) == 1 &&
+            EVP_EncryptUpdate(ctr_ctx_.get(), out.data(), &out_len,
+                              in.data(), static_cast<int>(in.size())) == 1,
+        "SM4-CTR failed");
+    return;
+  }
+#if defined(__x86_64__)
+  constexpr size_t kChunkBytes = kSm4ParallelBlocks * kBlockBytes;
+  uint8_t counters[kChunkBytes];
+  uint8_t key_stream[kChunkBytes];
+  for (size_t i = 0; i < kSm4ParallelBlocks; ++i) {
+    std::copy(counter.begin(), counter.end(), counters + i * kBlockBytes);
+  }
+  uint32_t next = LoadBigEndian32(counter.data() + 12);
+  for (size_t offset = 0; offset < in.size(); offset += kChunkBytes) {
+    for (size_t i = 0; i < kSm4ParallelBlocks; ++i, ++next) {
+      uint8_t* word = counters + i * kBlockBytes + 12;
+      word[0] = static_cast<uint8_t>(next >> 24);
+      word[1] = static_cast<uint8_t>(next >> 16);
+      word[2] = static_cast<uint8_t>(next >> 8);
+      word[3] = static_cast<uint8_t>(next);
+    }
+    Sm4EncryptBlocks(round_keys_, counters, key_stream);
+    const size_t len = std::min(kChunkBytes, in.size() - offset);
+    for (size_t i = 0; i < len; ++i) {
+      out[offset + i] = in[offset + i] ^ key_stream[i];
+    }
+  }
+#endif
+}
+
+Sm4Gcm::Block Sm4Gcm::Tag(const Block& iv_block, yacl::ByteContainerView aad,
+                          yacl::ByteContainerView ciphertext) {
+  Block xi{};
+  Ghash(aad, &xi);
+  Ghash(ciphertext, &xi);
+  Block lens{};
+  StoreBigEndian64(static_cast<uint64_t>(aad.size()) * 8, lens.data());
+  StoreBigEndian64(static_cast<uint64_t>(ciphertext.size()) * 8,
+                   lens.data() + 8);
+  Ghash(lens, &xi);
+  const Block mask = EncryptBlock(iv_block);
+  for (size_t i = 0; i < kBlockBytes; ++i) {
+    xi[i] ^= mask[i];
+  }
+  return xi;
+}
+
+void Sm4Gcm::Ghash(yacl::ByteContainerView data, Block* xi) const {
+  const size_t full_blocks = data.size() / kBlockBytes;
+  const size_t tail = data.size() % kBlockBytes;
+  Block last{};
+  if (tail != 0) {
+    std::memcpy(last.data(), data.data() + full_blocks * kBlockBytes, tail);
+  }
+  const size_t last_blocks = tail == 0 ? 0 : 1;
+#if defined(__x86_64__)
+  if (use_clmul_) {
+    GhashClmul(h_reversed_.data(), data.data(), full_blocks, xi->data());
+    GhashClmul(h_reversed_.data(), last.data(), last_blocks, xi->data());
+    return;
+  }
+#endif
+  GhashInteger(h_words_, data.data(), full_blocks, xi->data());
+  GhashInteger(h_words_, last.data(), last_blocks, xi->data());
+}
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
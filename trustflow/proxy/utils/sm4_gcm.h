@@ -0,0 +1,89 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+
+#include "absl/types/span.h"
+#include "openssl/evp.h"
+#include "yacl/base/byte_container_view.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+constexpr uint8_t kSm4KeyLen = 16;
+
+// SM4-GCM of RFC 8998, GCM of NIST SP 800-38D over the SM4 block cipher,
+// with 12 byte IVs and 16 byte tags
+//
+// On x86 CPUs with AES instructions, such as the Hygon ones, SM4 runs four
+// blocks at a time with its S-box computed by AESENCLAST between two affine
+// maps, the SM4 and AES S-boxes both being affine over inversion in
+// GF(2^8). Elsewhere it runs in counter mode through OpenSSL, which uses the
+// SM4 instructions of the CPU where its build has them and its table based
+// SM4 otherwise, whose S-box lookups are not constant time. GHASH uses
+// carry-less multiplication where the CPU has it and constant time integer
+// multiplication otherwise.
+// Not thread safe, every thread should own its engine.
+class Sm4Gcm {
+ public:
+  // With use_cpu_instructions false, SM4 runs through OpenSSL and GHASH on
+  // integer multiplication whatever the CPU, which tests compare against
+  explicit Sm4Gcm(yacl::ByteContainerView key,
+                  bool use_cpu_instructions = true);
+
+  void Encrypt(yacl::ByteContainerView iv, yacl::ByteContainerView aad,
+               yacl::ByteContainerView plaintext,
+               absl::Span<uint8_t> ciphertext, absl::Span<uint8_t> tag);
+
+  // Return whether tag matches, plaintext is undefined otherwise
+  bool Decrypt(yacl::ByteContainerView iv, yacl::ByteContainerView aad,
+               yacl::ByteContainerView ciphertext, yacl::ByteContainerView tag,
+               absl::Span<uint8_t> plaintext);
+
+ private:
+  using Block = std::array<uint8_t, 16>;
+  using UniqueCipherCtx =
+      std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)>;
+
+  Block EncryptBlock(const Block& in);
+  // Counter mode from counter, which increments in its low 32 bits
+  void ApplyCounter(const Block& counter, yacl::ByteContainerView in,
+                    absl::Span<uint8_t> out);
+  Block Tag(const Block& iv_block, yacl::ByteContainerView aad,
+            yacl::ByteContainerView ciphertext);
+
+  // xi = (xi ^ data) * H for each 16 byte block of data, the last one
+  // padded with zeros
+  void Ghash(yacl::ByteContainerView data, Block* xi) const;
+
+  bool use_aesni_;
+  bool use_clmul_;
+  // round keys of the AES instruction path
+  std::array<uint32_t, 32> round_keys_;
+  // SM4-CTR of the OpenSSL path
+  UniqueCipherCtx ctr_ctx_;
+  // H byte reversed, as the carry-less multiplication takes it
+  Block h_reversed_;
+  // H as big endian high and low halves, as the integer GHASH takes it
+  std::array<uint64_t, 2> h_words_;
+};
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
@@ -0,0 +1,162 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trustflow/proxy/utils/sm4_gcm.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "absl/strings/escaping.h"
+#include "gtest/gtest.h"
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+namespace {
+
+std::vector<uint8_t> FromHex(const std::string& hex) {
+  const std::string bytes = absl::HexStringToBytes(hex);
+  return std::vector<uint8_t>(bytes.begin(), bytes.end());
+}
+
+std::vector<uint8_t> RandomBytes(std::mt19937* rng, size_t len) {
+  std::vector<uint8_t> bytes(len);
+  for (auto& b : bytes) {
+    b = static_cast<uint8_t>((*rng)());
+  }
+  return bytes;
+}
+
+}  // namespace
+
+// The parameter is use_cpu_instructions, false runs the OpenSSL SM4 and the
+// integer GHASH on every host
+class Sm4GcmTest : public ::testing::TestWithParam<bool> {};
+
+// RFC 8998 appendix A.1
+TEST_P(Sm4GcmTest, Rfc8998Vector) {
+  const auto key = FromHex("0123456789ABCDEFFEDCBA9876543210");
+  const auto iv = FromHex("00001234567800000000ABCD");
+  const auto aad = FromHex("FEEDFACEDEADBEEFFEEDFACEDEADBEEFABADDAD2");
+  const auto plaintext = FromHex(
+      "AAAAAAAAAAAAAAAABBBBBBBBBBBBBBBBCCCCCCCCCCCCCCCCDDDDDDDDDDDDDDDD"
+      "EEEEEEEEEEEEEEEEFFFFFFFFFFFFFFFFEEEEEEEEEEEEEEEEAAAAAAAAAAAAAAAA");
+  const auto expected_ciphertext = FromHex(
+      "17F399F08C67D5EE19D0DC9969C4BB7D5FD46FD3756489069157B282BB200735"
+      "D82710CA5C22F0CCFA7CBF93D496AC15A56834CBCF98C397B4024A2691233B8D");
+  const auto expected_tag = FromHex("83DE3541E4C2B58177E065A9BF7B62EC");
+
+  Sm4Gcm gcm(key, GetParam());
+  std::vector<uint8_t> ciphertext(plaintext.size());
+  std::vector<uint8_t> tag(16);
+  gcm.Encrypt(iv, aad, plaintext, absl::MakeSpan(ciphertext),
+              absl::MakeSpan(tag));
+  EXPECT_EQ(ciphertext, expected_ciphertext);
+  EXPECT_EQ(tag, expected_tag);
+
+  std::vector<uint8_t> decrypted(ciphertext.size());
+  ASSERT_TRUE(
+      gcm.Decrypt(iv, aad, ciphertext, tag, absl::MakeSpan(decrypted)));
+  EXPECT_EQ(decrypted, plaintext);
+}
+
+TEST_P(Sm4GcmTest, RejectsTampering) {
+  std::mt19937 rng(1);
+  const auto key = RandomBytes(&rng, kSm4KeyLen);
+  const auto iv = RandomBytes(&rng, 12);
+  const auto aad = RandomBytes(&rng, 20);
+  const auto plaintext = RandomBytes(&rng, 100);
+  Sm4Gcm gcm(key, GetParam());
+  std::vector<uint8_t> ciphertext(plaintext.size());
+  std::vector<uint8_t> tag(16);
+  gcm.Encrypt(iv, aad, plaintext, absl::MakeSpan(ciphertext),
+              absl::MakeSpan(tag));
+  std::vector<uint8_t> decrypted(plaintext.size());
+
+  for (size_t i = 0; i < tag.size(); ++i) {
+    auto bad_tag = tag;
+    bad_tag[i] ^= 0x80;
+    EXPECT_FALSE(
+        gcm.Decrypt(iv, aad, ciphertext, bad_tag, absl::MakeSpan(decrypted)))
+        << "tag byte " << i;
+  }
+  for (size_t i = 0; i < ciphertext.size(); ++i) {
+    auto bad_ciphertext = ciphertext;
+    bad_ciphertext[i] ^= 1;
+    EXPECT_FALSE(gcm.Decrypt(iv, aad, bad_ciphertext, tag,
+                             absl::MakeSpan(decrypted)))
+        << "ciphertext byte " << i;
+  }
+  for (size_t i = 0; i < aad.size(); ++i) {
+    auto bad_aad = aad;
+    bad_aad[i] ^= 1;
+    EXPECT_FALSE(
+        gcm.Decrypt(iv, bad_aad, ciphertext, tag, absl::MakeSpan(decrypted)))
+        << "aad byte " << i;
+  }
+  auto bad_iv = iv;
+  bad_iv[0] ^= 1;
+  EXPECT_FALSE(
+      gcm.Decrypt(bad_iv, aad, ciphertext, tag, absl::MakeSpan(decrypted)));
+  EXPECT_FALSE(gcm.Decrypt(iv, aad,
+                           yacl::ByteContainerView(ciphertext.data(),
+                                                   ciphertext.size() - 1),
+                           tag, absl::MakeSpan(decrypted.data(),
+                                               decrypted.size() - 1)));
+  Sm4Gcm other(RandomBytes(&rng, kSm4KeyLen), GetParam());
+  EXPECT_FALSE(
+      other.Decrypt(iv, aad, ciphertext, tag, absl::MakeSpan(decrypted)));
+}
+
+INSTANTIATE_TEST_SUITE_P(CpuInstructions, Sm4GcmTest, ::testing::Bool());
+
+// The CPU instruction paths against the portable one, across lengths that
+// cover partial blocks and the 16 block chunks of the AES instruction path
+TEST(Sm4GcmCrossTest, PathsAgree) {
+  std::mt19937 rng(2);
+  const auto key = RandomBytes(&rng, kSm4KeyLen);
+  Sm4Gcm fast(key);
+  Sm4Gcm portable(key, false);
+  std::vector<size_t> lens;
+  for (size_t len = 0; len <= 600; ++len) {
+    lens.push_back(len);
+  }
+  lens.insert(lens.end(), {4095, 4096, 4097, 65536 + 7});
+  for (size_t len : lens) {
+    const auto iv = RandomBytes(&rng, 12);
+    const auto aad = RandomBytes(&rng, len % 37);
+    const auto plaintext = RandomBytes(&rng, len);
+    std::vector<uint8_t> fast_ciphertext(len);
+    std::vector<uint8_t> fast_tag(16);
+    fast.Encrypt(iv, aad, plaintext, absl::MakeSpan(fast_ciphertext),
+                 absl::MakeSpan(fast_tag));
+    std::vector<uint8_t> portable_ciphertext(len);
+    std::vector<uint8_t> portable_tag(16);
+    portable.Encrypt(iv, aad, plaintext, absl::MakeSpan(portable_ciphertext),
+                     absl::MakeSpan(portable_tag));
+    ASSERT_EQ(fast_ciphertext, portable_ciphertext) << "length " << len;
+    ASSERT_EQ(fast_tag, portable_tag) << "length " << len;
+
+    std::vector<uint8_t> decrypted(len);
+    ASSERT_TRUE(portable.Decrypt(iv, aad, fast_ciphertext, fast_tag,
+                                 absl::MakeSpan(decrypted)));
+    ASSERT_EQ(decrypted, plaintext) << "length " << len;
+  }
+}
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
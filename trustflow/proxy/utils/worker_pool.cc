@@ -0,0 +1,157 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trustflow/proxy/utils/worker_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+namespace {
+
+// pool and index of the worker running on this thread
+thread_local const WorkerPool* current_pool = nullptr;
+thread_local size_t current_index = 0;
+
+}  // namespace
+
+WorkerPool::WorkerPool(size_t num_threads, size_t max_queued)
+    : max_queued_(std::max<size_t>(1, max_queued)) {
+  num_threads = std::max<size_t>(1, num_threads);
+  for (size_t i = 0; i < num_threads; ++i) {
+    workers_.emplace_back(std::make_unique<Worker>());
+  }
+  // start after all workers exist, as they steal from each other
+  for (size_t i = 0; i < num_threads; ++i) {
+    workers_[i]->thread = std::thread(&WorkerPool::Run, this, i);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  task_cv_.notify_all();
+  done_cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker->thread.join();
+  }
+}
+
+bool WorkerPool::InWorker() const { return current_pool == this; }
+
+bool WorkerPool::Submit(std::function<void()> task) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (InWorker()) {
+      if (error_ || stopping_) {
+        return false;
+      }
+      workers_[current_index]->tasks.push_back(std::move(task));
+    } else {
+      done_cv_.wait(lock, [this] {
+        return error_ || stopping_ || shared_tasks_.size() < max_queued_;
+      });
+      if (error_ || stopping_) {
+        return false;
+      }
+      shared_tasks_.push_back(std::move(task));
+    }
+    ++queued_;
+  }
+  task_cv_.notify_one();
+  return true;
+}
+
+void WorkerPool::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] {
+    return (queued_ == 0 || error_) && running_ == 0;
+  });
+  if (error_) {
+    std::rethrow_exception(std::exchange(error_, nullptr));
+  }
+}
+
+bool WorkerPool::PopTask(size_t index, std::function<void()>* task) {
+  auto& own = workers_[index]->tasks;
+  if (!own.empty()) {
+    *task = std::move(own.back());
+    own.pop_back();
+    return true;
+  }
+  for (size_t i = 1; i < workers_.size(); ++i) {
+    auto& victim = workers_[(index + i) % workers_.size()]->tasks;
+    if (!victim.empty()) {
+      *task = std::move(victim.front());
+      victim.pop_front();
+      return true;
+    }
+  }
+  if (!shared_tasks_.empty()) {
+    *task = std::move(shared_tasks_.front());
+    shared_tasks_.pop_front();
+    // a producer may wait for the free slot
+    done_cv_.notify_all();
+    return true;
+  }
+  return false;
+}
+
+void WorkerPool::Run(size_t index) {
+  current_pool = this;
+  current_index = index;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    std::function<void()> task;
+    task_cv_.wait(lock, [&] { return stopping_ || PopTask(index, &task); });
+    if (stopping_) {
+      return;
+    }
+    --queued_;
+    ++running_;
+    lock.unlock();
+
+    std::exception_ptr error;
+    try {
+      task();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    // release what the task holds before Wait may return
+    task = nullptr;
+
+    lock.lock();
+    --running_;
+    if (error && !error_) {
+      // skip the queued tasks, the first failure is what Wait reports
+      error_ = error;
+      shared_tasks_.clear();
+      for (auto& worker : workers_) {
+        worker->tasks.clear();
+      }
+      queued_ = 0;
+    }
+    done_cv_.notify_all();
+  }
+}
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow
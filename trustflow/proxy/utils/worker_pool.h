@@ -0,0 +1,89 @@
+// Copyright 2024 Ant Group Co., Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace trustflow {
+namespace proxy {
+namespace utils {
+
+// Work stealing pool of a fixed set of threads.
+// Tasks submitted from outside go to a shared queue, where Submit blocks
+// while max_queued tasks are waiting, so a producer that outpaces the
+// workers holds at most num_threads + max_queued tasks at a time. Tasks
+// submitted by a running task go to the deque of its worker without
+// blocking. An idle worker takes the newest task of its own deque, then
+// steals the oldest task of another worker, then takes from the shared
+// queue. Tasks are expected to be coarse, one lock guards all queues.
+class WorkerPool {
+ public:
+  WorkerPool(size_t num_threads, size_t max_queued);
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  // Drop the queued tasks and wait for the running ones
+  ~WorkerPool();
+
+  // Queue task, see above for where it goes
+  // Return false without queuing once a task has failed, so that producers
+  // can stop early
+  bool Submit(std::function<void()> task);
+
+  // Wait until all submitted tasks are done, rethrow the first failure
+  void Wait();
+
+  size_t num_threads() const { return workers_.size(); }
+
+  // Whether the calling thread is a worker of this pool
+  bool InWorker() const;
+
+ private:
+  struct Worker {
+    std::deque<std::function<void()>> tasks;
+    std::thread thread;
+  };
+
+  // Take the next task for worker index, mutex_ must be held
+  bool PopTask(size_t index, std::function<void()>* task);
+
+  void Run(size_t index);
+
+  std::mutex mutex_;
+  // signals workers about new tasks and stop
+  std::condition_variable task_cv_;
+  // signals producers about free queue slots and Wait about idle workers
+  std::condition_variable done_cv_;
+  std::deque<std::function<void()>> shared_tasks_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  size_t max_queued_ = 0;
+  // tasks in all queues
+  size_t queued_ = 0;
+  size_t running_ = 0;
+  bool stopping_ = false;
+  std::exception_ptr error_;
+};
+
+}  // namespace utils
+}  // namespace proxy
+}  // namespace trustflow